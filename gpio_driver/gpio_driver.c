@@ -3,6 +3,7 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/fcntl.h>
@@ -15,10 +16,30 @@
 #include <linux/gpio.h>
 #include <linux/delay.h>
 #include <linux/jiffies.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/smp.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/irq.h>
 
+#include "gpio_driver.h"
+
+#define CREATE_TRACE_POINTS
+#include "gpio_driver_trace.h"
+
 /* Driver Doc.*/
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -36,9 +57,9 @@ MODULE_DESCRIPTION("Driver for Simon Game");
 //       total system ram is 0x3F000000 (1GB - 16MB)
 //       instead of 0x20000000 (512 MB)
 
-/* GPIO registers base address. */
+/* GPIO registers base address, the peripheral base is the peri_base parameter. */
 #define BCM2708_PERI_BASE   (0x3F000000)
-#define GPIO_BASE           (BCM2708_PERI_BASE + 0x200000)
+#define GPIO_BASE_OFFSET    (0x200000)
 #define GPIO_ADDR_SPACE_LEN (0xB4)
 //--
 
@@ -145,23 +166,56 @@ typedef enum {GPIO_DIRECTION_IN = 0, GPIO_DIRECTION_OUT = 1} DIRECTION;
 #define GPIO_26 (26)
 #define GPIO_27 (27)
 
+/* Number of GPIO lines of the controller. */
+#define GPIO_PIN_COUNT (54)
+
+/* Registers of a GPIO pin, precomputed for every pin at init. */
+struct gpio_pin_regs
+{
+    u16 fsel;               /* GPFSELn offset. */
+    u8 fsel_shift;          /* Position of the pin function bits in GPFSELn. */
+    u8 bank;                /* 0 for GPIO 0-31, 1 for GPIO 32-53. */
+    u16 set;                /* GPSETn offset. */
+    u16 clr;                /* GPCLRn offset. */
+    u16 lev;                /* GPLEVn offset. */
+    u16 pudclk;             /* GPPUDCLKn offset. */
+    u32 mask;               /* Bit of the pin in the GPSETn/GPCLRn/GPLEVn/GPPUDCLKn bank. */
+};
+
+static struct gpio_pin_regs gpio_pin_regs[GPIO_PIN_COUNT];
+
 #define DEVICE_NAME "gpio_driver"
 
+/* LEDs and buttons in the pin group of an instance. */
+#define GPIO_GROUP_SIZE (4)
+
+/* Most instances (minors) served by the module. */
+#define GPIO_MAX_INSTANCES (4)
+
 /* Declaration of gpio_driver.c functions */
-int gpio_driver_init(void);
-void gpio_driver_exit(void);
+static int gpio_driver_init(void);
+static void gpio_driver_exit(void);
 static int gpio_driver_open(struct inode *, struct file *);
 static int gpio_driver_release(struct inode *, struct file *);
-static ssize_t gpio_driver_read(struct file *, char *buf, size_t , loff_t *);
-static ssize_t gpio_driver_write(struct file *, const char *buf, size_t , loff_t *);
+static ssize_t gpio_driver_read(struct file *, char __user *buf, size_t , loff_t *);
+static ssize_t gpio_driver_write(struct file *, const char __user *buf, size_t , loff_t *);
+static __poll_t gpio_driver_poll(struct file *, poll_table *);
+static int gpio_driver_mmap(struct file *, struct vm_area_struct *);
+static long gpio_driver_ioctl(struct file *, unsigned int, unsigned long);
 
 /* Structure that declares the usual file access functions. */
-struct file_operations gpio_driver_fops =
+static const struct file_operations gpio_driver_fops =
 {
+    owner   :   THIS_MODULE,
     open    :   gpio_driver_open,
     release :   gpio_driver_release,
     read    :   gpio_driver_read,
-    write   :   gpio_driver_write
+    write   :   gpio_driver_write,
+    poll    :   gpio_driver_poll,
+    mmap    :   gpio_driver_mmap,
+    unlocked_ioctl : gpio_driver_ioctl,
+    compat_ioctl   : compat_ptr_ioctl,
+    llseek  :   no_llseek
 };
 
 /* Declaration of the init and exit functions. */
@@ -170,87 +224,266 @@ module_exit(gpio_driver_exit);
 
 /* Global variables of the driver */
 
-/* IRQ Number */
-unsigned int GPIO_12_irq_Number = 0;
-unsigned int GPIO_16_irq_Number = 0;
-unsigned int GPIO_20_irq_Number = 0;
-unsigned int GPIO_21_irq_Number = 0;
+struct gpio_instance;
+
+/* LED pulse acknowledging a button press, switched off from an hrtimer. */
+struct gpio_led_pulse
+{
+    struct gpio_instance *inst; /* Instance the LED belongs to. */
+    struct hrtimer timer;
+    char pin;
+};
+
+/*
+ * Defaults of the instance configuration, which GPIO_IOC_SET_CONFIG changes
+ * for a single instance at runtime.
+ */
+
+/* Length of the LED pulse acknowledging a press in milliseconds. */
+static unsigned int pulse_ms = 100;
+module_param(pulse_ms, uint, 0444);
+MODULE_PARM_DESC(pulse_ms, "LED pulse length on button press in ms, 0 disables it");
 
-/* Save Flag */
-static unsigned long flag = 0;
+/* Button input line with its own debouncing state. */
+struct gpio_button
+{
+    struct gpio_instance *inst; /* Instance the button belongs to. */
+    char pin;               /* Switch GPIO line. */
+    char led;               /* LED lit by the button. */
+    u32 number;             /* Button number reported to user space (1-4). */
+    unsigned int irq;       /* IRQ number of the switch line. */
+    u64 last_ns;            /* Time of the last accepted press. */
+    u64 edge_ns;            /* Time of the edge waiting for level confirmation. */
+    u32 edge_seq;           /* Edges of the line, only its IRQ handler writes it. */
+    u32 confirm_seq;        /* Number of the edge waiting for level confirmation. */
+    unsigned long pending;  /* Bit 0 set while edge_ns waits for confirmation. */
+    struct hrtimer confirm; /* Samples the line level confirm_us after the edge. */
+};
+
+/* Minimal time between two accepted presses of the same button in microseconds. */
+static unsigned int debounce_us = 30000;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "Per button debounce window in us");
+
+/* Delay after the edge at which the line has to be still low, 0 disables it. */
+static unsigned int confirm_us = 0;
+module_param(confirm_us, uint, 0444);
+MODULE_PARM_DESC(confirm_us, "Confirm the press by sampling the level this many us after the edge, 0 disables it");
+
+/* LED pattern played from an hrtimer, see GPIO_CMD_PLAY. */
+struct gpio_playback
+{
+    struct hrtimer timer;
+    struct gpio_play_step steps[GPIO_PLAY_MAX_STEPS];
+    u32 count;              /* Number of steps in the pattern. */
+    u32 index;              /* Step being played. */
+    int lit;                /* Step LEDs are lit, the off phase follows. */
+    int running;            /* Pattern is being played. */
+
+    /* Overshoot of the step deadlines, see struct gpio_play_stats. */
+    atomic64_t deadlines;
+    atomic64_t late_ns_total;
+    atomic64_t late_ns_max;
+    atomic64_t last_deadlines;
+    atomic64_t last_late_ns_total;
+    atomic64_t last_late_ns_max;
+};
+
+/* PWM tick of the animations which do not set their own, see GPIO_IOC_ANIMATE. */
+static unsigned int pwm_tick_us = 125;
+module_param(pwm_tick_us, uint, 0644);
+MODULE_PARM_DESC(pwm_tick_us, "Default software PWM tick of the LED animations in us");
 
-/* For Debouncing*/
-extern unsigned long volatile jiffies;
-unsigned long old_jiffie = 0;
+/* LED animation rendered with software PWM from an hrtimer, see GPIO_IOC_ANIMATE. */
+struct gpio_animation_state
+{
+    struct hrtimer timer;   /* Single timer servicing all LEDs of the instance. */
+    struct gpio_anim_frame frames[GPIO_ANIM_MAX_FRAMES];
+    u32 count;              /* Number of frames in the animation. */
+    u32 index;              /* Frame being played. */
+    u8 from[GPIO_GROUP_SIZE]; /* Levels the frame fades from. */
+    ktime_t frame_start;    /* Timer expiry at which the frame started. */
+    ktime_t tick;           /* Timer period. */
+    u32 phase;              /* Tick within the PWM period. */
+    u32 lit;                /* LEDs lit by the last tick. */
+    int running;            /* Animation is being played. */
+
+    /* Scheduling statistics, see struct gpio_anim_stats. */
+    u32 tick_us;
+    atomic64_t ticks;
+    atomic64_t late_ns_total;
+    atomic64_t late_ns_max;
+    atomic64_t overruns;
+};
 
-/* Major number. */
-int gpio_driver_major;
+/* Expected input uploaded with GPIO_IOC_EXPECT. */
+struct gpio_expect_state
+{
+    u8 buttons[GPIO_EXPECT_MAX];
+    u32 count;              /* Number of expected presses, 0 while verification is off. */
+    u32 index;              /* Presses verified so far. */
+    u32 flags;              /* GPIO_EXPECT_F_* */
+    struct gpio_feedback wrong;
+    struct gpio_feedback complete;
+    struct gpio_feedback feedback;  /* Pattern picked by the last verdict. */
+    struct gpio_play_step pattern[GPIO_PLAY_MAX_STEPS];
+    struct work_struct work;        /* Starts the feedback pattern, outside of the IRQ. */
+    int feedback_pending;           /* Work queued, keeps playback.running set. Under expect_lock. */
+};
 
-/* Buffer to store data. */
+/* Length of the text commands and of a read() chunk. */
 #define BUF_LEN 80
-char* gpio_driver_buffer;
-char* gpio_sequnce_buffer;
 
+/* Log2 histogram buckets, bucket n counts times of 2^n to 2^(n+1) - 1 ns. */
+#define GPIO_HIST_BUCKETS (32)
 
-/* Virtual address where the physical GPIO address is mapped */
-void* virt_gpio_base;
+/* Counters of the IRQ path, indexed by the button number - 1. */
+struct gpio_counters
+{
+    u64 irq_count;          /* IRQ handler invocations. */
+    u64 isr_ns_total;       /* Time spent in the IRQ handler. */
+    u64 isr_ns_max;         /* Longest IRQ handler invocation. */
+    u64 edges[GPIO_GROUP_SIZE];     /* Falling edges of the switch. */
+    u64 accepted[GPIO_GROUP_SIZE];  /* Presses stored in the event ring. */
+    u64 debounced[GPIO_GROUP_SIZE]; /* Edges rejected inside the debounce window. */
+    u64 unconfirmed[GPIO_GROUP_SIZE]; /* Presses rejected by the level confirmation. */
+    u64 isr_hist[GPIO_HIST_BUCKETS];  /* IRQ handler execution time. */
+};
 
 /*
- * GetGPFSELReg function
- *  Parameters:
- *   pin    - number of GPIO pin;
- *
- *   return - GPFSELn offset from GPIO base address, for containing desired pin control
- *  Operation:
- *   Based on the passed GPIO pin number, finds the corresponding GPFSELn reg and
- *   returns its offset from GPIO base address.
+ * IRQ path counters of one CPU. Each CPU updates only its own copy, with
+ * interrupts disabled, so the handlers of all CPUs never share a cache line;
+ * readers sum the copies.
  */
-unsigned int GetGPFSELReg(char pin)
+struct gpio_cpu_stats
 {
-    unsigned int addr;
+    struct gpio_counters counters;
+    struct u64_stats_sync syncp; /* Untorn 64-bit reads on 32-bit CPUs. */
+};
 
-    if(pin >= 0 && pin <10)
-        addr = GPFSEL0_OFFSET;
-    else if(pin >= 10 && pin <20)
-        addr = GPFSEL1_OFFSET;
-    else if(pin >= 20 && pin <30)
-        addr = GPFSEL2_OFFSET;
-    else if(pin >= 30 && pin <40)
-        addr = GPFSEL3_OFFSET;
-    else if(pin >= 40 && pin <50)
-        addr = GPFSEL4_OFFSET;
-    else /*if(pin >= 50 && pin <53) */
-        addr = GPFSEL5_OFFSET;
+/* Per open file state. */
+struct gpio_session
+{
+    struct gpio_instance *inst; /* Instance of the opened minor. */
+    int consumer;           /* Session owns the event ring tail. */
+    int mapped;             /* Session mapped the event ring, poll() delivers its events. */
+};
 
-  return addr;
-}
+/* Blocking read timeout in milliseconds (0 - wait until a press arrives). */
+static unsigned int read_timeout_ms = 0;
+module_param(read_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(read_timeout_ms, "Blocking read timeout in ms, 0 waits forever");
 
 /*
- * GetGPIOPinOffset function
- *  Parameters:
- *   pin    - number of GPIO pin;
- *
- *   return - offset of the pin control bit, position in control registers
+ * Driver instance, one minor serving one pin group. Instances share only the
+ * GPIO registers, and their SET/CLR stores never touch the pins of another
+ * group, so the stations of a host do not see each other.
+ */
+struct gpio_instance
+{
+    struct cdev cdev;
+    unsigned int minor;
+    char name[16];          /* Device node and IRQ name. */
+
+    struct gpio_led_pulse leds[GPIO_GROUP_SIZE];
+    struct gpio_button buttons[GPIO_GROUP_SIZE];
+
+    /* Runtime configuration, starts from the module parameters. */
+    struct gpio_config config;
+
+    /* IRQ path counters, one copy per CPU. */
+    struct gpio_cpu_stats __percpu *cpu_stats;
+
+    /* Counters of the process and timer paths. */
+    atomic64_t led_writes[GPIO_GROUP_SIZE]; /* GPSET/GPCLR stores driving the LED. */
+    atomic64_t bytes_read;      /* Bytes copied to user space by read(). */
+    atomic64_t bytes_written;   /* Bytes taken from user space by write(). */
+    atomic64_t latency_hist[GPIO_HIST_BUCKETS]; /* Press to user space delivery. */
+    u32 latency_head;           /* Ring head whose delivery poll() accounted last. */
+
+    struct dentry *debugfs;     /* Statistics directory of the instance. */
+
+    /* Ring of button events, shared with user space through mmap. */
+    struct gpio_ring *ring;
+    u32 ring_head;          /* Producer cursor, ring->head is its copy for user space. */
+    u32 ring_overruns;      /* Dropped events, ring->overruns is its copy for user space. */
+    u32 event_seq;          /* Sequence number of the next event. */
+    u32 event_overrun;      /* Set when events were dropped, cleared by the next stored event. */
+    spinlock_t ring_lock;   /* Serializes the IRQ handlers producing events on different CPUs. */
+
+    /* Session consuming the event ring, only one at a time. */
+    struct gpio_session *ring_owner;
+
+    /* Serializes the event ring consumers (read() and ownership changes). */
+    struct mutex read_mutex;
+
+    /* Readers sleeping until a button press is recorded. */
+    wait_queue_head_t wait;
+
+    struct gpio_playback playback;
+    struct gpio_animation_state anim;
+    struct mutex play_mutex;    /* Serializes the writers replacing the pattern or the animation. */
+
+    struct gpio_expect_state expect;
+    spinlock_t expect_lock;     /* Protects expect against the IRQ handlers. */
+};
+
+/* Major number, instance N is minor N. */
+static int gpio_driver_major;
+
+/* Instances, one per pin group. */
+static struct gpio_instance *gpio_instances[GPIO_MAX_INSTANCES];
+static unsigned int gpio_instance_count;
+
+/* Slab cache the instances are allocated from. */
+static struct kmem_cache *gpio_instance_cache;
+
+/* Pin groups, GPIO_GROUP_SIZE LEDs and switches per instance. */
+static int led_pins[GPIO_MAX_INSTANCES * GPIO_GROUP_SIZE] = { GPIO_06, GPIO_13, GPIO_19, GPIO_26 };
+static int led_pins_count = GPIO_GROUP_SIZE;
+module_param_array(led_pins, int, &led_pins_count, 0444);
+MODULE_PARM_DESC(led_pins, "LED lines, 4 per instance (default 6,13,19,26)");
+
+static int switch_pins[GPIO_MAX_INSTANCES * GPIO_GROUP_SIZE] = { GPIO_12, GPIO_16, GPIO_20, GPIO_21 };
+static int switch_pins_count = GPIO_GROUP_SIZE;
+module_param_array(switch_pins, int, &switch_pins_count, 0444);
+MODULE_PARM_DESC(switch_pins, "Switch lines of the LEDs in led_pins, 4 per instance (default 12,16,20,21)");
+
+/* Peripheral base: 0x20000000 on BCM2835 (Pi 1/Zero), 0x3F000000 on BCM2836/7 (Pi 2/3), 0xFE000000 on BCM2711 (Pi 4). */
+static ulong peri_base = BCM2708_PERI_BASE;
+module_param(peri_base, ulong, 0444);
+MODULE_PARM_DESC(peri_base, "ARM physical address of the peripherals (default 0x3F000000)");
+
+/* Virtual address where the physical GPIO address is mapped */
+static void __iomem *virt_gpio_base;
+
+/*
+ * GpioPinTableInit function
  *  Operation:
- *   Based on the passed GPIO pin number, finds the position of its control bit
- *   in corresponding control registers.
+ *   Computes the registers and the mask of every GPIO pin once, so that setting,
+ *   clearing or reading a pin is a table load and a single MMIO access.
  */
-char GetGPIOPinOffset(char pin)
+static void GpioPinTableInit(void)
 {
-    if(pin >= 0 && pin <10)
-        pin = pin;
-    else if(pin >= 10 && pin <20)
-        pin -= 10;
-    else if(pin >= 20 && pin <30)
-        pin -= 20;
-    else if(pin >= 30 && pin <40)
-        pin -= 30;
-    else if(pin >= 40 && pin <50)
-        pin -= 40;
-    else /*if(pin >= 50 && pin <53) */
-        pin -= 50;
+    struct gpio_pin_regs *regs;
+    int pin;
 
-    return pin;
+    for (pin = 0; pin < GPIO_PIN_COUNT; pin++)
+    {
+        regs = &gpio_pin_regs[pin];
+
+        /* Ten pins per GPFSELn, three function bits each. */
+        regs->fsel = GPFSEL0_OFFSET + (pin / 10) * 4;
+        regs->fsel_shift = (pin % 10) * 3;
+
+        /* One bit per pin in the two banks of the other registers. */
+        regs->bank = pin / 32;
+        regs->set = regs->bank ? GPSET1_OFFSET : GPSET0_OFFSET;
+        regs->clr = regs->bank ? GPCLR1_OFFSET : GPCLR0_OFFSET;
+        regs->lev = regs->bank ? GPLEV1_OFFSET : GPLEV0_OFFSET;
+        regs->pudclk = regs->bank ? GPPUDCLK1_OFFSET : GPPUDCLK0_OFFSET;
+        regs->mask = 0x1 << (pin % 32);
+    }
 }
 
 /*
@@ -262,21 +495,18 @@ char GetGPIOPinOffset(char pin)
  *   Sets to use internal pull-up or pull-down resistor, or not to use it if pull-none
  *   selected for desired GPIO pin.
  */
-void SetInternalPullUpDown(char pin, PUD pull)
+static void SetInternalPullUpDown(char pin, PUD pull)
 {
+    const struct gpio_pin_regs *regs = &gpio_pin_regs[(u8) pin];
     unsigned int gppud_offset;
     unsigned int gppudclk_offset;
     unsigned int tmp;
-    unsigned int mask;
 
     /* Get the offset of GPIO Pull-up/down Register (GPPUD) from GPIO base address. */
     gppud_offset = GPPUD_OFFSET;
 
     /* Get the offset of GPIO Pull-up/down Clock Register (GPPUDCLK) from GPIO base address. */
-    gppudclk_offset = (pin < 32) ? GPPUDCLK0_OFFSET : GPPUDCLK1_OFFSET;
-
-    /* Get pin offset in register . */
-    pin = (pin < 32) ? pin : pin - 32;
+    gppudclk_offset = regs->pudclk;
 
     /* Write to GPPUD to set the required control signal (i.e. Pull-up or Pull-Down or neither
        to remove the current Pull-up/down). */
@@ -288,8 +518,7 @@ void SetInternalPullUpDown(char pin, PUD pull)
        modify � NOTE only the pads which receive a clock will be modified, all others will
        retain their previous state. */
     tmp = ioread32(virt_gpio_base + gppudclk_offset);
-    mask = 0x1 << pin;
-    tmp |= mask;
+    tmp |= regs->mask;
     iowrite32(tmp, virt_gpio_base + gppudclk_offset);
 
     /* Wait 150 cycles � this provides the required hold time for the control signal */
@@ -299,8 +528,7 @@ void SetInternalPullUpDown(char pin, PUD pull)
 
     /* Write to GPPUDCLK0/1 to remove the clock. */
     tmp = ioread32(virt_gpio_base + gppudclk_offset);
-    mask = 0x1 << pin;
-    tmp &= (~mask);
+    tmp &= ~regs->mask;
     iowrite32(tmp, virt_gpio_base + gppudclk_offset);
 }
 
@@ -312,31 +540,19 @@ void SetInternalPullUpDown(char pin, PUD pull)
  *  Operation:
  *   Sets the desired GPIO pin to be used as input or output based on the direcation value.
  */
-void SetGpioPinDirection(char pin, DIRECTION direction)
+static void SetGpioPinDirection(char pin, DIRECTION direction)
 {
-    unsigned int GPFSELReg_offset;
+    const struct gpio_pin_regs *regs = &gpio_pin_regs[(u8) pin];
     unsigned int tmp;
-    unsigned int mask;
-
-    /* Get base address of function selection register. */
-    GPFSELReg_offset = GetGPFSELReg(pin);
 
-    /* Calculate gpio pin offset. */
-    pin = GetGPIOPinOffset(pin);
-
-    /* Set gpio pin direction. */
-    tmp = ioread32(virt_gpio_base + GPFSELReg_offset);
+    /* Set gpio pin direction, the function bits of the pin are 000 or 001. */
+    tmp = ioread32(virt_gpio_base + regs->fsel);
+    tmp &= ~(0x7 << regs->fsel_shift);
     if(direction)
     { //set as output: set 1
-      mask = 0x1 << (pin*3);
-      tmp |= mask;
-    }
-    else
-    { //set as input: set 0
-      mask = ~(0x1 << (pin*3));
-      tmp &= mask;
+      tmp |= 0x1 << regs->fsel_shift;
     }
-    iowrite32(tmp, virt_gpio_base + GPFSELReg_offset);
+    iowrite32(tmp, virt_gpio_base + regs->fsel);
 }
 
 /*
@@ -346,18 +562,12 @@ void SetGpioPinDirection(char pin, DIRECTION direction)
  *  Operation:
  *   Sets the desired GPIO pin to HIGH level. The pin should previously be defined as output.
  */
-void SetGpioPin(char pin)
+static void SetGpioPin(char pin)
 {
-    unsigned int GPSETreg_offset;
-    unsigned int tmp;
-
-    /* Get base address of gpio set register. */
-    GPSETreg_offset = (pin < 32) ? GPSET0_OFFSET : GPSET1_OFFSET;
-    pin = (pin < 32) ? pin : pin - 32;
+    const struct gpio_pin_regs *regs = &gpio_pin_regs[(u8) pin];
 
     /* Set gpio. */
-    tmp = 0x1 << pin;
-    iowrite32(tmp, virt_gpio_base + GPSETreg_offset);
+    iowrite32(regs->mask, virt_gpio_base + regs->set);
 }
 
 /*
@@ -367,18 +577,12 @@ void SetGpioPin(char pin)
  *  Operation:
  *   Sets the desired GPIO pin to LOW level. The pin should previously be defined as output.
  */
-void ClearGpioPin(char pin)
+static void ClearGpioPin(char pin)
 {
-    unsigned int GPCLRreg_offset;
-    unsigned int tmp;
-
-    /* Get base address of gpio clear register. */
-    GPCLRreg_offset = (pin < 32) ? GPCLR0_OFFSET : GPCLR1_OFFSET;
-    pin = (pin < 32) ? pin : pin - 32;
+    const struct gpio_pin_regs *regs = &gpio_pin_regs[(u8) pin];
 
     /* Clear gpio. */
-    tmp = 0x1 << pin;
-    iowrite32(tmp, virt_gpio_base + GPCLRreg_offset);
+    iowrite32(regs->mask, virt_gpio_base + regs->clr);
 }
 
 /*
@@ -390,342 +594,2035 @@ void ClearGpioPin(char pin)
  *  Operation:
  *   Reads the level from the desired GPIO pin and returns the read value.
  */
-char GetGpioPinValue(char pin)
+static char GetGpioPinValue(char pin)
 {
-    unsigned int GPLEVreg_offset;
-    unsigned int tmp;
-    unsigned int mask;
-
-    /* Get base address of gpio level register. */
-    GPLEVreg_offset = (pin < 32) ?  GPLEV0_OFFSET : GPLEV1_OFFSET;
-    pin = (pin < 32) ? pin : pin - 32;
+    const struct gpio_pin_regs *regs = &gpio_pin_regs[(u8) pin];
 
     /* Read gpio pin level. */
-    tmp = ioread32(virt_gpio_base + GPLEVreg_offset);
-    mask = 0x1 << pin;
-    tmp &= mask;
-
-    return (tmp >> pin);
+    return (ioread32(virt_gpio_base + regs->lev) & regs->mask) != 0;
 }
 
-/* Interupt Handler For GPIO pin going low*/
-static irqreturn_t gpio_irq_handler_falling(int irq,void *dev_id) 
+/*
+ * GpioRingPush function
+ *  Parameters:
+ *   inst   - instance storing the event;
+ *   type   - GPIO_EV_* type of the event;
+ *   pin    - GPIO line which raised the event;
+ *   value  - number of the pressed button, or the type specific value;
+ *   timestamp_ns - ktime_get_ns() when the event happened;
+ *  Operation:
+ *   Stores an event at the head of the event ring. If the consumer did not
+ *   free a slot the event is dropped and counted in the ring overruns. The
+ *   mapping can write the whole page, so the producer state is kept in the
+ *   instance and only published to the ring; of the shared fields just the
+ *   tail is read back, and a bogus tail only makes the ring look full.
+ */
+static void GpioRingPush(struct gpio_instance *inst, u16 type, char pin, u32 value, u64 timestamp_ns)
 {
-    int id = (int) (int *) dev_id;
+    struct gpio_event *ev;
+    unsigned long flags;
+    u32 head;
+    u32 tail;
 
-    /* Debouncing proc. */
-    unsigned long diff = jiffies - old_jiffie;
+    spin_lock_irqsave(&inst->ring_lock, flags);
 
-    if (diff < 20)
-    {
-        return IRQ_HANDLED;
-    }
+    head = inst->ring_head;
+    tail = smp_load_acquire(&inst->ring->tail);
 
-    old_jiffie = jiffies;
+    trace_gpio_enqueue(inst->minor, pin, timestamp_ns, inst->event_seq, type, value,
+                       head - tail >= GPIO_RING_SIZE);
 
-    /* What LED was activated  */
-    if (id == GPIO_06)
+    if (head - tail >= GPIO_RING_SIZE)
     {
-        strcat(gpio_sequnce_buffer, "1");
-    }
-    else if (id == GPIO_13)
-    {
-       strcat(gpio_sequnce_buffer, "2");
-    }
-    else if (id == GPIO_19)
-    {
-       strcat(gpio_sequnce_buffer, "3");
-    }
-    else if (id == GPIO_26)
-    {
-       strcat(gpio_sequnce_buffer, "4");
+        /* Ring full, drop the event. */
+        inst->ring_overruns++;
+        WRITE_ONCE(inst->ring->overruns, inst->ring_overruns);
+        inst->event_overrun = 1;
+        WRITE_ONCE(inst->event_seq, inst->event_seq + 1);
     }
     else
     {
-        strcat(gpio_sequnce_buffer, "0");
+        ev = &inst->ring->events[head & (GPIO_RING_SIZE - 1)];
+        ev->timestamp_ns = timestamp_ns;
+        ev->seq = inst->event_seq;
+        WRITE_ONCE(inst->event_seq, inst->event_seq + 1);
+        ev->type = type;
+        ev->pin = pin;
+        ev->edge = GPIO_EDGE_FALLING;
+        ev->value = value;
+        ev->flags = inst->event_overrun ? GPIO_EV_F_OVERRUN : 0;
+        inst->event_overrun = 0;
+
+        /* Publish the event after its contents. */
+        smp_store_release(&inst->ring_head, head + 1);
+        smp_store_release(&inst->ring->head, head + 1);
     }
-    
 
-    local_irq_save(flag); // Save all curent interupts;
-    
-    SetGpioPin(id);
-    mdelay(100);
-    ClearGpioPin(id);
-    printk(KERN_INFO "IRQ req: %d\n", irq);
-    
-    local_irq_restore(flag);
-    
-    return IRQ_HANDLED;
+    spin_unlock_irqrestore(&inst->ring_lock, flags);
 }
 
 /*
- * Initialization:
- *  1. Register device driver
- *  2. Allocate buffer
- *  3. Initialize buffer
- *  4. Map GPIO Physical address space to virtual address
- *  5. Initialize GPIO pins
- *  6. Init and start the high resoultion timer
+ * GpioHistBucket function
+ *  Parameters:
+ *   ns     - measured time;
+ *
+ *   return - log2 histogram bucket of the time
  */
-int gpio_driver_init(void)
+static u32 GpioHistBucket(u64 ns)
 {
-    int result = -1;
+    return ns ? min_t(u32, ilog2(ns), GPIO_HIST_BUCKETS - 1) : 0;
+}
 
-    printk(KERN_INFO "Inserting gpio_driver module\n");
+/*
+ * GpioLedsStored function
+ *  Parameters:
+ *   inst   - instance owning the LEDs;
+ *   set    - mask of LEDs whose pins were written to GPSETn (bit 0 is LED1);
+ *   clear  - mask of LEDs whose pins were written to GPCLRn;
+ *  Operation:
+ *   Accounts one register store for every LED in the masks, in the debugfs
+ *   counters and in the gpio_led_store tracepoint.
+ */
+static void GpioLedsStored(struct gpio_instance *inst, u32 set, u32 clear)
+{
+    int i;
 
-    /* Registering device. */
-    result = register_chrdev(0, DEVICE_NAME, &gpio_driver_fops);
-    if (result < 0)
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
     {
-        printk(KERN_INFO "gpio_driver: cannot obtain major number %d\n", gpio_driver_major);
-        return result;
+        if ((set | clear) & (1 << i))
+        {
+            atomic64_inc(&inst->led_writes[i]);
+            trace_gpio_led_store(inst->minor, inst->leds[i].pin, READ_ONCE(inst->event_seq), !!(set & (1 << i)));
+        }
     }
+}
 
-    gpio_driver_major = result;
-    printk(KERN_INFO "gpio_driver major number is %d\n", gpio_driver_major);
+/*
+ * GpioLedPulseEnd function
+ *  Parameters:
+ *   timer  - pulse timer of the LED;
+ *  Operation:
+ *   Switches off the LED lit by the IRQ handler when its pulse expires.
+ */
+static enum hrtimer_restart GpioLedPulseEnd(struct hrtimer *timer)
+{
+    struct gpio_led_pulse *pulse = container_of(timer, struct gpio_led_pulse, timer);
 
-    /* Allocating memory for the buffer. */
-    gpio_driver_buffer = kmalloc(BUF_LEN, GFP_KERNEL);
-    if (!gpio_driver_buffer)
-    {
-        result = -ENOMEM;
-        goto fail_no_mem_d;
-    }
+    ClearGpioPin(pulse->pin);
+    GpioLedsStored(pulse->inst, 0, 1 << (pulse - pulse->inst->leds));
+
+    return HRTIMER_NORESTART;
+}
 
-    /* Initialize data buffer. */
-    memset(gpio_driver_buffer, 0, BUF_LEN);
+/*
+ * GpioLedPulseStart function
+ *  Parameters:
+ *   inst   - instance of the button;
+ *   button - number of the pressed button (1-4);
+ *  Operation:
+ *   Lights the LED of the button and arms its pulse timer. A new press on the
+ *   same button restarts the pulse.
+ */
+static void GpioLedPulseStart(struct gpio_instance *inst, u32 button)
+{
+    struct gpio_led_pulse *pulse;
+    unsigned int length_ms = READ_ONCE(inst->config.pulse_ms);
 
-    /* Allocating memory for the buffer. */
-    gpio_sequnce_buffer = kmalloc(BUF_LEN, GFP_KERNEL);
-    if (!gpio_sequnce_buffer)
+    if (button < 1 || button > GPIO_GROUP_SIZE || length_ms == 0)
     {
-        result = -ENOMEM;
-        goto fail_no_mem_s;
+        return;
     }
 
-    /* Initialize data buffer. */
-    memset(gpio_driver_buffer, 0, BUF_LEN);
+    pulse = &inst->leds[button - 1];
 
-    /* map the GPIO register space from PHYSICAL address space to virtual address space */
-    virt_gpio_base = ioremap(GPIO_BASE, GPIO_ADDR_SPACE_LEN);
-    if(!virt_gpio_base)
+    SetGpioPin(pulse->pin);
+    GpioLedsStored(inst, 1 << (button - 1), 0);
+    hrtimer_start(&pulse->timer, ms_to_ktime(length_ms), HRTIMER_MODE_REL);
+}
+
+/*
+ * GpioLedsApply function
+ *  Parameters:
+ *   inst   - instance owning the LEDs;
+ *   set    - mask of LEDs to light (bit 0 is LED1);
+ *   clear  - mask of LEDs to switch off;
+ *  Operation:
+ *   Lights and switches off the LEDs selected by the masks (set wins if a LED is
+ *   in both). All LEDs change together: the pin masks are collected first and
+ *   written with at most one GPSETn and one GPCLRn store per register bank.
+ */
+static void GpioLedsApply(struct gpio_instance *inst, u32 set, u32 clear)
+{
+    u32 set_bank[2] = { 0, 0 };
+    u32 clear_bank[2] = { 0, 0 };
+    const struct gpio_pin_regs *regs;
+    int i;
+
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
     {
-        result = -ENOMEM;
-        goto fail_no_virt_mem;
+        regs = &gpio_pin_regs[(u8) inst->leds[i].pin];
+
+        if (set & (1 << i))
+        {
+            set_bank[regs->bank] |= regs->mask;
+        }
+        else if (clear & (1 << i))
+        {
+            clear_bank[regs->bank] |= regs->mask;
+        }
     }
 
-    /* Initialize GPIO pins. */
-    /* LEDS */
-    SetGpioPinDirection(GPIO_06, GPIO_DIRECTION_OUT);
-    SetGpioPinDirection(GPIO_13, GPIO_DIRECTION_OUT);
-    SetGpioPinDirection(GPIO_19, GPIO_DIRECTION_OUT);
-    SetGpioPinDirection(GPIO_26, GPIO_DIRECTION_OUT);
+    if (set_bank[0])
+        iowrite32(set_bank[0], virt_gpio_base + GPSET0_OFFSET);
+    if (set_bank[1])
+        iowrite32(set_bank[1], virt_gpio_base + GPSET1_OFFSET);
+    if (clear_bank[0])
+        iowrite32(clear_bank[0], virt_gpio_base + GPCLR0_OFFSET);
+    if (clear_bank[1])
+        iowrite32(clear_bank[1], virt_gpio_base + GPCLR1_OFFSET);
+
+    GpioLedsStored(inst, set & ((1 << GPIO_GROUP_SIZE) - 1), clear & ~set & ((1 << GPIO_GROUP_SIZE) - 1));
+}
 
+/*
+ * GpioLedsFrame function
+ *  Parameters:
+ *   inst   - instance owning the LEDs;
+ *   leds   - mask of LEDs which should be lit, all others are switched off;
+ *  Operation:
+ *   Applies a complete LED state in one GPSET0 and one GPCLR0 store.
+ */
+static void GpioLedsFrame(struct gpio_instance *inst, u32 leds)
+{
+    GpioLedsApply(inst, leds, ~leds);
+}
 
-    /* SWitches */
-    SetInternalPullUpDown(GPIO_12, PULL_UP);
-    SetInternalPullUpDown(GPIO_16, PULL_UP);
-    SetInternalPullUpDown(GPIO_20, PULL_UP);
-    SetInternalPullUpDown(GPIO_21, PULL_UP);
-    SetGpioPinDirection(GPIO_12, GPIO_DIRECTION_IN);
-    SetGpioPinDirection(GPIO_16, GPIO_DIRECTION_IN);
-    SetGpioPinDirection(GPIO_20, GPIO_DIRECTION_IN);
-    SetGpioPinDirection(GPIO_21, GPIO_DIRECTION_IN);
-    
+/*
+ * GpioPlaybackRunning function
+ *  Parameters:
+ *   inst    - instance playing the pattern;
+ *   running - non-zero while a pattern is played;
+ *   feedback - non-zero when the feedback pattern of a verdict starts;
+ *  Operation:
+ *   Updates playback.running under expect_lock, the lock GpioExpectCheck() holds
+ *   when it sets the flag and queues the feedback pattern. The flag stays set
+ *   until that pattern starts, so poll() reports no POLLPRI in between.
+ */
+static void GpioPlaybackRunning(struct gpio_instance *inst, int running, int feedback)
+{
+    struct gpio_expect_state *expect = &inst->expect;
+    unsigned long flags;
 
-    // Getting IRQ Number for GPIO Pins
-    GPIO_12_irq_Number = gpio_to_irq(GPIO_12);
-    if (request_irq(GPIO_12_irq_Number, gpio_irq_handler_falling, IRQF_TRIGGER_FALLING, DEVICE_NAME, (void *) GPIO_06))
+    spin_lock_irqsave(&inst->expect_lock, flags);
+    if (feedback)
     {
-        printk(KERN_INFO "IRQ GPIO 12 ERROR");
-        result = -EINTR;
-        goto free_gpio_12;
+        expect->feedback_pending = 0;
     }
+    WRITE_ONCE(inst->playback.running, running || expect->feedback_pending);
+    spin_unlock_irqrestore(&inst->expect_lock, flags);
+}
 
-    GPIO_16_irq_Number = gpio_to_irq(GPIO_16);
-    if (request_irq(GPIO_16_irq_Number, (void *) gpio_irq_handler_falling, IRQF_TRIGGER_FALLING, DEVICE_NAME, (void *) GPIO_13))
+/*
+ * GpioPlaybackTick function
+ *  Parameters:
+ *   timer  - playback timer;
+ *  Operation:
+ *   Ends the on phase of the current step, or starts the next step. Every
+ *   deadline is the previous one plus the phase length, so the pattern does not
+ *   drift with the timer latency; the delay of the tick after its deadline is
+ *   counted as the overshoot. After the last step a GPIO_EV_PLAYBACK event is
+ *   stored and the waiters are woken up.
+ */
+static enum hrtimer_restart GpioPlaybackTick(struct hrtimer *timer)
+{
+    struct gpio_instance *inst = container_of(timer, struct gpio_instance, playback.timer);
+    struct gpio_playback *playback = &inst->playback;
+    struct gpio_play_step *step = &playback->steps[playback->index];
+    s64 late = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer), hrtimer_get_expires(timer)));
+    u32 next_us;
+
+    if (late < 0)
     {
-        printk(KERN_INFO "IRQ GPIO 16 ERROR");
-        result = -EINTR;
-        goto free_gpio_16;
+        late = 0;
     }
 
-    GPIO_20_irq_Number = gpio_to_irq(GPIO_20);
-    if (request_irq(GPIO_20_irq_Number, (void *) gpio_irq_handler_falling, IRQF_TRIGGER_FALLING, DEVICE_NAME, (void *) GPIO_19))
+    /* Single writer like the animation statistics. */
+    atomic64_inc(&playback->deadlines);
+    atomic64_add(late, &playback->late_ns_total);
+    if (late > atomic64_read(&playback->late_ns_max))
     {
-        printk(KERN_INFO "IRQ GPIO 20 ERROR");
-        result = -EINTR;
-        goto free_gpio_20;
+        atomic64_set(&playback->late_ns_max, late);
     }
-
-    GPIO_21_irq_Number = gpio_to_irq(GPIO_21);
-    if (request_irq(GPIO_21_irq_Number, (void *) gpio_irq_handler_falling, IRQF_TRIGGER_FALLING, DEVICE_NAME, (void *) GPIO_26))
+    atomic64_inc(&playback->last_deadlines);
+    atomic64_add(late, &playback->last_late_ns_total);
+    if (late > atomic64_read(&playback->last_late_ns_max))
     {
-        printk(KERN_INFO "IRQ GPIO 21 ERROR");
-        result = -EINTR;
-        goto free_gpio_21;
+        atomic64_set(&playback->last_late_ns_max, late);
     }
 
-    printk(KERN_INFO "'mknod /dev/%s c %d 0'.\n", DEVICE_NAME, gpio_driver_major);
-    printk(KERN_INFO " IRQ Numbers %d %d %d %d", GPIO_12_irq_Number, GPIO_16_irq_Number, GPIO_20_irq_Number, GPIO_21_irq_Number);
-    
-    return 0;
-
-fail_no_virt_mem:
-    /* Freeing the major number. */
-    unregister_chrdev(gpio_driver_major, DEVICE_NAME);
-
-fail_no_mem_d:
-    /* Freeing buffer gpio_driver_buffer. */
-    if (gpio_driver_buffer)
+    if (playback->lit)
     {
-        kfree(gpio_driver_buffer);
+        GpioLedsApply(inst, 0, step->led_mask);
+        playback->lit = 0;
+        next_us = step->off_us;
     }
-
-fail_no_mem_s:
-    /* Freeing buffer gpio_driver_buffer. */
-    if (gpio_sequnce_buffer)
+    else
     {
-        kfree(gpio_sequnce_buffer);
+        playback->index++;
+        if (playback->index >= playback->count)
+        {
+            GpioPlaybackRunning(inst, 0, 0);
+            GpioRingPush(inst, GPIO_EV_PLAYBACK, 0, playback->count, ktime_get_ns());
+            wake_up_interruptible(&inst->wait);
+
+            return HRTIMER_NORESTART;
+        }
+
+        step = &playback->steps[playback->index];
+        GpioLedsApply(inst, step->led_mask, 0);
+        playback->lit = 1;
+        next_us = step->on_us;
     }
 
-free_gpio_12:
-    /* Freeing IRQ Line */
-    free_irq(GPIO_12_irq_Number, (void *) GPIO_06);
+    hrtimer_add_expires_ns(timer, (u64) next_us * NSEC_PER_USEC);
+
+    return HRTIMER_RESTART;
+}
+
+/*
+ * GpioAnimationEnd function
+ *  Parameters:
+ *   inst   - instance playing the animation;
+ *
+ *   return - HRTIMER_NORESTART
+ *  Operation:
+ *   Leaves lit the LEDs whose last level is above half of GPIO_ANIM_LEVEL_MAX,
+ *   switches off the others, stores a GPIO_EV_PLAYBACK event and wakes up the
+ *   waiters.
+ */
+static enum hrtimer_restart GpioAnimationEnd(struct gpio_instance *inst)
+{
+    struct gpio_animation_state *anim = &inst->anim;
+    u32 lit = 0;
+    int i;
 
-free_gpio_16:
-    /* Freeing IRQ Line */
-    free_irq(GPIO_16_irq_Number, (void *) GPIO_13);
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        if (anim->from[i] > GPIO_ANIM_LEVEL_MAX / 2)
+        {
+            lit |= 1 << i;
+        }
+    }
 
-free_gpio_20:
-    /* Freeing IRQ Line */
-    free_irq(GPIO_20_irq_Number, (void *) GPIO_19);
+    GpioLedsApply(inst, lit, anim->lit & ~lit);
+    anim->lit = lit;
 
-free_gpio_21:
-    /* Freeing IRQ Line */
-    free_irq(GPIO_12_irq_Number, (void *) GPIO_26);
+    WRITE_ONCE(anim->running, 0);
+    GpioRingPush(inst, GPIO_EV_PLAYBACK, 0, anim->count, ktime_get_ns());
+    wake_up_interruptible(&inst->wait);
 
-    return result;
+    return HRTIMER_NORESTART;
 }
 
 /*
- * Cleanup:
- *  1. release GPIO pins (clear all outputs, set all as inputs and pull-none to minimize the power consumption)
- *  2. Unmap GPIO Physical address space from virtual address
- *  3. Free buffer
- *  4. Unregister device driver
+ * GpioAnimationTick function
+ *  Parameters:
+ *   timer  - animation timer;
+ *  Operation:
+ *   Renders one PWM tick of all LEDs of the instance. The position in the
+ *   animation is computed from the timer expiry, so a late tick does not
+ *   delay the rest of it, and the LED registers are written only when the
+ *   set of lit LEDs changes. Ticks the timer missed are skipped and counted
+ *   as overruns together with the delay of the tick.
  */
-void gpio_driver_exit(void)
+static enum hrtimer_restart GpioAnimationTick(struct hrtimer *timer)
 {
-    printk(KERN_INFO "Removing gpio_driver module\n");
+    struct gpio_instance *inst = container_of(timer, struct gpio_instance, anim.timer);
+    struct gpio_animation_state *anim = &inst->anim;
+    struct gpio_anim_frame *frame = &anim->frames[anim->index];
+    ktime_t expires = hrtimer_get_expires(timer);
+    ktime_t now = hrtimer_cb_get_time(timer);
+    u64 elapsed = ktime_to_ns(ktime_sub(expires, anim->frame_start));
+    s64 late = ktime_to_ns(ktime_sub(now, expires));
+    u64 length;
+    u64 fade;
+    u64 forward;
+    u32 level;
+    u32 lit = 0;
+    int i;
+
+    if (late < 0)
+    {
+        late = 0;
+    }
 
-    /* Clear GPIO pins. */
-    ClearGpioPin(GPIO_06);
-    ClearGpioPin(GPIO_13);
-    ClearGpioPin(GPIO_19);
-    ClearGpioPin(GPIO_26);
+    /* The timer of an instance never runs on two CPUs at once, a plain max is enough. */
+    atomic64_inc(&anim->ticks);
+    atomic64_add(late, &anim->late_ns_total);
+    if (late > atomic64_read(&anim->late_ns_max))
+    {
+        atomic64_set(&anim->late_ns_max, late);
+    }
 
-    /* Set GPIO pins as inputs and disable pull-ups. */
-    SetGpioPinDirection(GPIO_06, GPIO_DIRECTION_IN);
-    SetGpioPinDirection(GPIO_13, GPIO_DIRECTION_IN);
-    SetGpioPinDirection(GPIO_19, GPIO_DIRECTION_IN);
-    SetGpioPinDirection(GPIO_26, GPIO_DIRECTION_IN);
-    SetInternalPullUpDown(GPIO_12, PULL_NONE);
-    SetInternalPullUpDown(GPIO_16, PULL_NONE);
-    SetInternalPullUpDown(GPIO_20, PULL_NONE);
-    SetInternalPullUpDown(GPIO_21, PULL_NONE);
+    /* Frames which ended since the previous tick. */
+    length = ((u64) frame->fade_us + frame->hold_us) * NSEC_PER_USEC;
+    while (elapsed >= length)
+    {
+        memcpy(anim->from, frame->level, sizeof(anim->from));
+        anim->frame_start = ktime_add_ns(anim->frame_start, length);
+        elapsed -= length;
 
-    free_irq(GPIO_12_irq_Number, (void *) GPIO_06);
-    free_irq(GPIO_16_irq_Number, (void *) GPIO_13);
-    free_irq(GPIO_20_irq_Number, (void *) GPIO_19);
-    free_irq(GPIO_21_irq_Number, (void *) GPIO_26);
+        if (++anim->index >= anim->count)
+        {
+            return GpioAnimationEnd(inst);
+        }
 
+        frame = &anim->frames[anim->index];
+        length = ((u64) frame->fade_us + frame->hold_us) * NSEC_PER_USEC;
+    }
 
-    /* Unmap GPIO Physical address space. */
-    if (virt_gpio_base)
+    fade = (u64) frame->fade_us * NSEC_PER_USEC;
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
     {
-        iounmap(virt_gpio_base);
+        level = frame->level[i];
+        if (elapsed < fade)
+        {
+            if (level >= anim->from[i])
+            {
+                level = anim->from[i] + (u32) div64_u64((u64) (level - anim->from[i]) * elapsed, fade);
+            }
+            else
+            {
+                level = anim->from[i] - (u32) div64_u64((u64) (anim->from[i] - level) * elapsed, fade);
+            }
+        }
+
+        /* The LED is lit for the first 'duty' ticks of the PWM period. */
+        if (anim->phase < (level * GPIO_ANIM_PWM_STEPS + GPIO_ANIM_LEVEL_MAX / 2) / GPIO_ANIM_LEVEL_MAX)
+        {
+            lit |= 1 << i;
+        }
     }
 
-    /* Freeing buffer gpio_driver_buffer. */
-    if (gpio_driver_buffer)
+    if (lit != anim->lit)
     {
-        kfree(gpio_driver_buffer);
+        GpioLedsApply(inst, lit, anim->lit & ~lit);
+        anim->lit = lit;
     }
 
-    /* Freeing buffer gpio_sequnce_buffer. */
-    if (gpio_sequnce_buffer)
+    /* Next tick after now, ticks already missed are skipped. */
+    forward = hrtimer_forward(timer, now, anim->tick);
+    if (forward > 1)
     {
-        kfree(gpio_sequnce_buffer);
+        atomic64_add(forward - 1, &anim->overruns);
     }
+    anim->phase = (anim->phase + forward) % GPIO_ANIM_PWM_STEPS;
 
-    /* Freeing the major number. */
-    unregister_chrdev(gpio_driver_major,  DEVICE_NAME);
+    return HRTIMER_RESTART;
 }
 
-/* File open function. */
-static int gpio_driver_open(struct inode *inode, struct file *filp)
+/*
+ * GpioPlaybackStop function
+ *  Parameters:
+ *   inst   - instance playing the pattern or the animation;
+ *  Operation:
+ *   Stops the pattern and the animation and switches off the LEDs they keep
+ *   lit. The running flags are left to the caller, which replaces them with
+ *   the state of what it starts without a window where neither is set.
+ *   Called with play_mutex held.
+ */
+static void GpioPlaybackStop(struct gpio_instance *inst)
 {
-    /* Initialize driver variables here. */
+    struct gpio_playback *playback = &inst->playback;
+    struct gpio_animation_state *anim = &inst->anim;
 
-    /* Reset the device here. */
+    lockdep_assert_held(&inst->play_mutex);
 
-    /* Success. */
-    return 0;
+    hrtimer_cancel(&playback->timer);
+    /* An IRQ handler may be setting it for the feedback pattern meanwhile. */
+    if (READ_ONCE(playback->running) && playback->lit)
+    {
+        GpioLedsApply(inst, 0, playback->steps[playback->index].led_mask);
+    }
+    playback->lit = 0;
+
+    hrtimer_cancel(&anim->timer);
+    if (anim->running)
+    {
+        GpioLedsApply(inst, 0, anim->lit);
+    }
+    anim->lit = 0;
 }
 
-/* File close function. */
-static int gpio_driver_release(struct inode *inode, struct file *filp)
+/*
+ * GpioAnimationStart function
+ *  Parameters:
+ *   inst   - instance playing the animation;
+ *   frames - animation to play, already copied from user space;
+ *   count  - number of frames, 0 only stops the current animation;
+ *   tick_us - PWM tick;
+ *  Operation:
+ *   Stops the pattern or animation being played, switches off all LEDs of the
+ *   instance and starts the new animation with an immediate first tick.
+ */
+static void GpioAnimationStart(struct gpio_instance *inst, const struct gpio_anim_frame *frames, u32 count,
+                               u32 tick_us)
 {
-    /* Success. */
-    return 0;
+    struct gpio_animation_state *anim = &inst->anim;
+
+    mutex_lock(&inst->play_mutex);
+
+    GpioPlaybackStop(inst);
+
+    memcpy(anim->frames, frames, count * sizeof(*frames));
+    anim->count = count;
+    anim->index = 0;
+    anim->phase = 0;
+    memset(anim->from, 0, sizeof(anim->from));
+    WRITE_ONCE(anim->running, count != 0);
+    GpioPlaybackRunning(inst, 0, 0);
+
+    if (count)
+    {
+        GpioLedsFrame(inst, 0);
+        WRITE_ONCE(anim->tick_us, tick_us);
+        anim->tick = ns_to_ktime((u64) tick_us * NSEC_PER_USEC);
+        anim->frame_start = ktime_get();
+        hrtimer_start(&anim->timer, anim->frame_start, HRTIMER_MODE_ABS);
+    }
+
+    mutex_unlock(&inst->play_mutex);
 }
 
 /*
- * File read function
+ * GpioPlaybackStart function
  *  Parameters:
- *   filp  - a type file structure;
- *   buf   - a buffer, from which the user space function (fread) will read;
- *   len - a counter with the number of bytes to transfer, which has the same
- *           value as the usual counter in the user space function (fread);
- *   f_pos - a position of where to start reading the file;
+ *   inst   - instance playing the pattern;
+ *   steps  - pattern to play, already copied from user space;
+ *   count  - number of steps, 0 only stops the current pattern;
+ *   feedback - non-zero for the feedback pattern of a verdict;
  *  Operation:
- *   The gpio_driver_read function transfers data from the driver buffer (gpio_driver_buffer)
- *   to user space with the function copy_to_user.
+ *   Stops the pattern or animation being played and starts the new pattern
+ *   from its first step, with the statistics of the last pattern cleared.
  */
-static ssize_t gpio_driver_read(struct file *filp, char *buf, size_t len, loff_t *f_pos)
+static void GpioPlaybackStart(struct gpio_instance *inst, const struct gpio_play_step *steps, u32 count,
+                              int feedback)
 {
-    /* Size of valid data in gpio_driver - data to send in user space. */
-    int data_size = 0;
+    struct gpio_playback *playback = &inst->playback;
 
-    /* Reset memory. */
-    memset(gpio_driver_buffer, 0, BUF_LEN);
+    mutex_lock(&inst->play_mutex);
 
-    strcpy(gpio_driver_buffer, gpio_sequnce_buffer);
+    GpioPlaybackStop(inst);
 
-    /* Reset memory. */
-    memset(gpio_sequnce_buffer, 0, BUF_LEN);
+    memcpy(playback->steps, steps, count * sizeof(*steps));
+    playback->count = count;
+    playback->index = 0;
+    atomic64_set(&playback->last_deadlines, 0);
+    atomic64_set(&playback->last_late_ns_total, 0);
+    atomic64_set(&playback->last_late_ns_max, 0);
+    GpioPlaybackRunning(inst, count != 0, feedback);
+    WRITE_ONCE(inst->anim.running, 0);
 
-    if (*f_pos == 0)
+    if (count)
     {
-        /* Get size of valid data. */
-        data_size = strlen(gpio_driver_buffer);
+        GpioLedsApply(inst, steps[0].led_mask, 0);
+        playback->lit = 1;
+        hrtimer_start(&playback->timer, ns_to_ktime((u64) steps[0].on_us * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    }
 
-        /* Send data to user space. */
-        if (copy_to_user(buf, gpio_driver_buffer, data_size) != 0)
+    mutex_unlock(&inst->play_mutex);
+}
+
+/*
+ * GpioExpectFeedback function
+ *  Parameters:
+ *   work   - feedback work of the expected input;
+ *  Operation:
+ *   Plays the feedback pattern chosen by the last verdict. Runs from the
+ *   system workqueue because replacing the pattern may sleep.
+ */
+static void GpioExpectFeedback(struct work_struct *work)
+{
+    struct gpio_instance *inst = container_of(work, struct gpio_instance, expect.work);
+    struct gpio_expect_state *expect = &inst->expect;
+    struct gpio_feedback feedback;
+    unsigned long flags;
+    u32 i;
+
+    spin_lock_irqsave(&inst->expect_lock, flags);
+    feedback = expect->feedback;
+    spin_unlock_irqrestore(&inst->expect_lock, flags);
+
+    for (i = 0; i < feedback.repeat; i++)
+    {
+        expect->pattern[i] = feedback.step;
+    }
+
+    GpioPlaybackStart(inst, expect->pattern, feedback.repeat, 1);
+}
+
+/*
+ * GpioExpectCheck function
+ *  Parameters:
+ *   button - button of the accepted press;
+ *   timestamp_ns - time of the press;
+ *
+ *   return - non-zero if the consumer has to be woken up for the press
+ *  Operation:
+ *   Stores the press in the event ring, compares it with the next expected
+ *   button and stores the verdict after the press. Both happen under
+ *   expect_lock, so a press in the ring after GpioExpectArm() is always
+ *   judged and one before it never is. A wrong press or the last expected
+ *   one ends verification and may start the feedback pattern. Without
+ *   verification every press wakes the consumer.
+ */
+static int GpioExpectCheck(struct gpio_button *button, u64 timestamp_ns)
+{
+    struct gpio_instance *inst = button->inst;
+    struct gpio_expect_state *expect = &inst->expect;
+    unsigned long flags;
+    u32 kind = 0;
+    u32 index;
+    int wake = 1;
+
+    spin_lock_irqsave(&inst->expect_lock, flags);
+
+    GpioRingPush(inst, GPIO_EV_BUTTON, button->pin, button->number, timestamp_ns);
+
+    if (expect->count)
+    {
+        index = expect->index;
+
+        if (button->number != expect->buttons[index])
+        {
+            kind = GPIO_VERDICT_WRONG;
+        }
+        else if (++expect->index == expect->count)
+        {
+            kind = GPIO_VERDICT_COMPLETE;
+            index = expect->count;
+        }
+        else if (expect->flags & GPIO_EXPECT_F_PROGRESS)
+        {
+            kind = GPIO_VERDICT_PROGRESS;
+            index = expect->index;
+        }
+        else
+        {
+            wake = 0;
+        }
+
+        if (kind == GPIO_VERDICT_WRONG || kind == GPIO_VERDICT_COMPLETE)
+        {
+            /* GpioRingReady() reads it without the lock. */
+            WRITE_ONCE(expect->count, 0);
+
+            if ((kind == GPIO_VERDICT_WRONG && (expect->flags & GPIO_EXPECT_F_PLAY_WRONG))
+                || (kind == GPIO_VERDICT_COMPLETE && (expect->flags & GPIO_EXPECT_F_PLAY_COMPLETE)))
+            {
+                expect->feedback = kind == GPIO_VERDICT_WRONG ? expect->wrong : expect->complete;
+
+                /* No POLLPRI between the verdict and the start of the pattern. */
+                expect->feedback_pending = 1;
+                WRITE_ONCE(inst->playback.running, 1);
+                schedule_work(&expect->work);
+            }
+        }
+
+        if (kind)
+        {
+            GpioRingPush(inst, GPIO_EV_VERDICT, button->pin, GPIO_VERDICT(kind, index), timestamp_ns);
+        }
+    }
+
+    spin_unlock_irqrestore(&inst->expect_lock, flags);
+
+    return wake;
+}
+
+/*
+ * GpioExpectArm function
+ *  Parameters:
+ *   inst   - instance verifying the presses;
+ *   arg    - expected input, already copied from user space;
+ *
+ *   return - 0 on success, negative error code otherwise
+ *  Operation:
+ *   Replaces the expected input, a count of 0 ends verification. Arming
+ *   discards the events left in the ring, the consumer only finds presses
+ *   which get a verdict. Must be called with the read_mutex of the
+ *   instance held, the lock of the other writer of the ring tail.
+ */
+static int GpioExpectArm(struct gpio_instance *inst, const struct gpio_expect *arg)
+{
+    struct gpio_expect_state *expect = &inst->expect;
+    unsigned long flags;
+    u32 i;
+
+    lockdep_assert_held(&inst->read_mutex);
+
+    if (arg->count > GPIO_EXPECT_MAX)
+    {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < arg->count; i++)
+    {
+        if (arg->buttons[i] < 1 || arg->buttons[i] > GPIO_GROUP_SIZE)
+        {
+            return -EINVAL;
+        }
+    }
+
+    if (((arg->flags & GPIO_EXPECT_F_PLAY_WRONG)
+         && (arg->wrong.repeat < 1 || arg->wrong.repeat > GPIO_PLAY_MAX_STEPS))
+        || ((arg->flags & GPIO_EXPECT_F_PLAY_COMPLETE)
+         && (arg->complete.repeat < 1 || arg->complete.repeat > GPIO_PLAY_MAX_STEPS)))
+    {
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&inst->expect_lock, flags);
+    memcpy(expect->buttons, arg->buttons, arg->count);
+    expect->index = 0;
+    WRITE_ONCE(expect->flags, arg->flags);
+    expect->wrong = arg->wrong;
+    expect->complete = arg->complete;
+    WRITE_ONCE(expect->count, arg->count);
+
+    /* No press can be stored between the arm and the drop, see GpioExpectCheck(). */
+    if (arg->count)
+    {
+        smp_store_release(&inst->ring->tail, smp_load_acquire(&inst->ring_head));
+    }
+    spin_unlock_irqrestore(&inst->expect_lock, flags);
+
+    return 0;
+}
+
+/*
+ * GpioIsrStat function
+ *  Parameters:
+ *   button - button of the IRQ;
+ *   start  - ktime_get_ns() at the entry of the IRQ handler;
+ *   debounced - the edge was rejected inside the debounce window;
+ *  Operation:
+ *   Accounts the edge and the execution time of one IRQ handler invocation
+ *   in the counters of the current CPU. The IRQ handler and the confirm timer
+ *   are the writers of a CPU. On PREEMPT_RT both run in threads which may
+ *   preempt each other, so the update is made with interrupts disabled, which
+ *   also keeps it on the CPU. Elsewhere they are already disabled and this
+ *   costs nothing.
+ */
+static void GpioIsrStat(struct gpio_button *button, u64 start, int debounced)
+{
+    struct gpio_cpu_stats *stats;
+    struct gpio_counters *counters;
+    u64 duration = ktime_get_ns() - start;
+    u32 i = button->number - 1;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    stats = this_cpu_ptr(button->inst->cpu_stats);
+    counters = &stats->counters;
+
+    u64_stats_update_begin(&stats->syncp);
+    counters->irq_count++;
+    counters->isr_ns_total += duration;
+    if (duration > counters->isr_ns_max)
+    {
+        counters->isr_ns_max = duration;
+    }
+    counters->isr_hist[GpioHistBucket(duration)]++;
+    counters->edges[i]++;
+    if (debounced)
+    {
+        counters->debounced[i]++;
+    }
+    u64_stats_update_end(&stats->syncp);
+
+    local_irq_restore(flags);
+}
+
+/*
+ * GpioPressStat function
+ *  Parameters:
+ *   button - button of the press;
+ *   accepted - the press was stored, otherwise the level confirmation failed;
+ *  Operation:
+ *   Accounts the outcome of a press in the counters of the current CPU. Called
+ *   from the IRQ handler or the confirm timer, with interrupts disabled like
+ *   GpioIsrStat().
+ */
+static void GpioPressStat(struct gpio_button *button, int accepted)
+{
+    struct gpio_cpu_stats *stats;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    stats = this_cpu_ptr(button->inst->cpu_stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    if (accepted)
+    {
+        stats->counters.accepted[button->number - 1]++;
+    }
+    else
+    {
+        stats->counters.unconfirmed[button->number - 1]++;
+    }
+    u64_stats_update_end(&stats->syncp);
+
+    local_irq_restore(flags);
+}
+
+/*
+ * GpioCountersRead function
+ *  Parameters:
+ *   inst   - instance of the IRQs;
+ *   sum    - receives the counters of all CPUs;
+ *  Operation:
+ *   Sums up the IRQ path counters of all CPUs, retrying the copy of a CPU
+ *   whose handler updated it while it was read.
+ */
+static void GpioCountersRead(struct gpio_instance *inst, struct gpio_counters *sum)
+{
+    const struct gpio_cpu_stats *stats;
+    struct gpio_counters copy;
+    unsigned int start;
+    int cpu;
+    int i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu)
+    {
+        stats = per_cpu_ptr(inst->cpu_stats, cpu);
+
+        do
+        {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            copy = stats->counters;
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+        sum->irq_count += copy.irq_count;
+        sum->isr_ns_total += copy.isr_ns_total;
+        sum->isr_ns_max = max(sum->isr_ns_max, copy.isr_ns_max);
+
+        for (i = 0; i < GPIO_GROUP_SIZE; i++)
+        {
+            sum->edges[i] += copy.edges[i];
+            sum->accepted[i] += copy.accepted[i];
+            sum->debounced[i] += copy.debounced[i];
+            sum->unconfirmed[i] += copy.unconfirmed[i];
+        }
+
+        for (i = 0; i < GPIO_HIST_BUCKETS; i++)
+        {
+            sum->isr_hist[i] += copy.isr_hist[i];
+        }
+    }
+}
+
+/*
+ * GpioCountersResetCpu function
+ *  Parameters:
+ *   info   - instance whose counters are reset;
+ *  Operation:
+ *   Clears the IRQ path counters of the CPU it runs on. Runs with the IRQs of
+ *   that CPU disabled, so no handler updates them meanwhile.
+ */
+static void GpioCountersResetCpu(void *info)
+{
+    struct gpio_instance *inst = info;
+    struct gpio_cpu_stats *stats = this_cpu_ptr(inst->cpu_stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    memset(&stats->counters, 0, sizeof(stats->counters));
+    u64_stats_update_end(&stats->syncp);
+}
+
+/*
+ * GpioLatencyStat function
+ *  Parameters:
+ *   inst   - instance of the press;
+ *   timestamp_ns - time of the press;
+ *  Operation:
+ *   Accounts the delay between a press and its delivery to user space.
+ */
+static void GpioLatencyStat(struct gpio_instance *inst, u64 timestamp_ns)
+{
+    atomic64_inc(&inst->latency_hist[GpioHistBucket(ktime_get_ns() - timestamp_ns)]);
+}
+
+/*
+ * GpioButtonAccept function
+ *  Parameters:
+ *   button - debounced button;
+ *   edge_ns - time of the edge which started the press;
+ *  Operation:
+ *   Records the press in the event ring, verifies it against the expected
+ *   input, wakes up the readers and starts the LED pulse acknowledging it.
+ */
+static void GpioButtonAccept(struct gpio_button *button, u64 edge_ns)
+{
+    struct gpio_instance *inst = button->inst;
+
+    /* Read by the IRQ handler, which may run on another CPU than the confirm timer. */
+    WRITE_ONCE(button->last_ns, edge_ns);
+    GpioPressStat(button, 1);
+
+    /* Stores the press, then wakes up readers waiting for it, or only for its verdict. */
+    if (GpioExpectCheck(button, edge_ns))
+    {
+        wake_up_interruptible(&inst->wait);
+    }
+
+    /* Acknowledge the press, the LED goes off from the pulse timer. */
+    GpioLedPulseStart(inst, button->number);
+}
+
+/*
+ * GpioButtonConfirm function
+ *  Parameters:
+ *   timer  - confirm timer of the button;
+ *  Operation:
+ *   Accepts the pending press only if the switch is still pressed (low level),
+ *   filtering out the spikes and the bounces of a released switch.
+ */
+static enum hrtimer_restart GpioButtonConfirm(struct hrtimer *timer)
+{
+    struct gpio_button *button = container_of(timer, struct gpio_button, confirm);
+    u32 decision = GetGpioPinValue(button->pin) == 0 ? GPIO_TRACE_ACCEPTED : GPIO_TRACE_UNCONFIRMED;
+
+    trace_gpio_debounce(button->inst->minor, button->pin, button->edge_ns, button->confirm_seq, decision,
+                        ktime_get_ns() - button->edge_ns);
+
+    if (decision == GPIO_TRACE_ACCEPTED)
+    {
+        GpioButtonAccept(button, button->edge_ns);
+    }
+    else
+    {
+        GpioPressStat(button, 0);
+    }
+
+    clear_bit(0, &button->pending);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Interupt Handler For GPIO pin going low
+ *
+ * Only records the press (timestamp and enqueue) and starts the LED pulse,
+ * the LED is switched off later by its hrtimer. Every button is debounced on
+ * its own, so presses of different buttons never mask each other.
+ */
+static irqreturn_t gpio_irq_handler_falling(int irq,void *dev_id) 
+{
+    struct gpio_button *button = dev_id;
+    struct gpio_config *config = &button->inst->config;
+    u64 start = ktime_get_ns();
+    u32 confirm = READ_ONCE(config->confirm_us);
+    u64 last_ns = READ_ONCE(button->last_ns);
+    u32 seq = ++button->edge_seq;
+    int debounced = 0;
+
+    trace_gpio_edge(button->inst->minor, button->pin, start, seq);
+
+    /* Debouncing proc. */
+    if (last_ns && start - last_ns < (u64) READ_ONCE(config->debounce_us) * NSEC_PER_USEC)
+    {
+        trace_gpio_debounce(button->inst->minor, button->pin, start, seq, GPIO_TRACE_DEBOUNCED, start - last_ns);
+        debounced = 1;
+        goto out;
+    }
+
+    if (confirm == 0)
+    {
+        trace_gpio_debounce(button->inst->minor, button->pin, start, seq, GPIO_TRACE_ACCEPTED,
+                            last_ns ? start - last_ns : 0);
+        GpioButtonAccept(button, start);
+    }
+    else if (!test_and_set_bit(0, &button->pending))
+    {
+        trace_gpio_debounce(button->inst->minor, button->pin, start, seq, GPIO_TRACE_PENDING,
+                            last_ns ? start - last_ns : 0);
+
+        /* Check the level later, edges until then belong to the same press. */
+        button->edge_ns = start;
+        button->confirm_seq = seq;
+        hrtimer_start(&button->confirm, ns_to_ktime((u64) confirm * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    }
+    else
+    {
+        trace_gpio_debounce(button->inst->minor, button->pin, start, seq, GPIO_TRACE_MERGED,
+                            start - button->edge_ns);
+    }
+
+out:
+    GpioIsrStat(button, start, debounced);
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * GpioHistShow function
+ *  Parameters:
+ *   m      - debugfs file;
+ *   hist   - log2 histogram;
+ *  Operation:
+ *   Prints the non-empty buckets of the histogram, one range in ns per line.
+ */
+static void GpioHistShow(struct seq_file *m, const u64 *hist)
+{
+    int i;
+
+    for (i = 0; i < GPIO_HIST_BUCKETS; i++)
+    {
+        if (hist[i] == 0)
+        {
+            continue;
+        }
+
+        if (i == GPIO_HIST_BUCKETS - 1)
+        {
+            seq_printf(m, "%12llu .. %12s %10llu\n", 1ULL << i, "", hist[i]);
+        }
+        else
+        {
+            seq_printf(m, "%12llu .. %12llu %10llu\n", i ? 1ULL << i : 0, (2ULL << i) - 1, hist[i]);
+        }
+    }
+}
+
+/* debugfs 'stats': totals of the instance. */
+static int gpio_stats_show(struct seq_file *m, void *v)
+{
+    struct gpio_instance *inst = m->private;
+    struct gpio_counters counters;
+
+    GpioCountersRead(inst, &counters);
+
+    seq_printf(m, "irqs %llu\n", counters.irq_count);
+    seq_printf(m, "isr_ns_avg %llu\n",
+               counters.irq_count ? div64_u64(counters.isr_ns_total, counters.irq_count) : 0);
+    seq_printf(m, "isr_ns_max %llu\n", counters.isr_ns_max);
+    seq_printf(m, "ring_overruns %u\n", READ_ONCE(inst->ring_overruns));
+    seq_printf(m, "bytes_read %lld\n", atomic64_read(&inst->bytes_read));
+    seq_printf(m, "bytes_written %lld\n", atomic64_read(&inst->bytes_written));
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gpio_stats);
+
+/* debugfs 'pins': counters of every switch and LED line. */
+static int gpio_pins_show(struct seq_file *m, void *v)
+{
+    struct gpio_instance *inst = m->private;
+    struct gpio_counters counters;
+    int i;
+
+    GpioCountersRead(inst, &counters);
+
+    seq_puts(m, "switch gpio      edges   accepted  debounced unconfirmed\n");
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        seq_printf(m, "%6d %4d %10llu %10llu %10llu %11llu\n", i + 1, inst->buttons[i].pin,
+                   counters.edges[i], counters.accepted[i], counters.debounced[i], counters.unconfirmed[i]);
+    }
+
+    seq_puts(m, "led    gpio     writes\n");
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        seq_printf(m, "%6d %4d %10lld\n", i + 1, inst->leds[i].pin, atomic64_read(&inst->led_writes[i]));
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gpio_pins);
+
+/* debugfs 'isr_hist': IRQ handler execution time. */
+static int gpio_isr_hist_show(struct seq_file *m, void *v)
+{
+    struct gpio_instance *inst = m->private;
+    struct gpio_counters counters;
+
+    GpioCountersRead(inst, &counters);
+    GpioHistShow(m, counters.isr_hist);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gpio_isr_hist);
+
+/* debugfs 'latency_hist': delay from a press to its delivery to user space. */
+static int gpio_latency_hist_show(struct seq_file *m, void *v)
+{
+    struct gpio_instance *inst = m->private;
+    u64 hist[GPIO_HIST_BUCKETS];
+    int i;
+
+    for (i = 0; i < GPIO_HIST_BUCKETS; i++)
+    {
+        hist[i] = atomic64_read(&inst->latency_hist[i]);
+    }
+    GpioHistShow(m, hist);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gpio_latency_hist);
+
+/*
+ * debugfs 'reset': writing any value clears the counters and histograms of
+ * the instance. The ring overruns stay, the mapped ring reports them too.
+ */
+static int gpio_reset_set(void *data, u64 val)
+{
+    struct gpio_instance *inst = data;
+    int i;
+
+    on_each_cpu(GpioCountersResetCpu, inst, 1);
+
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        atomic64_set(&inst->led_writes[i], 0);
+    }
+
+    for (i = 0; i < GPIO_HIST_BUCKETS; i++)
+    {
+        atomic64_set(&inst->latency_hist[i], 0);
+    }
+
+    atomic64_set(&inst->bytes_read, 0);
+    atomic64_set(&inst->bytes_written, 0);
+
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(gpio_reset_fops, NULL, gpio_reset_set, "%llu\n");
+
+/* Directory of the driver in debugfs, one subdirectory per instance. */
+static struct dentry *gpio_debugfs_root;
+
+/*
+ * GpioDebugfsCreate function
+ *  Parameters:
+ *   inst   - instance whose statistics are exposed;
+ *  Operation:
+ *   Creates <debugfs>/gpio_driver/<instance>/ with the statistics files. Like
+ *   every debugfs user the driver does not check the result, a missing
+ *   directory only hides the statistics.
+ */
+static void GpioDebugfsCreate(struct gpio_instance *inst)
+{
+    inst->debugfs = debugfs_create_dir(inst->name, gpio_debugfs_root);
+
+    debugfs_create_file("stats", 0444, inst->debugfs, inst, &gpio_stats_fops);
+    debugfs_create_file("pins", 0444, inst->debugfs, inst, &gpio_pins_fops);
+    debugfs_create_file("isr_hist", 0444, inst->debugfs, inst, &gpio_isr_hist_fops);
+    debugfs_create_file("latency_hist", 0444, inst->debugfs, inst, &gpio_latency_hist_fops);
+    debugfs_create_file_unsafe("reset", 0200, inst->debugfs, inst, &gpio_reset_fops);
+}
+
+/*
+ * GpioInstanceStop function
+ *  Parameters:
+ *   inst   - instance whose switch IRQs are already freed;
+ *  Operation:
+ *   Cancels the timers and the work of the instance, so none fires after its
+ *   pins are released, and releases the pins (clear all outputs, set all as
+ *   inputs and pull-none to minimize the power consumption).
+ */
+static void GpioInstanceStop(struct gpio_instance *inst)
+{
+    int i;
+
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        hrtimer_cancel(&inst->buttons[i].confirm);
+    }
+
+    /* The feedback work starts the playback timer. */
+    cancel_work_sync(&inst->expect.work);
+    hrtimer_cancel(&inst->playback.timer);
+    hrtimer_cancel(&inst->anim.timer);
+
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        hrtimer_cancel(&inst->leds[i].timer);
+    }
+
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        /* Clear GPIO pins. */
+        ClearGpioPin(inst->leds[i].pin);
+
+        /* Set GPIO pins as inputs and disable pull-ups. */
+        SetGpioPinDirection(inst->leds[i].pin, GPIO_DIRECTION_IN);
+        SetInternalPullUpDown(inst->buttons[i].pin, PULL_NONE);
+    }
+}
+
+/*
+ * GpioInstanceCreate function
+ *  Parameters:
+ *   minor  - minor number of the instance, selects its pin group;
+ *
+ *   return - the new instance, or an ERR_PTR() on failure
+ *  Operation:
+ *   Allocates the instance from the instance slab cache together with its event
+ *   ring, initializes the pins of its group, requests the switch IRQs and adds
+ *   the character device last, once the instance is ready to be opened.
+ */
+static struct gpio_instance *GpioInstanceCreate(unsigned int minor)
+{
+    struct gpio_instance *inst;
+    struct gpio_button *button;
+    int result;
+    int cpu;
+    int i;
+
+    inst = kmem_cache_zalloc(gpio_instance_cache, GFP_KERNEL);
+    if (!inst)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    inst->cpu_stats = alloc_percpu(struct gpio_cpu_stats);
+    if (!inst->cpu_stats)
+    {
+        result = -ENOMEM;
+        goto fail_no_stats;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        u64_stats_init(&per_cpu_ptr(inst->cpu_stats, cpu)->syncp);
+    }
+
+    /* The first instance keeps the name of the single instance driver. */
+    inst->minor = minor;
+    if (minor == 0)
+    {
+        strscpy(inst->name, DEVICE_NAME, sizeof(inst->name));
+    }
+    else
+    {
+        snprintf(inst->name, sizeof(inst->name), DEVICE_NAME "%u", minor);
+    }
+
+    /* Allocating a page for the event ring, it is mapped to user space. */
+    inst->ring = (struct gpio_ring *) get_zeroed_page(GFP_KERNEL);
+    if (!inst->ring)
+    {
+        result = -ENOMEM;
+        goto fail_no_ring;
+    }
+
+    /* Initialize event ring. */
+    inst->ring->magic = GPIO_RING_MAGIC;
+    inst->ring->version = GPIO_RING_VERSION;
+    inst->ring->size = GPIO_RING_SIZE;
+    inst->ring->event_size = sizeof(struct gpio_event);
+
+    spin_lock_init(&inst->ring_lock);
+    mutex_init(&inst->read_mutex);
+    init_waitqueue_head(&inst->wait);
+    mutex_init(&inst->play_mutex);
+    spin_lock_init(&inst->expect_lock);
+
+    /* Runtime configuration starts from the module parameters. */
+    inst->config.debounce_us = debounce_us;
+    inst->config.confirm_us = confirm_us;
+    inst->config.pulse_ms = pulse_ms;
+    inst->config.read_timeout_ms = read_timeout_ms;
+
+    /* Initialize playback timer. */
+    hrtimer_init(&inst->playback.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    inst->playback.timer.function = GpioPlaybackTick;
+
+    /* Initialize animation timer, its expiries are absolute. */
+    hrtimer_init(&inst->anim.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    inst->anim.timer.function = GpioAnimationTick;
+
+    /* Initialize input verification. */
+    INIT_WORK(&inst->expect.work, GpioExpectFeedback);
+
+    /* Initialize GPIO pins of the group. */
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        /* LEDS */
+        inst->leds[i].inst = inst;
+        inst->leds[i].pin = led_pins[minor * GPIO_GROUP_SIZE + i];
+        hrtimer_init(&inst->leds[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        inst->leds[i].timer.function = GpioLedPulseEnd;
+        SetGpioPinDirection(inst->leds[i].pin, GPIO_DIRECTION_OUT);
+
+        /* SWitches */
+        button = &inst->buttons[i];
+        button->inst = inst;
+        button->pin = switch_pins[minor * GPIO_GROUP_SIZE + i];
+        button->led = inst->leds[i].pin;
+        button->number = i + 1;
+        hrtimer_init(&button->confirm, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        button->confirm.function = GpioButtonConfirm;
+        SetInternalPullUpDown(button->pin, PULL_UP);
+        SetGpioPinDirection(button->pin, GPIO_DIRECTION_IN);
+    }
+
+    // Getting IRQ Numbers for the switch pins
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        button = &inst->buttons[i];
+        button->irq = gpio_to_irq(button->pin);
+
+        result = request_irq(button->irq, gpio_irq_handler_falling, IRQF_TRIGGER_FALLING, inst->name, button);
+        if (result)
+        {
+            printk(KERN_INFO "%s: IRQ GPIO %d ERROR\n", inst->name, button->pin);
+            goto free_irqs;
+        }
+    }
+
+    /* The instance can be opened from now on. */
+    cdev_init(&inst->cdev, &gpio_driver_fops);
+    inst->cdev.owner = THIS_MODULE;
+
+    result = cdev_add(&inst->cdev, MKDEV(gpio_driver_major, minor), 1);
+    if (result)
+    {
+        goto free_irqs;
+    }
+
+    printk(KERN_INFO "'mknod /dev/%s c %d %u'.\n", inst->name, gpio_driver_major, minor);
+
+    /* Statistics are optional, the instance works without them. */
+    GpioDebugfsCreate(inst);
+
+    return inst;
+
+free_irqs:
+    /* Freeing IRQ Lines */
+    while (i-- > 0)
+    {
+        free_irq(inst->buttons[i].irq, &inst->buttons[i]);
+    }
+
+    GpioInstanceStop(inst);
+
+    /* Freeing the event ring. */
+    free_page((unsigned long) inst->ring);
+
+fail_no_ring:
+    free_percpu(inst->cpu_stats);
+
+fail_no_stats:
+    kmem_cache_free(gpio_instance_cache, inst);
+
+    return ERR_PTR(result);
+}
+
+/*
+ * GpioInstanceDestroy function
+ *  Parameters:
+ *   inst   - instance to remove, none of its files may be open;
+ *  Operation:
+ *   Removes the character device first, then frees the instance in the reverse
+ *   order of GpioInstanceCreate().
+ */
+static void GpioInstanceDestroy(struct gpio_instance *inst)
+{
+    struct gpio_counters counters;
+    int i;
+
+    debugfs_remove_recursive(inst->debugfs);
+    cdev_del(&inst->cdev);
+
+    for (i = 0; i < GPIO_GROUP_SIZE; i++)
+    {
+        free_irq(inst->buttons[i].irq, &inst->buttons[i]);
+    }
+
+    GpioInstanceStop(inst);
+
+    GpioCountersRead(inst, &counters);
+    printk(KERN_INFO "%s: %llu IRQs, ISR time avg %llu ns, max %llu ns\n",
+           inst->name, counters.irq_count,
+           counters.irq_count ? div64_u64(counters.isr_ns_total, counters.irq_count) : 0,
+           counters.isr_ns_max);
+
+    /* Freeing the event ring. */
+    free_page((unsigned long) inst->ring);
+    free_percpu(inst->cpu_stats);
+
+    kmem_cache_free(gpio_instance_cache, inst);
+}
+
+/*
+ * GpioPinsValidate function
+ *
+ *   return - 0 if the pin groups can be used, -EINVAL otherwise
+ *  Operation:
+ *   Every instance needs GPIO_GROUP_SIZE LED and switch lines, each of them on
+ *   the p1 connector (GPIO_02 - GPIO_27) and used only once.
+ */
+static int GpioPinsValidate(void)
+{
+    u64 used = 0;
+    int pin;
+    int i;
+
+    if (led_pins_count == 0 || led_pins_count % GPIO_GROUP_SIZE || switch_pins_count != led_pins_count)
+    {
+        printk(KERN_INFO "gpio_driver: led_pins and switch_pins need %d pins per instance\n", GPIO_GROUP_SIZE);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < 2 * led_pins_count; i++)
+    {
+        pin = i < led_pins_count ? led_pins[i] : switch_pins[i - led_pins_count];
+
+        if (pin < GPIO_02 || pin > GPIO_27)
+        {
+            printk(KERN_INFO "gpio_driver: GPIO %d is not on the p1 connector\n", pin);
+            return -EINVAL;
+        }
+
+        if (used & (1ULL << pin))
+        {
+            printk(KERN_INFO "gpio_driver: GPIO %d is used twice\n", pin);
+            return -EINVAL;
+        }
+
+        used |= 1ULL << pin;
+    }
+
+    return 0;
+}
+
+/*
+ * GpioConfigValidate function
+ *  Parameters:
+ *   config - configuration from user space or the module parameters;
+ *
+ *   return - 0 if the values are in range, -EINVAL otherwise
+ *  Operation:
+ *   Bounds the debounce, confirmation and pulse times before they become
+ *   hrtimer intervals in ns, and the read timeout before it becomes jiffies.
+ */
+static int GpioConfigValidate(const struct gpio_config *config)
+{
+    if (config->debounce_us > GPIO_CONFIG_DEBOUNCE_MAX_US || config->confirm_us > GPIO_CONFIG_CONFIRM_MAX_US
+        || config->pulse_ms > GPIO_CONFIG_PULSE_MAX_MS || config->read_timeout_ms > GPIO_CONFIG_TIMEOUT_MAX_MS)
+    {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Initialization:
+ *  1. Validate the pin groups, the configuration and the peripheral base
+ *  2. Precompute the pin register table
+ *  3. Create the instance slab cache
+ *  4. Register device driver, one minor per pin group
+ *  5. Map GPIO Physical address space to virtual address
+ *  6. Create the debugfs directory
+ *  7. Create the instances (buffers, event ring, GPIO pins, IRQs, cdev, statistics)
+ */
+static int gpio_driver_init(void)
+{
+    struct gpio_instance *inst;
+    struct gpio_config config = { debounce_us, confirm_us, pulse_ms, read_timeout_ms };
+    dev_t devt;
+    int result = -1;
+    unsigned int i;
+
+    printk(KERN_INFO "Inserting gpio_driver module\n");
+
+    /* The event ring has to fit in the single page mapped to user space. */
+    BUILD_BUG_ON(sizeof(struct gpio_ring) > GPIO_RING_MMAP_LEN);
+
+    result = GpioPinsValidate();
+    if (result)
+    {
+        return result;
+    }
+
+    if (GpioConfigValidate(&config))
+    {
+        printk(KERN_INFO "gpio_driver: debounce_us, confirm_us, pulse_ms or read_timeout_ms out of range\n");
+        return -EINVAL;
+    }
+
+    if (peri_base == 0 || peri_base & (PAGE_SIZE - 1))
+    {
+        printk(KERN_INFO "gpio_driver: invalid peri_base 0x%lx\n", peri_base);
+        return -EINVAL;
+    }
+
+    GpioPinTableInit();
+
+    gpio_instance_count = led_pins_count / GPIO_GROUP_SIZE;
+
+    gpio_instance_cache = kmem_cache_create("gpio_driver_instance", sizeof(struct gpio_instance), 0,
+                                            SLAB_HWCACHE_ALIGN, NULL);
+    if (!gpio_instance_cache)
+    {
+        return -ENOMEM;
+    }
+
+    /* Registering device. */
+    result = alloc_chrdev_region(&devt, 0, gpio_instance_count, DEVICE_NAME);
+    if (result < 0)
+    {
+        printk(KERN_INFO "gpio_driver: cannot obtain major number\n");
+        goto fail_no_region;
+    }
+
+    gpio_driver_major = MAJOR(devt);
+    printk(KERN_INFO "gpio_driver major number is %d\n", gpio_driver_major);
+
+    /* map the GPIO register space from PHYSICAL address space to virtual address space */
+    virt_gpio_base = ioremap(peri_base + GPIO_BASE_OFFSET, GPIO_ADDR_SPACE_LEN);
+    if(!virt_gpio_base)
+    {
+        result = -ENOMEM;
+        goto fail_no_virt_mem;
+    }
+
+    gpio_debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    for (i = 0; i < gpio_instance_count; i++)
+    {
+        inst = GpioInstanceCreate(i);
+        if (IS_ERR(inst))
+        {
+            result = PTR_ERR(inst);
+            goto fail_instance;
+        }
+
+        gpio_instances[i] = inst;
+    }
+
+    return 0;
+
+fail_instance:
+    while (i-- > 0)
+    {
+        GpioInstanceDestroy(gpio_instances[i]);
+        gpio_instances[i] = NULL;
+    }
+
+    debugfs_remove_recursive(gpio_debugfs_root);
+    iounmap(virt_gpio_base);
+
+fail_no_virt_mem:
+    /* Freeing the minor numbers. */
+    unregister_chrdev_region(devt, gpio_instance_count);
+
+fail_no_region:
+    kmem_cache_destroy(gpio_instance_cache);
+
+    return result;
+}
+
+/*
+ * Cleanup:
+ *  1. Destroy the instances (release GPIO pins, free IRQs, buffers and event rings)
+ *     and remove the debugfs directory
+ *  2. Unmap GPIO Physical address space from virtual address
+ *  3. Unregister device driver
+ *  4. Destroy the instance slab cache
+ */
+static void gpio_driver_exit(void)
+{
+    unsigned int i;
+
+    printk(KERN_INFO "Removing gpio_driver module\n");
+
+    for (i = 0; i < gpio_instance_count; i++)
+    {
+        GpioInstanceDestroy(gpio_instances[i]);
+        gpio_instances[i] = NULL;
+    }
+
+    debugfs_remove_recursive(gpio_debugfs_root);
+
+    /* Unmap GPIO Physical address space. */
+    if (virt_gpio_base)
+    {
+        iounmap(virt_gpio_base);
+    }
+
+    /* Freeing the major number. */
+    unregister_chrdev_region(MKDEV(gpio_driver_major, 0), gpio_instance_count);
+
+    kmem_cache_destroy(gpio_instance_cache);
+}
+
+/* File open function. */
+static int gpio_driver_open(struct inode *inode, struct file *filp)
+{
+    struct gpio_session *session;
+
+    /* Initialize driver variables here. */
+    session = kzalloc(sizeof(*session), GFP_KERNEL);
+    if (!session)
+    {
+        return -ENOMEM;
+    }
+
+    /* Every minor is an instance of its own. */
+    session->inst = container_of(inode->i_cdev, struct gpio_instance, cdev);
+    filp->private_data = session;
+
+    /* The device is a stream of presses, it has no file position. */
+    return nonseekable_open(inode, filp);
+}
+
+/* File close function. */
+static int gpio_driver_release(struct inode *inode, struct file *filp)
+{
+    struct gpio_session *session = filp->private_data;
+    struct gpio_instance *inst = session->inst;
+    struct gpio_expect none = { .count = 0 };
+
+    /* Give up the event ring, the next consumer may claim it. */
+    mutex_lock(&inst->read_mutex);
+    if (session->consumer)
+    {
+        inst->ring_owner = NULL;
+
+        /* The next consumer does not inherit the expected input. */
+        GpioExpectArm(inst, &none);
+    }
+    mutex_unlock(&inst->read_mutex);
+
+    kfree(session);
+
+    /* Success. */
+    return 0;
+}
+
+/*
+ * GpioSessionClaimLocked function
+ *  Parameters:
+ *   session - session of the file consuming events;
+ *
+ *   return - 0 if the session owns the event ring, -EBUSY if another one does
+ *  Operation:
+ *   The first session which reads, polls or maps the device becomes the event
+ *   ring consumer until it is closed. Its cursor starts at the current head, so
+ *   presses made before the session started are not delivered to it.
+ *   Must be called with the read_mutex of the instance held.
+ */
+static int GpioSessionClaimLocked(struct gpio_session *session)
+{
+    struct gpio_instance *inst = session->inst;
+
+    lockdep_assert_held(&inst->read_mutex);
+
+    if (inst->ring_owner == session)
+    {
+        return 0;
+    }
+
+    if (inst->ring_owner)
+    {
+        return -EBUSY;
+    }
+
+    inst->ring_owner = session;
+    session->consumer = 1;
+    smp_store_release(&inst->ring->tail, smp_load_acquire(&inst->ring_head));
+
+    return 0;
+}
+
+/*
+ * GpioSessionClaim function
+ *  Parameters:
+ *   filp   - file consuming events;
+ *
+ *   return - 0 if the session of the file owns the event ring, -EBUSY otherwise
+ */
+static int GpioSessionClaim(struct file *filp)
+{
+    struct gpio_session *session = filp->private_data;
+    int ret;
+
+    mutex_lock(&session->inst->read_mutex);
+    ret = GpioSessionClaimLocked(session);
+    mutex_unlock(&session->inst->read_mutex);
+
+    return ret;
+}
+
+/*
+ * GpioRingReady function
+ *  Parameters:
+ *   inst   - instance of the event ring;
+ *
+ *   return - non-zero if at least one event is waiting in the event ring and
+ *            no armed verification holds the presses back until their verdict
+ */
+static int GpioRingReady(struct gpio_instance *inst)
+{
+    if (READ_ONCE(inst->expect.count) && !(READ_ONCE(inst->expect.flags) & GPIO_EXPECT_F_PROGRESS))
+    {
+        return 0;
+    }
+
+    return smp_load_acquire(&inst->ring_head) != READ_ONCE(inst->ring->tail);
+}
+
+/*
+ * File read function
+ *  Parameters:
+ *   filp  - a type file structure;
+ *   buf   - a buffer, from which the user space function (fread) will read;
+ *   len - a counter with the number of bytes to transfer, which has the same
+ *           value as the usual counter in the user space function (fread);
+ *   f_pos - a position of where to start reading the file;
+ *  Operation:
+ *   The gpio_driver_read function consumes button events from the event ring and
+ *   transfers them to user space as ASCII button numbers with the function
+ *   copy_to_user. If no press is recorded yet, the caller sleeps until one arrives
+ *   (at most read_timeout_ms when it is set), or gets -EAGAIN when the file is
+ *   opened with O_NONBLOCK. A timed out read returns 0.
+ */
+static ssize_t gpio_driver_read(struct file *filp, char __user *buf, size_t len, loff_t *f_pos)
+{
+    /* Size of valid data in gpio_driver - data to send in user space. */
+    int data_size = 0;
+    char sequence[BUF_LEN];
+    struct gpio_session *session = filp->private_data;
+    struct gpio_instance *inst = session->inst;
+    unsigned int timeout_ms = READ_ONCE(inst->config.read_timeout_ms);
+    struct gpio_event *ev;
+    long timeout = timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+    u32 head;
+    u32 tail;
+    u32 start;
+    /* Set when a pass took no slot: the ring was drained by another reader. */
+    int stalled = 0;
+    int ret;
+
+    /* Only the session owning the event ring may take events from it. */
+    ret = GpioSessionClaim(filp);
+    if (ret)
+    {
+        return ret;
+    }
+
+    /* Nothing could be copied, the events stay in the ring. */
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    /* Other events (e.g. end of playback) are skipped, wait until a press is taken. */
+    while (data_size == 0)
+    {
+        if (!GpioRingReady(inst) || stalled)
         {
-            return -EFAULT;
+            if (filp->f_flags & O_NONBLOCK)
+            {
+                return -EAGAIN;
+            }
+
+            timeout = wait_event_interruptible_timeout(inst->wait, GpioRingReady(inst) &&
+                          (!stalled || smp_load_acquire(&inst->ring_head) != head), timeout);
+            if (timeout == 0)
+            {
+                return 0;
+            }
+            if (timeout < 0)
+            {
+                return -ERESTARTSYS;
+            }
         }
-        else
+
+        mutex_lock(&inst->read_mutex);
+
+        head = smp_load_acquire(&inst->ring_head);
+        tail = READ_ONCE(inst->ring->tail);
+
+        /* Tail is writable from user space, do not trust it. */
+        if (head - tail > GPIO_RING_SIZE)
         {
-            (*f_pos) += data_size;
+            tail = head;
+        }
+        start = tail;
 
-            return data_size;
+        /* Take the recorded presses, converted to ASCII digits. */
+        while (tail != head && data_size < len && data_size < BUF_LEN)
+        {
+            ev = &inst->ring->events[tail & (GPIO_RING_SIZE - 1)];
+            if (ev->type == GPIO_EV_BUTTON)
+            {
+                sequence[data_size++] = '0' + ev->value;
+                GpioLatencyStat(inst, ev->timestamp_ns);
+                trace_gpio_read(inst->minor, ev->pin, ev->timestamp_ns, ev->seq);
+            }
+            tail++;
         }
+
+        /* Release the consumed slots to the producer. */
+        smp_store_release(&inst->ring->tail, tail);
+
+        mutex_unlock(&inst->read_mutex);
+
+        /* Copy again only after the tail moved, otherwise wait for the next event. */
+        stalled = tail == start;
     }
-    else
+
+    /* Send data to user space. */
+    if (copy_to_user(buf, sequence, data_size) != 0)
+    {
+        return -EFAULT;
+    }
+
+    atomic64_add(data_size, &inst->bytes_read);
+
+    return data_size;
+}
+
+/*
+ * GpioPollLatency function
+ *  Parameters:
+ *   inst   - instance reported readable;
+ *  Operation:
+ *   A consumer of the mapped ring takes the events without read(), so its
+ *   delivery is the poll() reporting them. The newest event is accounted once,
+ *   when poll() first reports the head it was stored at.
+ */
+static void GpioPollLatency(struct gpio_instance *inst)
+{
+    u32 head = smp_load_acquire(&inst->ring_head);
+    struct gpio_event *ev = &inst->ring->events[(head - 1) & (GPIO_RING_SIZE - 1)];
+
+    if (head != READ_ONCE(inst->latency_head))
+    {
+        WRITE_ONCE(inst->latency_head, head);
+        GpioLatencyStat(inst, ev->timestamp_ns);
+    }
+}
+
+/*
+ * File poll function
+ *  Parameters:
+ *   filp  - a type file structure;
+ *   wait  - poll table the caller sleeps on;
+ *  Operation:
+ *   Reports the device readable while an event is waiting, POLLPRI while no
+ *   pattern or animation is running and always writable. Polling for input claims the event
+ *   ring for the session, if another session owns it POLLERR is reported.
+ */
+static __poll_t gpio_driver_poll(struct file *filp, poll_table *wait)
+{
+    struct gpio_session *session = filp->private_data;
+    struct gpio_instance *inst = session->inst;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &inst->wait, wait);
+
+    /* Waiting for input makes the session the consumer, like read() does. */
+    if (poll_requested_events(wait) & (EPOLLIN | EPOLLRDNORM))
+    {
+        if (GpioSessionClaim(filp))
+        {
+            mask |= EPOLLERR;
+        }
+        else if (GpioRingReady(inst))
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+
+            /* read() accounts the delivery of the other sessions. */
+            if (session->mapped)
+            {
+                GpioPollLatency(inst);
+            }
+        }
+    }
+
+    if (!READ_ONCE(inst->playback.running) && !READ_ONCE(inst->anim.running))
+    {
+        mask |= EPOLLPRI;
+    }
+
+    return mask;
+}
+
+/*
+ * File mmap function
+ *  Parameters:
+ *   filp  - a type file structure;
+ *   vma   - user space area the event ring is mapped to;
+ *  Operation:
+ *   Maps the event ring page to user space, so presses can be consumed without
+ *   read() calls. Only a single page at offset 0 can be mapped, by the session
+ *   owning the event ring.
+ */
+static int gpio_driver_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct gpio_session *session = filp->private_data;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
+
+    if (vma->vm_pgoff != 0 || size > PAGE_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    /* The mapping process consumes the events, it has to own the event ring. */
+    ret = GpioSessionClaim(filp);
+    if (ret)
+    {
+        return ret;
+    }
+
+    ret = remap_pfn_range(vma, vma->vm_start, virt_to_phys(session->inst->ring) >> PAGE_SHIFT,
+                          size, vma->vm_page_prot);
+    if (ret == 0)
+    {
+        session->mapped = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * GpioPlaybackUpload function
+ *  Parameters:
+ *   inst   - instance playing the pattern;
+ *   steps  - user space address of the pattern steps;
+ *   count  - number of steps;
+ *
+ *   return - 0 on success, negative error code otherwise
+ *  Operation:
+ *   Copies the pattern from user space and starts playing it.
+ */
+static int GpioPlaybackUpload(struct gpio_instance *inst, const void __user *steps, u32 count)
+{
+    struct gpio_play_step *copy;
+
+    if (count > GPIO_PLAY_MAX_STEPS)
+    {
+        return -EINVAL;
+    }
+
+    copy = kmalloc(GPIO_PLAY_MAX_STEPS * sizeof(*copy), GFP_KERNEL);
+    if (!copy)
+    {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(copy, steps, count * sizeof(*copy)) != 0)
+    {
+        kfree(copy);
+        return -EFAULT;
+    }
+
+    GpioPlaybackStart(inst, copy, count, 0);
+    kfree(copy);
+
+    return 0;
+}
+
+/*
+ * GpioAnimationUpload function
+ *  Parameters:
+ *   inst   - instance playing the animation;
+ *   animation - GPIO_IOC_ANIMATE argument, already copied from user space;
+ *
+ *   return - 0 on success, negative error code otherwise
+ *  Operation:
+ *   Checks the tick, copies the frames from user space and starts playing them.
+ */
+static int GpioAnimationUpload(struct gpio_instance *inst, const struct gpio_animation *animation)
+{
+    struct gpio_anim_frame *copy;
+    u32 tick_us = animation->tick_us;
+
+    if (tick_us == 0)
+    {
+        tick_us = clamp(READ_ONCE(pwm_tick_us), (unsigned int) GPIO_ANIM_TICK_MIN_US,
+                        (unsigned int) GPIO_ANIM_TICK_MAX_US);
+    }
+
+    if (animation->count > GPIO_ANIM_MAX_FRAMES || tick_us < GPIO_ANIM_TICK_MIN_US
+        || tick_us > GPIO_ANIM_TICK_MAX_US)
+    {
+        return -EINVAL;
+    }
+
+    copy = kmalloc(GPIO_ANIM_MAX_FRAMES * sizeof(*copy), GFP_KERNEL);
+    if (!copy)
+    {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(copy, u64_to_user_ptr(animation->frames), animation->count * sizeof(*copy)) != 0)
+    {
+        kfree(copy);
+        return -EFAULT;
+    }
+
+    GpioAnimationStart(inst, copy, animation->count, tick_us);
+    kfree(copy);
+
+    return 0;
+}
+
+/*
+ * GpioCommand function
+ *  Parameters:
+ *   inst   - instance the command is written to;
+ *   header - header of the binary command;
+ *   records - user space address of the records following the header;
+ *   len    - length of the records in bytes;
+ *
+ *   return - 0 on success, negative error code otherwise
+ *  Operation:
+ *   Executes a binary command written to the device.
+ */
+static int GpioCommand(struct gpio_instance *inst, const struct gpio_cmd_header *header, const char __user *records,
+                       size_t len)
+{
+    struct gpio_frame frame;
+
+    switch (header->type)
     {
+    case GPIO_CMD_PLAY:
+        if (len != header->count * sizeof(struct gpio_play_step))
+        {
+            return -EINVAL;
+        }
+
+        return GpioPlaybackUpload(inst, records, header->count);
+
+    case GPIO_CMD_FRAME:
+        if (header->count != 1 || len != sizeof(frame))
+        {
+            return -EINVAL;
+        }
+
+        if (copy_from_user(&frame, records, sizeof(frame)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        GpioLedsFrame(inst, frame.leds);
+
         return 0;
+
+    default:
+        return -EINVAL;
     }
 }
 
@@ -739,56 +2636,300 @@ static ssize_t gpio_driver_read(struct file *filp, char *buf, size_t len, loff_t
  *   f_pos - a position of where to start writing in the file;
  *  Operation:
  *   The function copy_from_user transfers the data from user space to kernel space.
+ *   Data starting with GPIO_CMD_MAGIC is a binary command (see gpio_driver.h),
+ *   anything else is the text "LEDn v" command.
  */
-static ssize_t gpio_driver_write(struct file *filp, const char *buf, size_t len, loff_t *f_pos)
+static ssize_t gpio_driver_write(struct file *filp, const char __user *buf, size_t len, loff_t *f_pos)
 {
-    /* Reset memory. */
-    memset(gpio_driver_buffer, 0, BUF_LEN);
+    struct gpio_session *session = filp->private_data;
+    struct gpio_instance *inst = session->inst;
+    /* Private to the call, writers on other CPUs never share it. */
+    char gpio_driver_buffer[BUF_LEN];
+    struct gpio_cmd_header header;
+    size_t size;
+    int led;
+    int ret;
+
+    /* Binary commands start with a magic number. */
+    if (len >= sizeof(header))
+    {
+        if (copy_from_user(&header, buf, sizeof(header)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if (header.magic == GPIO_CMD_MAGIC)
+        {
+            trace_gpio_command(inst->minor, 0, READ_ONCE(inst->event_seq), header.type, header.count, len);
+
+            /* Like GPIO_IOC_PLAY, a pattern is played only for the event ring owner. */
+            if (header.type == GPIO_CMD_PLAY)
+            {
+                ret = GpioSessionClaim(filp);
+                if (ret)
+                {
+                    return ret;
+                }
+            }
+
+            ret = GpioCommand(inst, &header, buf + sizeof(header), len - sizeof(header));
+            if (ret)
+            {
+                return ret;
+            }
+
+            atomic64_add(len, &inst->bytes_written);
+            return len;
+        }
+    }
+
+    /* Text commands are short, never copy more than the buffer holds. */
+    size = min_t(size_t, len, BUF_LEN - 1);
 
     /* Get data from user space.*/
-    if (copy_from_user(gpio_driver_buffer, buf, len) != 0)
+    if (copy_from_user(gpio_driver_buffer, buf, size) != 0)
     {
         return -EFAULT;
     }
     else
     {
+        gpio_driver_buffer[size] = '\0';
+
         if (strstr(gpio_driver_buffer, "LED") && strlen(gpio_driver_buffer) >= 5)
         {
             if ( gpio_driver_buffer[3] == '1')
             {
                 if (gpio_driver_buffer[5] == '1')
-                    SetGpioPin(GPIO_06);
+                    SetGpioPin(inst->leds[0].pin);
                 else
-                    ClearGpioPin(GPIO_06);
+                    ClearGpioPin(inst->leds[0].pin);
             }
             else if (gpio_driver_buffer[3] == '2')
             {
                 if (gpio_driver_buffer[5] == '1')
-                    SetGpioPin(GPIO_13);
+                    SetGpioPin(inst->leds[1].pin);
                 else
-                    ClearGpioPin(GPIO_13);
+                    ClearGpioPin(inst->leds[1].pin);
             }
             else if (gpio_driver_buffer[3] == '3')
             {
                 if (gpio_driver_buffer[5] == '1')
-                    SetGpioPin(GPIO_19);
+                    SetGpioPin(inst->leds[2].pin);
                 else
-                    ClearGpioPin(GPIO_19);
+                    ClearGpioPin(inst->leds[2].pin);
             }
             else if (gpio_driver_buffer[3] == '4')
             {
                 if (gpio_driver_buffer[5] == '1')
-                    SetGpioPin(GPIO_26);
+                    SetGpioPin(inst->leds[3].pin);
                 else
-                    ClearGpioPin(GPIO_26);
+                    ClearGpioPin(inst->leds[3].pin);
             }
 
-            /* Reset memory. */
-             memset(gpio_driver_buffer, 0, BUF_LEN);
+            if (gpio_driver_buffer[3] >= '1' && gpio_driver_buffer[3] <= '4')
+            {
+                led = gpio_driver_buffer[3] - '1';
+                trace_gpio_command(inst->minor, inst->leds[led].pin, READ_ONCE(inst->event_seq),
+                                   GPIO_TRACE_CMD_TEXT, gpio_driver_buffer[5] == '1', size);
+
+                if (gpio_driver_buffer[5] == '1')
+                    GpioLedsStored(inst, 1 << led, 0);
+                else
+                    GpioLedsStored(inst, 0, 1 << led);
+            }
 
+            atomic64_add(size, &inst->bytes_written);
             return len;
         }
         
         return 0;
     }
 }
+
+/*
+ * File ioctl function
+ *  Parameters:
+ *   filp  - a type file structure;
+ *   cmd   - GPIO_IOC_* request;
+ *   arg   - user space address of the request argument;
+ *  Operation:
+ *   Binary control plane of the driver, see gpio_driver.h.
+ */
+static long gpio_driver_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_session *session = filp->private_data;
+    struct gpio_instance *inst = session->inst;
+    void __user *argp = (void __user *) arg;
+    struct gpio_version version;
+    struct gpio_leds leds;
+    struct gpio_frame frame;
+    struct gpio_config config;
+    struct gpio_stats stats;
+    struct gpio_play play;
+    struct gpio_expect expect;
+    struct gpio_animation animation;
+    struct gpio_anim_stats anim_stats;
+    struct gpio_play_stats play_stats;
+    struct gpio_counters counters;
+    u32 switches;
+    int ret;
+    int i;
+
+    switch (cmd)
+    {
+    case GPIO_IOC_GET_VERSION:
+        version.abi = GPIO_ABI_VERSION;
+        version.ring = GPIO_RING_VERSION;
+        version.leds = GPIO_GROUP_SIZE;
+        version.buttons = GPIO_GROUP_SIZE;
+
+        return copy_to_user(argp, &version, sizeof(version)) ? -EFAULT : 0;
+
+    case GPIO_IOC_SET_LEDS:
+        if (copy_from_user(&leds, argp, sizeof(leds)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        GpioLedsApply(inst, leds.set, leds.clear);
+
+        return 0;
+
+    case GPIO_IOC_SET_FRAME:
+        if (copy_from_user(&frame, argp, sizeof(frame)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        GpioLedsFrame(inst, frame.leds);
+
+        return 0;
+
+    case GPIO_IOC_GET_SWITCHES:
+        switches = 0;
+        for (i = 0; i < GPIO_GROUP_SIZE; i++)
+        {
+            /* Switches are pulled up, a pressed switch reads low. */
+            if (GetGpioPinValue(inst->buttons[i].pin) == 0)
+            {
+                switches |= 1 << i;
+            }
+        }
+
+        return put_user(switches, (u32 __user *) argp);
+
+    case GPIO_IOC_GET_CONFIG:
+        config.debounce_us = READ_ONCE(inst->config.debounce_us);
+        config.confirm_us = READ_ONCE(inst->config.confirm_us);
+        config.pulse_ms = READ_ONCE(inst->config.pulse_ms);
+        config.read_timeout_ms = READ_ONCE(inst->config.read_timeout_ms);
+
+        return copy_to_user(argp, &config, sizeof(config)) ? -EFAULT : 0;
+
+    case GPIO_IOC_SET_CONFIG:
+        if (copy_from_user(&config, argp, sizeof(config)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if (GpioConfigValidate(&config))
+        {
+            return -EINVAL;
+        }
+
+        WRITE_ONCE(inst->config.debounce_us, config.debounce_us);
+        WRITE_ONCE(inst->config.confirm_us, config.confirm_us);
+        WRITE_ONCE(inst->config.pulse_ms, config.pulse_ms);
+        WRITE_ONCE(inst->config.read_timeout_ms, config.read_timeout_ms);
+
+        return 0;
+
+    case GPIO_IOC_GET_STATS:
+        memset(&stats, 0, sizeof(stats));
+        GpioCountersRead(inst, &counters);
+        stats.irq_count = counters.irq_count;
+        stats.isr_ns_total = counters.isr_ns_total;
+        stats.isr_ns_max = counters.isr_ns_max;
+        stats.overruns = READ_ONCE(inst->ring_overruns);
+
+        return copy_to_user(argp, &stats, sizeof(stats)) ? -EFAULT : 0;
+
+    case GPIO_IOC_PLAY:
+        /* The end of the pattern is stored in the event ring, only its owner may play. */
+        ret = GpioSessionClaim(filp);
+        if (ret)
+        {
+            return ret;
+        }
+
+        if (copy_from_user(&play, argp, sizeof(play)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        return GpioPlaybackUpload(inst, u64_to_user_ptr(play.steps), play.count);
+
+    case GPIO_IOC_EXPECT:
+        if (copy_from_user(&expect, argp, sizeof(expect)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        /* Verification holds back the presses of the owner, no other session may arm it. */
+        mutex_lock(&inst->read_mutex);
+        ret = GpioSessionClaimLocked(session);
+
+        /* read() passes on presses only, the verdicts reach just the mapping. */
+        if (ret == 0 && expect.count && !session->mapped)
+        {
+            ret = -EOPNOTSUPP;
+        }
+
+        if (ret == 0)
+        {
+            ret = GpioExpectArm(inst, &expect);
+        }
+        mutex_unlock(&inst->read_mutex);
+
+        return ret;
+
+    case GPIO_IOC_ANIMATE:
+        /* Like a pattern, the end of the animation goes to the owner. */
+        ret = GpioSessionClaim(filp);
+        if (ret)
+        {
+            return ret;
+        }
+
+        if (copy_from_user(&animation, argp, sizeof(animation)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        return GpioAnimationUpload(inst, &animation);
+
+    case GPIO_IOC_GET_ANIM_STATS:
+        memset(&anim_stats, 0, sizeof(anim_stats));
+        anim_stats.tick_us = READ_ONCE(inst->anim.tick_us);
+        anim_stats.ticks = atomic64_read(&inst->anim.ticks);
+        anim_stats.late_ns_total = atomic64_read(&inst->anim.late_ns_total);
+        anim_stats.late_ns_max = atomic64_read(&inst->anim.late_ns_max);
+        anim_stats.overruns = atomic64_read(&inst->anim.overruns);
+
+        return copy_to_user(argp, &anim_stats, sizeof(anim_stats)) ? -EFAULT : 0;
+
+    case GPIO_IOC_GET_PLAY_STATS:
+        memset(&play_stats, 0, sizeof(play_stats));
+        play_stats.deadlines = atomic64_read(&inst->playback.deadlines);
+        play_stats.late_ns_total = atomic64_read(&inst->playback.late_ns_total);
+        play_stats.late_ns_max = atomic64_read(&inst->playback.late_ns_max);
+        play_stats.last_deadlines = atomic64_read(&inst->playback.last_deadlines);
+        play_stats.last_late_ns_total = atomic64_read(&inst->playback.last_late_ns_total);
+        play_stats.last_late_ns_max = atomic64_read(&inst->playback.last_late_ns_max);
+
+        return copy_to_user(argp, &play_stats, sizeof(play_stats)) ? -EFAULT : 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
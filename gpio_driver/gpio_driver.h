@@ -0,0 +1,331 @@
+/*
+ * gpio_driver.h
+ *
+ * Interface shared between the gpio_driver kernel module and user space
+ * applications (simon_game). Everything defined here is part of the driver
+ * ABI, so fields may only be appended and never reordered.
+ */
+#ifndef GPIO_DRIVER_H
+#define GPIO_DRIVER_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Device node created for the driver. This is the first instance (minor 0),
+ * the module serves one instance per pin group (see the led_pins and
+ * switch_pins module parameters) and instance N is minor N, by convention
+ * /dev/gpio_driverN. Instances are independent, each has its own event ring,
+ * playback, configuration and statistics.
+ */
+#define GPIO_DRIVER_DEVICE "/dev/gpio_driver"
+
+/*
+ * Event ring
+ *
+ * Button presses are stored as fixed size binary records in a single page
+ * ring buffer which can be mapped to user space with mmap (offset 0, length
+ * GPIO_RING_MMAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED).
+ *
+ * The IRQ handler is the only producer and advances 'head'. The consumer
+ * (either the mapping process or read() on its behalf) advances 'tail'.
+ * Both are free running counters, the slot is 'counter & (size - 1)'.
+ * 'head' and 'overruns' are copies of the driver state: the driver never
+ * reads them back, a store through the mapping is lost at the next event.
+ *
+ * When the ring is full new events are dropped, never overwritten: the
+ * 'overruns' counter is incremented and the next stored event carries
+ * GPIO_EV_F_OVERRUN. Every event (dropped or not) consumes a sequence
+ * number, so a consumer can also see how many events it lost from the gap.
+ */
+#define GPIO_RING_MAGIC    (0x474E5247) /* "GRNG" */
+#define GPIO_RING_VERSION  (1)
+#define GPIO_RING_SIZE     (128)        /* Must be a power of two. */
+#define GPIO_RING_MMAP_LEN (4096)
+
+/* Event types. */
+#define GPIO_EV_BUTTON     (1)
+#define GPIO_EV_PLAYBACK   (2) /* Playback finished, value is the number of steps played. */
+#define GPIO_EV_VERDICT    (3) /* Input verification, value is GPIO_VERDICT(), see GPIO_IOC_EXPECT. */
+
+/* Edge that triggered the event. */
+#define GPIO_EDGE_FALLING  (0)
+#define GPIO_EDGE_RISING   (1)
+
+/* Event flags. */
+#define GPIO_EV_F_OVERRUN  (0x1) /* Events were dropped before this one. */
+
+struct gpio_event
+{
+    __u64 timestamp_ns; /* ktime_get_ns() when the edge was handled. */
+    __u32 seq;          /* Sequence number of the event. */
+    __u16 type;         /* GPIO_EV_* */
+    __u8  pin;          /* GPIO line which raised the event. */
+    __u8  edge;         /* GPIO_EDGE_* */
+    __u32 value;        /* Button number (1-4) for GPIO_EV_BUTTON, see GPIO_EV_*. */
+    __u32 flags;        /* GPIO_EV_F_* */
+};
+
+struct gpio_ring
+{
+    /* Read only description of the ring. */
+    __u32 magic;
+    __u32 version;
+    __u32 size;         /* Number of event slots. */
+    __u32 event_size;   /* sizeof(struct gpio_event) */
+    __u32 reserved0[12];
+
+    /* Written by the producer (driver) only. */
+    __u32 head;
+    __u32 overruns;     /* Number of events dropped because the ring was full. */
+    __u32 reserved1[14];
+
+    /* Written by the consumer only. */
+    __u32 tail;
+    __u32 reserved2[15];
+
+    struct gpio_event events[GPIO_RING_SIZE];
+};
+
+/*
+ * Binary commands
+ *
+ * A write() starting with GPIO_CMD_MAGIC is a binary command instead of the
+ * text "LEDn v" protocol. The header is followed by 'count' records of the
+ * type given by 'type', and the whole command has to be written at once.
+ */
+#define GPIO_CMD_MAGIC     (0x444D4347) /* "GCMD" */
+
+/* Command types. */
+#define GPIO_CMD_PLAY      (1) /* Records are struct gpio_play_step. */
+#define GPIO_CMD_FRAME     (2) /* One struct gpio_frame record. */
+
+struct gpio_cmd_header
+{
+    __u32 magic;        /* GPIO_CMD_MAGIC */
+    __u16 type;         /* GPIO_CMD_* */
+    __u16 count;        /* Number of records following the header. */
+};
+
+/*
+ * LED frame
+ *
+ * Complete LED state: LEDs in 'leds' (bit 0 is LED1) are lit and all the
+ * others are switched off at the same time, with a single register store
+ * for each of the two.
+ */
+struct gpio_frame
+{
+    __u32 leds;
+};
+
+/*
+ * Playback
+ *
+ * GPIO_CMD_PLAY uploads a pattern which the driver plays from a high
+ * resolution timer: for every step the LEDs in 'led_mask' (bit 0 is LED1)
+ * are lit for 'on_us' and then dark for 'off_us'. Step deadlines are
+ * absolute, so the timing errors do not add up over the pattern.
+ *
+ * Uploading a pattern replaces the one being played, and a command with no
+ * steps just stops the playback. When the last step ends a GPIO_EV_PLAYBACK
+ * event is stored in the event ring. poll() reports POLLPRI while no
+ * playback is running. As the event goes to the ring, GPIO_CMD_PLAY,
+ * GPIO_IOC_PLAY, GPIO_IOC_ANIMATE and GPIO_IOC_EXPECT claim the ring like
+ * read() does and fail with EBUSY while another session owns it.
+ *
+ * GPIO_IOC_GET_PLAY_STATS reports the overshoot of the steps, the delay of
+ * the timer after each deadline (the end of the on and of the off phase).
+ */
+#define GPIO_PLAY_MAX_STEPS (64)
+
+struct gpio_play_step
+{
+    __u32 led_mask;     /* LEDs lit during the step. */
+    __u32 on_us;        /* Time the LEDs are lit. */
+    __u32 off_us;       /* Time the LEDs are dark after it. */
+};
+
+/*
+ * ioctl control plane
+ *
+ * Binary replacement of the text protocol. GPIO_IOC_GET_VERSION returns
+ * GPIO_ABI_VERSION, which is incremented whenever a request is added;
+ * existing requests and structures never change, their size is part of
+ * the request number.
+ */
+#define GPIO_ABI_VERSION   (5)
+
+struct gpio_version
+{
+    __u32 abi;          /* GPIO_ABI_VERSION */
+    __u32 ring;         /* GPIO_RING_VERSION */
+    __u32 leds;         /* Number of LEDs. */
+    __u32 buttons;      /* Number of buttons. */
+};
+
+/* LEDs in 'set' are lit, LEDs in 'clear' are switched off (bit 0 is LED1). */
+struct gpio_leds
+{
+    __u32 set;
+    __u32 clear;
+};
+
+/* Runtime configuration, the same values as the module parameters. */
+#define GPIO_CONFIG_DEBOUNCE_MAX_US (1000000)
+#define GPIO_CONFIG_CONFIRM_MAX_US  (1000000)
+#define GPIO_CONFIG_PULSE_MAX_MS    (10000)
+#define GPIO_CONFIG_TIMEOUT_MAX_MS  (3600000)
+
+struct gpio_config
+{
+    __u32 debounce_us;  /* Per button debounce window. */
+    __u32 confirm_us;   /* Level confirmation delay, 0 disables it. */
+    __u32 pulse_ms;     /* LED pulse on button press, 0 disables it. */
+    __u32 read_timeout_ms; /* Blocking read timeout, 0 waits forever. */
+};
+
+struct gpio_stats
+{
+    __u64 irq_count;    /* IRQ handler invocations. */
+    __u64 isr_ns_total; /* Time spent in the IRQ handler. */
+    __u64 isr_ns_max;   /* Longest IRQ handler invocation. */
+    __u32 overruns;     /* Events dropped on a full event ring. */
+    __u32 reserved;
+};
+
+/* Pattern for GPIO_IOC_PLAY, 'steps' points to 'count' struct gpio_play_step. */
+struct gpio_play
+{
+    __u32 count;
+    __u32 reserved;
+    __u64 steps;
+};
+
+/*
+ * Input verification
+ *
+ * GPIO_IOC_EXPECT uploads the buttons the player has to press. The driver
+ * checks every accepted press against the next expected button and stores
+ * a GPIO_EV_VERDICT event after the GPIO_EV_BUTTON one. While verification
+ * is armed presses are still stored, but only verdicts wake the consumer,
+ * so a whole turn costs a single wakeup. A wrong press or the last expected
+ * one disarms verification, as does a GPIO_IOC_EXPECT with count 0.
+ *
+ * With GPIO_EXPECT_F_PLAY_WRONG / GPIO_EXPECT_F_PLAY_COMPLETE the driver
+ * starts the feedback pattern ('step' played 'repeat' times) by itself.
+ * POLLPRI is not reported from the verdict until that pattern is over.
+ *
+ * Verdicts are delivered through the mapped event ring only, read() skips
+ * them like every other event but the presses. Arming fails with EOPNOTSUPP
+ * unless the session mapped the ring, disarming (count 0) always works.
+ * Arming discards the events left in the ring (the tail moves to the head),
+ * so every press found after it is one the driver judges.
+ */
+#define GPIO_EXPECT_MAX             (64)
+
+#define GPIO_EXPECT_F_PROGRESS      (0x1) /* Verdict (and wakeup) for every correct press too. */
+#define GPIO_EXPECT_F_PLAY_WRONG    (0x2) /* Play 'wrong' after a wrong press. */
+#define GPIO_EXPECT_F_PLAY_COMPLETE (0x4) /* Play 'complete' after the last press. */
+
+/* Verdict kinds. */
+#define GPIO_VERDICT_PROGRESS       (1) /* Index presses were correct so far. */
+#define GPIO_VERDICT_WRONG          (2) /* Press number index (from 0) was wrong. */
+#define GPIO_VERDICT_COMPLETE       (3) /* All index presses were correct. */
+
+#define GPIO_VERDICT(kind, index)   (((kind) << 16) | (index))
+#define GPIO_VERDICT_KIND(value)    ((value) >> 16)
+#define GPIO_VERDICT_INDEX(value)   ((value) & 0xFFFF)
+
+struct gpio_feedback
+{
+    struct gpio_play_step step;
+    __u32 repeat;       /* 1 - GPIO_PLAY_MAX_STEPS */
+};
+
+struct gpio_expect
+{
+    __u32 count;        /* Number of expected presses, 0 disarms verification. */
+    __u32 flags;        /* GPIO_EXPECT_F_* */
+    struct gpio_feedback wrong;
+    struct gpio_feedback complete;
+    __u8  buttons[GPIO_EXPECT_MAX]; /* Expected button numbers (1-4). */
+};
+
+/*
+ * Animation
+ *
+ * GPIO_IOC_ANIMATE uploads keyframes which the driver renders with software
+ * PWM, from a single hrtimer per instance servicing all LEDs every tick. Each
+ * frame fades linearly from the levels of the previous frame (all LEDs dark
+ * before the first one) to 'level' in 'fade_us' and then holds them for
+ * 'hold_us'. A PWM period is GPIO_ANIM_PWM_STEPS ticks, so a level is shown
+ * with that many brightness steps.
+ *
+ * Frame times are taken from the timer expiry, not from the time the tick ran,
+ * so late ticks do not stretch the animation. When it ends, LEDs above half of
+ * GPIO_ANIM_LEVEL_MAX stay lit and a GPIO_EV_PLAYBACK event is stored, like at
+ * the end of a pattern. An animation and a pattern replace each other, and
+ * poll() reports POLLPRI only while neither is running.
+ *
+ * GPIO_IOC_GET_ANIM_STATS reports how well the ticks kept their schedule:
+ * 'late_ns_*' is the delay of a tick after its expiry, 'overruns' counts the
+ * ticks skipped because the timer ran more than a whole tick late.
+ */
+#define GPIO_ANIM_MAX_FRAMES (32)
+#define GPIO_ANIM_LEVEL_MAX  (255)
+#define GPIO_ANIM_PWM_STEPS  (16)
+#define GPIO_ANIM_TICK_MIN_US (50)
+#define GPIO_ANIM_TICK_MAX_US (10000)
+
+struct gpio_anim_frame
+{
+    __u8  level[4];     /* Brightness of LED1-LED4 at the end of the fade, 0 - GPIO_ANIM_LEVEL_MAX. */
+    __u32 fade_us;      /* Time of the linear fade to 'level'. */
+    __u32 hold_us;      /* Time 'level' is held after the fade. */
+};
+
+/* Animation for GPIO_IOC_ANIMATE, 'frames' points to 'count' struct gpio_anim_frame. */
+struct gpio_animation
+{
+    __u32 count;        /* Number of frames, 0 stops the animation. */
+    __u32 tick_us;      /* PWM tick, 0 uses the pwm_tick_us module parameter. */
+    __u64 frames;
+};
+
+struct gpio_anim_stats
+{
+    __u32 tick_us;      /* Tick of the last animation. */
+    __u32 reserved;
+    __u64 ticks;        /* Ticks run. */
+    __u64 late_ns_total; /* Sum of the tick delays after their expiry. */
+    __u64 late_ns_max;  /* Longest tick delay. */
+    __u64 overruns;     /* Ticks skipped. */
+};
+
+struct gpio_play_stats
+{
+    __u64 deadlines;    /* Step deadlines of all patterns. */
+    __u64 late_ns_total; /* Sum of the delays after the deadlines. */
+    __u64 late_ns_max;  /* Longest delay. */
+    __u32 last_deadlines; /* The same for the last pattern, or the one being played. */
+    __u32 reserved;
+    __u64 last_late_ns_total;
+    __u64 last_late_ns_max;
+};
+
+#define GPIO_IOC_MAGIC         ('g')
+#define GPIO_IOC_GET_VERSION   _IOR(GPIO_IOC_MAGIC, 0, struct gpio_version)
+#define GPIO_IOC_SET_LEDS      _IOW(GPIO_IOC_MAGIC, 1, struct gpio_leds)
+#define GPIO_IOC_GET_SWITCHES  _IOR(GPIO_IOC_MAGIC, 2, __u32) /* Bit set for pressed buttons. */
+#define GPIO_IOC_GET_CONFIG    _IOR(GPIO_IOC_MAGIC, 3, struct gpio_config)
+#define GPIO_IOC_SET_CONFIG    _IOW(GPIO_IOC_MAGIC, 4, struct gpio_config)
+#define GPIO_IOC_GET_STATS     _IOR(GPIO_IOC_MAGIC, 5, struct gpio_stats)
+#define GPIO_IOC_PLAY          _IOW(GPIO_IOC_MAGIC, 6, struct gpio_play)
+#define GPIO_IOC_SET_FRAME     _IOW(GPIO_IOC_MAGIC, 7, struct gpio_frame)   /* ABI 2 */
+#define GPIO_IOC_EXPECT        _IOW(GPIO_IOC_MAGIC, 8, struct gpio_expect)  /* ABI 3 */
+#define GPIO_IOC_ANIMATE       _IOW(GPIO_IOC_MAGIC, 9, struct gpio_animation)  /* ABI 4 */
+#define GPIO_IOC_GET_ANIM_STATS _IOR(GPIO_IOC_MAGIC, 10, struct gpio_anim_stats) /* ABI 4 */
+#define GPIO_IOC_GET_PLAY_STATS _IOR(GPIO_IOC_MAGIC, 11, struct gpio_play_stats) /* ABI 5 */
+
+#endif /* GPIO_DRIVER_H */
@@ -0,0 +1,237 @@
+/*
+ * gpio_driver_trace.h
+ *
+ * Static tracepoints of the gpio_driver module, enabled with ftrace
+ * (events/gpio_driver/) or used by perf and trace-cmd. A disabled
+ * tracepoint costs a single patched-out branch.
+ *
+ * Every event carries the minor of the instance, the GPIO line, a
+ * timestamp in ktime_get_ns() time and a sequence number:
+ *  - gpio_edge, gpio_debounce: number of the edge on the switch line;
+ *  - gpio_enqueue, gpio_read: sequence number of the ring event, so a press
+ *    can be followed from the IRQ to the process which took it;
+ *  - gpio_command, gpio_led_store: sequence number of the next ring event,
+ *    which orders them against the presses.
+ */
+
+#ifndef GPIO_DRIVER_TRACE_DEFS
+#define GPIO_DRIVER_TRACE_DEFS
+
+/* Decisions of gpio_debounce. */
+#define GPIO_TRACE_ACCEPTED    (0) /* Press stored. */
+#define GPIO_TRACE_DEBOUNCED   (1) /* Edge inside the debounce window of the last press. */
+#define GPIO_TRACE_PENDING     (2) /* Press waits for the level confirmation. */
+#define GPIO_TRACE_MERGED      (3) /* Edge of a press already waiting for confirmation. */
+#define GPIO_TRACE_UNCONFIRMED (4) /* Switch released before the confirmation. */
+
+/* Command type of gpio_command for the text "LEDn v" protocol, others are GPIO_CMD_*. */
+#define GPIO_TRACE_CMD_TEXT    (0)
+
+#endif /* GPIO_DRIVER_TRACE_DEFS */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gpio_driver
+
+#if !defined(GPIO_DRIVER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define GPIO_DRIVER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(gpio_pin_event,
+
+    TP_PROTO(unsigned int minor, u8 pin, u64 ts, u32 seq),
+
+    TP_ARGS(minor, pin, ts, seq),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u8, pin)
+        __field(u64, ts)
+        __field(u32, seq)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pin = pin;
+        __entry->ts = ts;
+        __entry->seq = seq;
+    ),
+
+    TP_printk("minor=%u pin=%u ts=%llu seq=%u",
+              __entry->minor, __entry->pin, __entry->ts, __entry->seq)
+);
+
+/* Falling edge received by gpio_irq_handler_falling(). */
+DEFINE_EVENT(gpio_pin_event, gpio_edge,
+
+    TP_PROTO(unsigned int minor, u8 pin, u64 ts, u32 seq),
+
+    TP_ARGS(minor, pin, ts, seq)
+);
+
+/* Debounce decision for an edge, 'delta_ns' is the time since the last press or the edge. */
+TRACE_EVENT(gpio_debounce,
+
+    TP_PROTO(unsigned int minor, u8 pin, u64 ts, u32 seq, u32 decision, u64 delta_ns),
+
+    TP_ARGS(minor, pin, ts, seq, decision, delta_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u8, pin)
+        __field(u64, ts)
+        __field(u32, seq)
+        __field(u32, decision)
+        __field(u64, delta_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pin = pin;
+        __entry->ts = ts;
+        __entry->seq = seq;
+        __entry->decision = decision;
+        __entry->delta_ns = delta_ns;
+    ),
+
+    TP_printk("minor=%u pin=%u ts=%llu seq=%u %s delta_ns=%llu",
+              __entry->minor, __entry->pin, __entry->ts, __entry->seq,
+              __print_symbolic(__entry->decision,
+                               { GPIO_TRACE_ACCEPTED, "accepted" },
+                               { GPIO_TRACE_DEBOUNCED, "debounced" },
+                               { GPIO_TRACE_PENDING, "pending" },
+                               { GPIO_TRACE_MERGED, "merged" },
+                               { GPIO_TRACE_UNCONFIRMED, "unconfirmed" }),
+              __entry->delta_ns)
+);
+
+/* Event stored in the event ring, or dropped on a full ring. */
+TRACE_EVENT(gpio_enqueue,
+
+    TP_PROTO(unsigned int minor, u8 pin, u64 ts, u32 seq, u16 type, u32 value, int dropped),
+
+    TP_ARGS(minor, pin, ts, seq, type, value, dropped),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u8, pin)
+        __field(u64, ts)
+        __field(u32, seq)
+        __field(u16, type)
+        __field(u32, value)
+        __field(int, dropped)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pin = pin;
+        __entry->ts = ts;
+        __entry->seq = seq;
+        __entry->type = type;
+        __entry->value = value;
+        __entry->dropped = dropped;
+    ),
+
+    TP_printk("minor=%u pin=%u ts=%llu seq=%u type=%u value=0x%x%s",
+              __entry->minor, __entry->pin, __entry->ts, __entry->seq,
+              __entry->type, __entry->value, __entry->dropped ? " dropped" : "")
+);
+
+/* Press delivered to user space by gpio_driver_read(), 'ts' is the time of the press. */
+TRACE_EVENT(gpio_read,
+
+    TP_PROTO(unsigned int minor, u8 pin, u64 ts, u32 seq),
+
+    TP_ARGS(minor, pin, ts, seq),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u8, pin)
+        __field(u64, ts)
+        __field(u32, seq)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pin = pin;
+        __entry->ts = ts;
+        __entry->seq = seq;
+        __entry->latency_ns = ktime_get_ns() - ts;
+    ),
+
+    TP_printk("minor=%u pin=%u ts=%llu seq=%u latency_ns=%llu",
+              __entry->minor, __entry->pin, __entry->ts, __entry->seq, __entry->latency_ns)
+);
+
+/*
+ * Command parsed by gpio_driver_write(). For a text command 'pin' is the LED
+ * line and 'value' its new level, for a binary one 'pin' is 0 and 'value' the
+ * number of records.
+ */
+TRACE_EVENT(gpio_command,
+
+    TP_PROTO(unsigned int minor, u8 pin, u32 seq, u16 type, u32 value, size_t len),
+
+    TP_ARGS(minor, pin, seq, type, value, len),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u8, pin)
+        __field(u64, ts)
+        __field(u32, seq)
+        __field(u16, type)
+        __field(u32, value)
+        __field(size_t, len)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pin = pin;
+        __entry->ts = ktime_get_ns();
+        __entry->seq = seq;
+        __entry->type = type;
+        __entry->value = value;
+        __entry->len = len;
+    ),
+
+    TP_printk("minor=%u pin=%u ts=%llu seq=%u type=%u value=%u len=%zu",
+              __entry->minor, __entry->pin, __entry->ts, __entry->seq,
+              __entry->type, __entry->value, __entry->len)
+);
+
+/* GPSET ('on') or GPCLR store driving a LED line. */
+TRACE_EVENT(gpio_led_store,
+
+    TP_PROTO(unsigned int minor, u8 pin, u32 seq, int on),
+
+    TP_ARGS(minor, pin, seq, on),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u8, pin)
+        __field(u64, ts)
+        __field(u32, seq)
+        __field(int, on)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pin = pin;
+        __entry->ts = ktime_get_ns();
+        __entry->seq = seq;
+        __entry->on = on;
+    ),
+
+    TP_printk("minor=%u pin=%u ts=%llu seq=%u %s",
+              __entry->minor, __entry->pin, __entry->ts, __entry->seq, __entry->on ? "on" : "off")
+);
+
+#endif /* GPIO_DRIVER_TRACE_H */
+
+/* The module Makefile adds the module directory to the include path. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpio_driver_trace
+#include <trace/define_trace.h>
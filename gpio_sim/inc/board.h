@@ -0,0 +1,154 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gpio_driver.h"
+#include "trace.h"
+
+#define BOARD_LEDS 4
+#define BOARD_BUTTONS 4
+#define BOARD_MAX_ACTIONS 1024
+#define BOARD_MAX_TIMELINE 512
+
+#define BOARD_NEVER UINT64_MAX
+
+/* What a board call changed, tells the front end whom to wake up. */
+#define BOARD_CHANGED_EVENTS   0x1 // Events were stored in the ring
+#define BOARD_CHANGED_PLAYBACK 0x2 // Playback started or finished
+#define BOARD_CHANGED_LEDS     0x4 // LED state changed
+
+/* Scripted actions, see board_load_script(). */
+enum board_action_type
+{
+    ACTION_PRESS,
+    ACTION_BURST,
+    ACTION_AUTO,
+    ACTION_LOOP,
+};
+
+struct board_action
+{
+    enum board_action_type type;
+    uint64_t delay_ns;      // Time after the previous action
+    int button;             // Button number (1-4)
+    int count;              // Bounces of a press, presses of a burst
+    uint64_t gap_ns;        // Bounce period, burst period, auto press period
+    uint64_t hold_ns;       // Time the switch stays pressed
+    int error_pct;          // Auto player: chance of a wrong press
+};
+
+/* Switch level change scheduled on the board timeline. */
+struct board_item
+{
+    uint64_t t;
+    int kind;
+    int button;
+};
+
+/*
+ * Virtual Simon board: four buttons and four LEDs behind the gpio_driver
+ * protocol. The board has no clock of its own, the front end passes the
+ * time in with board_advance() and sleeps until board_next_deadline().
+ */
+struct board
+{
+    uint64_t now;
+    uint64_t advance_ns;    // Time given to board_advance(), the deadlines run late by the difference
+
+    // Event ring, the same layout the driver maps to user space
+    struct gpio_ring ring;
+    uint32_t seq;
+    int overrun;
+    int has_owner;
+    uint64_t owner;
+    int mapped;             // The owner takes the events from 'ring' itself, see board_map()
+
+    // Inputs and outputs
+    uint32_t leds;
+    uint32_t switches;      // Bit set while the switch is pressed
+    uint64_t last_ns[BOARD_BUTTONS];
+    uint64_t edge_ns[BOARD_BUTTONS];
+    int confirm_pending[BOARD_BUTTONS];
+    uint64_t pulse_end[BOARD_LEDS];
+
+    struct gpio_config config;
+    struct gpio_stats stats;
+
+    // Playback
+    struct gpio_play_step steps[GPIO_PLAY_MAX_STEPS];
+    uint32_t play_count;
+    uint32_t play_index;
+    int play_lit;
+    int play_running;
+    uint64_t play_deadline;
+    struct gpio_play_stats play_stats;
+
+    // Animation, shown frame by frame without the PWM, see GPIO_IOC_ANIMATE
+    struct gpio_anim_frame frames[GPIO_ANIM_MAX_FRAMES];
+    uint32_t anim_count;
+    uint32_t anim_index;
+    uint32_t anim_lit;
+    uint32_t anim_tick_us;
+    int anim_running;
+    uint64_t anim_deadline;
+    struct gpio_anim_stats anim_stats;
+
+    // Input verification, see GPIO_IOC_EXPECT
+    struct gpio_expect expect;
+    uint32_t expect_index;
+
+    // Script
+    struct board_action *script;
+    size_t script_len;
+    size_t script_pos;
+    uint64_t next_action;
+
+    // Auto player repeating every played sequence
+    int auto_on;
+    uint64_t auto_delay_ns;
+    uint64_t auto_gap_ns;
+    int auto_error_pct;
+
+    struct board_item timeline[BOARD_MAX_TIMELINE];
+    size_t timeline_len;
+
+    // Trace recording (NULL if none) and replay, see board_replay()
+    struct trace_writer *record;
+    const struct trace *replay;
+    size_t replay_pos;      // Next input record
+    size_t replay_led_pos;  // Next LED record compared with the LEDs
+    int replay_kind;        // Input records replayed, TRACE_SWITCH or TRACE_PRESS
+    uint64_t replay_start;
+    double replay_speed;
+    uint32_t replay_matched;
+    uint32_t replay_diverged;
+
+    unsigned int seed;
+    int verbose;
+};
+
+void board_init(struct board *b, uint64_t now);
+void board_free(struct board *b);
+int board_load_script(struct board *b, const char *path);
+int board_add_action(struct board *b, const struct board_action *action);
+
+uint64_t board_next_deadline(const struct board *b);
+int board_advance(struct board *b, uint64_t now);
+
+int board_press(struct board *b, int button, int bounces, uint64_t gap_ns, uint64_t hold_ns);
+int board_replay(struct board *b, const struct trace *trace, double speed);
+
+int board_claim(struct board *b, uint64_t owner);
+int board_map(struct board *b, uint64_t owner);
+void board_release(struct board *b, uint64_t owner);
+int board_ready(const struct board *b);
+int board_take_presses(struct board *b, char *buf, size_t max);
+unsigned int board_poll(struct board *b, uint64_t owner, unsigned int events);
+
+ssize_t board_write(struct board *b, uint64_t owner, const void *buf, size_t len);
+int board_ioctl(struct board *b, uint64_t owner, unsigned long cmd, void *arg);
+
+#endif // BOARD_H
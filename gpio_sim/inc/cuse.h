@@ -0,0 +1,52 @@
+#ifndef CUSE_H
+#define CUSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "board.h"
+
+#define CUSE_DEVICE "/dev/cuse"
+#define CUSE_MAX_READS 64
+#define CUSE_MAX_POLLS 64
+#define CUSE_MAX_WRITE (64 * 1024)
+
+/* Blocking read() waiting for a press. */
+struct cuse_read
+{
+    uint64_t unique;        // Request id, the reply is sent later
+    uint64_t fh;            // Session of the reader
+    uint32_t size;
+    uint64_t deadline;      // read_timeout_ms, BOARD_NEVER if none
+};
+
+/*
+ * Character device in user space (CUSE) front end of the virtual board.
+ * The kernel creates /dev/<name>, and every operation on it arrives as a
+ * request on /dev/cuse, which is served from a single thread.
+ */
+struct cuse_server
+{
+    int fd;
+    const char *name;
+    struct board *board;
+    uint64_t next_fh;
+
+    struct cuse_read reads[CUSE_MAX_READS];
+    size_t reads_len;
+
+    uint64_t polls[CUSE_MAX_POLLS]; // Poll handles waiting for a notification
+    size_t polls_len;
+
+    char *buf;
+    size_t buf_len;
+    int verbose;
+};
+
+uint64_t cuse_clock_ns(void);
+
+int cuse_open(struct cuse_server *srv, const char *name, struct board *board);
+int cuse_run(struct cuse_server *srv, volatile int *stop);
+void cuse_close(struct cuse_server *srv);
+
+#endif // CUSE_H
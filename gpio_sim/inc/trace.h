@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC 0x43525447 // "GTRC"
+#define TRACE_VERSION 1
+
+/* Record kinds. */
+#define TRACE_SWITCH  1 // Switch level change on the board, value 1 pressed, 0 released
+#define TRACE_PRESS   2 // Press taken by the consumer, value is the button (1-4)
+#define TRACE_COMMAND 3 // LED command, see the TRACE_CODE_* codes
+#define TRACE_LEDS    4 // LED state after a change, value is the LED mask
+
+/* Command codes: ioctls are _IOC_NR(cmd), writes are one of these. */
+#define TRACE_CODE_WRITE 0x100 // Binary write, plus the GPIO_CMD_* type
+#define TRACE_CODE_TEXT  0x200 // Text "LEDn v" write, pin is the LED (1-4)
+
+/*
+ * Binary trace file: the header, then fixed size records in the order
+ * they were written, all in host byte order.
+ */
+struct trace_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t seed;          // Random seed of the recorded session
+    uint32_t reserved;
+    uint64_t start_ns;      // Clock of the recorder when the trace started
+};
+
+struct trace_record
+{
+    uint64_t t_ns;          // Time since the start of the trace
+    uint8_t kind;
+    uint8_t pin;            // GPIO line of a switch, LED of a text command
+    uint16_t code;          // Command code of TRACE_COMMAND
+    uint32_t value;
+};
+
+/* Trace being recorded, buffered by stdio. */
+struct trace_writer
+{
+    FILE *f;
+    uint64_t start_ns;
+    uint64_t records;
+};
+
+/* Trace loaded for a replay. */
+struct trace
+{
+    struct trace_header header;
+    struct trace_record *records;
+    size_t count;
+};
+
+int trace_create(struct trace_writer *w, const char *path, uint64_t start_ns, uint32_t seed);
+void trace_add(struct trace_writer *w, uint64_t t, int kind, int pin, int code, uint32_t value);
+void trace_ioctl(struct trace_writer *w, uint64_t t, unsigned long cmd, const void *arg);
+int trace_close(struct trace_writer *w);
+
+int trace_load(struct trace *trace, const char *path);
+void trace_free(struct trace *trace);
+
+#endif // TRACE_H
@@ -0,0 +1,1306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "board.h"
+
+#define MS_NS 1000000ULL
+#define US_NS 1000ULL
+
+/* Timeline item kinds. */
+#define ITEM_FALL    0 // Switch pressed, the line goes low and raises an IRQ
+#define ITEM_RISE    1 // Switch released
+#define ITEM_CONFIRM 2 // Level confirmation of a pending press
+
+/* Hold time of a replayed TRACE_PRESS, the default of the scripts. */
+#define REPLAY_HOLD_NS (80 * MS_NS)
+
+/* Switch GPIO lines, reported in the events like the driver does. */
+static const int board_switch_pins[BOARD_BUTTONS] = {12, 16, 20, 21};
+
+void board_init(struct board *b, uint64_t now)
+{
+    memset(b, 0, sizeof(*b));
+
+    b->now = now;
+    b->ring.magic = GPIO_RING_MAGIC;
+    b->ring.version = GPIO_RING_VERSION;
+    b->ring.size = GPIO_RING_SIZE;
+    b->ring.event_size = sizeof(struct gpio_event);
+
+    // Same defaults as the driver module parameters
+    b->config.debounce_us = 30000;
+    b->config.confirm_us = 0;
+    b->config.pulse_ms = 100;
+    b->config.read_timeout_ms = 0;
+
+    for (int i = 0; i < BOARD_LEDS; i++)
+    {
+        b->pulse_end[i] = BOARD_NEVER;
+    }
+
+    b->next_action = BOARD_NEVER;
+    b->seed = (unsigned int) now;
+}
+
+void board_free(struct board *b)
+{
+    free(b->script);
+    b->script = NULL;
+    b->script_len = 0;
+}
+
+/*
+ * Appends an action to the script. The first action is scheduled
+ * relative to the current board time.
+ */
+int board_add_action(struct board *b, const struct board_action *action)
+{
+    struct board_action *script;
+
+    if (b->script_len >= BOARD_MAX_ACTIONS)
+    {
+        return -1;
+    }
+
+    script = realloc(b->script, (b->script_len + 1) * sizeof(*script));
+    if (!script)
+    {
+        return -1;
+    }
+
+    b->script = script;
+    b->script[b->script_len++] = *action;
+
+    if (b->script_len == 1)
+    {
+        b->script_pos = 0;
+        b->next_action = b->now + action->delay_ns;
+    }
+
+    return 0;
+}
+
+/*
+ * Loads a board script, one action per line, '#' starts a comment:
+ *
+ *   <delay_ms> press <button> [hold <ms>] [bounce <edges> <period_us>]
+ *   <delay_ms> burst <button> <presses> <period_ms>
+ *   <delay_ms> auto <reaction_ms> <period_ms> [<error_pct>]
+ *   <delay_ms> auto off
+ *   <delay_ms> loop
+ *
+ * The delay is counted from the previous action. 'auto' makes the board
+ * repeat every played single-LED sequence, as a player would.
+ * Returns 0 or -1 on error.
+ */
+int board_load_script(struct board *b, const char *path)
+{
+    char line[256];
+    char *word, *save;
+    int line_no = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+    {
+        printf("Error, script '%s' not opened\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        struct board_action action = {0};
+        double delay_ms;
+
+        line_no++;
+
+        if ((word = strchr(line, '#')))
+        {
+            *word = '\0';
+        }
+
+        word = strtok_r(line, " \t\r\n", &save);
+        if (!word)
+        {
+            continue;
+        }
+
+        delay_ms = atof(word);
+        action.delay_ns = delay_ms * MS_NS;
+        action.hold_ns = 80 * MS_NS;
+
+        word = strtok_r(NULL, " \t\r\n", &save);
+        if (!word)
+        {
+            goto bad_line;
+        }
+
+        if (strcmp(word, "press") == 0)
+        {
+            action.type = ACTION_PRESS;
+            word = strtok_r(NULL, " \t\r\n", &save);
+            if (!word)
+            {
+                goto bad_line;
+            }
+            action.button = atoi(word);
+
+            while ((word = strtok_r(NULL, " \t\r\n", &save)))
+            {
+                if (strcmp(word, "hold") == 0 && (word = strtok_r(NULL, " \t\r\n", &save)))
+                {
+                    action.hold_ns = atof(word) * MS_NS;
+                }
+                else if (strcmp(word, "bounce") == 0 && (word = strtok_r(NULL, " \t\r\n", &save)))
+                {
+                    action.count = atoi(word);
+                    word = strtok_r(NULL, " \t\r\n", &save);
+                    action.gap_ns = (word ? atof(word) : 500) * US_NS;
+                }
+                else
+                {
+                    goto bad_line;
+                }
+            }
+        }
+        else if (strcmp(word, "burst") == 0)
+        {
+            char *button = strtok_r(NULL, " \t\r\n", &save);
+            char *count = strtok_r(NULL, " \t\r\n", &save);
+            char *period = strtok_r(NULL, " \t\r\n", &save);
+
+            if (!button || !count || !period)
+            {
+                goto bad_line;
+            }
+
+            action.type = ACTION_BURST;
+            action.button = atoi(button);
+            action.count = atoi(count);
+            action.gap_ns = atof(period) * MS_NS;
+            action.hold_ns = action.gap_ns / 2;
+        }
+        else if (strcmp(word, "auto") == 0)
+        {
+            char *reaction = strtok_r(NULL, " \t\r\n", &save);
+            char *period = strtok_r(NULL, " \t\r\n", &save);
+            char *error = strtok_r(NULL, " \t\r\n", &save);
+
+            if (!reaction)
+            {
+                goto bad_line;
+            }
+
+            action.type = ACTION_AUTO;
+            if (strcmp(reaction, "off") != 0)
+            {
+                if (!period)
+                {
+                    goto bad_line;
+                }
+                action.count = 1;
+                action.hold_ns = atof(reaction) * MS_NS;
+                action.gap_ns = atof(period) * MS_NS;
+                action.error_pct = error ? atoi(error) : 0;
+            }
+        }
+        else if (strcmp(word, "loop") == 0)
+        {
+            action.type = ACTION_LOOP;
+        }
+        else
+        {
+            goto bad_line;
+        }
+
+        if ((action.type == ACTION_PRESS || action.type == ACTION_BURST)
+            && (action.button < 1 || action.button > BOARD_BUTTONS))
+        {
+            goto bad_line;
+        }
+
+        if (board_add_action(b, &action) < 0)
+        {
+            printf("Error, script '%s' too long\n", path);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+
+bad_line:
+    printf("Error, script '%s' line %d not understood\n", path, line_no);
+    fclose(f);
+    return -1;
+}
+
+/*
+ * Compares an LED change of a replay with the next LED state of the
+ * trace. The changes are compared in order, whatever their time.
+ */
+static void board_replay_leds(struct board *b, uint32_t leds)
+{
+    const struct trace *trace = b->replay;
+
+    while (b->replay_led_pos < trace->count && trace->records[b->replay_led_pos].kind != TRACE_LEDS)
+    {
+        b->replay_led_pos++;
+    }
+
+    if (b->replay_led_pos < trace->count && trace->records[b->replay_led_pos++].value == leds)
+    {
+        b->replay_matched++;
+    }
+    else
+    {
+        b->replay_diverged++;
+    }
+}
+
+static void board_set_leds(struct board *b, uint32_t leds)
+{
+    leds &= (1 << BOARD_LEDS) - 1;
+
+    if (leds == b->leds)
+    {
+        return;
+    }
+
+    if (b->verbose)
+    {
+        printf("[%10.3f ms] LEDs", b->now / 1e6);
+        for (int i = 0; i < BOARD_LEDS; i++)
+        {
+            printf(" %c", (leds & (1 << i)) ? '*' : '.');
+        }
+        printf("\n");
+    }
+
+    trace_add(b->record, b->now, TRACE_LEDS, 0, 0, leds);
+    if (b->replay)
+    {
+        board_replay_leds(b, leds);
+    }
+
+    b->leds = leds;
+}
+
+static int board_timeline_add(struct board *b, uint64_t t, int kind, int button)
+{
+    if (b->timeline_len >= BOARD_MAX_TIMELINE)
+    {
+        return -1;
+    }
+
+    b->timeline[b->timeline_len].t = t;
+    b->timeline[b->timeline_len].kind = kind;
+    b->timeline[b->timeline_len].button = button;
+    b->timeline_len++;
+
+    return 0;
+}
+
+/*
+ * Schedules a press of the button starting at t0: the switch closes,
+ * bounces 'bounces' times with the given period, is held for hold_ns
+ * and bounces the same way when it is released. Returns 0 or -1 when the
+ * timeline is full.
+ */
+static int board_schedule_press(struct board *b, uint64_t t0, int button, int bounces,
+                                uint64_t gap_ns, uint64_t hold_ns)
+{
+    uint64_t release;
+    int ret = 0;
+
+    if (button < 1 || button > BOARD_BUTTONS)
+    {
+        return -1;
+    }
+
+    // The switch is released only after the press bounces died out
+    if (hold_ns <= 2 * bounces * gap_ns)
+    {
+        hold_ns = 2 * bounces * gap_ns + gap_ns + 1;
+    }
+    release = t0 + hold_ns;
+
+    ret |= board_timeline_add(b, t0, ITEM_FALL, button);
+    for (int k = 1; k <= bounces; k++)
+    {
+        ret |= board_timeline_add(b, t0 + (2 * k - 1) * gap_ns, ITEM_RISE, button);
+        ret |= board_timeline_add(b, t0 + 2 * k * gap_ns, ITEM_FALL, button);
+    }
+
+    ret |= board_timeline_add(b, release, ITEM_RISE, button);
+    for (int k = 1; k <= bounces; k++)
+    {
+        ret |= board_timeline_add(b, release + (2 * k - 1) * gap_ns, ITEM_FALL, button);
+        ret |= board_timeline_add(b, release + 2 * k * gap_ns, ITEM_RISE, button);
+    }
+
+    return ret;
+}
+
+int board_press(struct board *b, int button, int bounces, uint64_t gap_ns, uint64_t hold_ns)
+{
+    return board_schedule_press(b, b->now, button, bounces, gap_ns, hold_ns);
+}
+
+/* Button (1-4) of a switch GPIO line, 0 if the line is no switch. */
+static int board_pin_button(int pin)
+{
+    for (int i = 0; i < BOARD_BUTTONS; i++)
+    {
+        if (board_switch_pins[i] == pin)
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Button (1-4) of an input record, 0 if it is none. */
+static int board_record_button(const struct trace_record *record)
+{
+    if (record->kind == TRACE_SWITCH)
+    {
+        return board_pin_button(record->pin);
+    }
+
+    if (record->kind == TRACE_PRESS && record->value >= 1 && record->value <= BOARD_BUTTONS)
+    {
+        return record->value;
+    }
+
+    return 0;
+}
+
+/* Moves the replay to the next input record from replay_pos on. */
+static void board_replay_seek(struct board *b)
+{
+    const struct trace *trace = b->replay;
+
+    while (b->replay_pos < trace->count
+           && (trace->records[b->replay_pos].kind != b->replay_kind
+               || !board_record_button(&trace->records[b->replay_pos])))
+    {
+        b->replay_pos++;
+    }
+}
+
+/*
+ * Replays the inputs of a trace from now on, 'speed' times faster than
+ * they were recorded. A trace of the board has the switch levels, with
+ * the bounces, a trace of the driver has only the presses taken by the
+ * game, which are pressed again like a script does. The LED changes are
+ * compared with the recorded ones, see replay_matched and replay_diverged.
+ * The trace has to stay loaded during the replay. Returns 0 or -1 if the
+ * trace has no inputs.
+ */
+int board_replay(struct board *b, const struct trace *trace, double speed)
+{
+    int kind = TRACE_PRESS;
+
+    for (size_t i = 0; i < trace->count; i++)
+    {
+        if (trace->records[i].kind == TRACE_SWITCH)
+        {
+            kind = TRACE_SWITCH;
+            break;
+        }
+    }
+
+    b->replay = trace;
+    b->replay_pos = 0;
+    b->replay_led_pos = 0;
+    b->replay_kind = kind;
+    b->replay_start = b->now;
+    b->replay_speed = speed;
+    b->replay_matched = 0;
+    b->replay_diverged = 0;
+
+    board_replay_seek(b);
+    if (b->replay_pos >= trace->count)
+    {
+        b->replay = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Time the next replayed input is due, BOARD_NEVER when the replay is over. */
+static uint64_t board_replay_deadline(const struct board *b)
+{
+    if (!b->replay || b->replay_pos >= b->replay->count)
+    {
+        return BOARD_NEVER;
+    }
+
+    return b->replay_start + (uint64_t) (b->replay->records[b->replay_pos].t_ns / b->replay_speed);
+}
+
+/*
+ * Stores an event in the ring, dropping it when the consumer did not
+ * free a slot, exactly like the driver does.
+ */
+static void board_ring_push(struct board *b, uint16_t type, int pin, uint32_t value, uint64_t t)
+{
+    struct gpio_ring *ring = &b->ring;
+    struct gpio_event *ev;
+
+    if (ring->head - ring->tail >= GPIO_RING_SIZE)
+    {
+        ring->overruns++;
+        b->overrun = 1;
+        b->seq++;
+        return;
+    }
+
+    ev = &ring->events[ring->head & (GPIO_RING_SIZE - 1)];
+    ev->timestamp_ns = t;
+    ev->seq = b->seq++;
+    ev->type = type;
+    ev->pin = pin;
+    ev->edge = GPIO_EDGE_FALLING;
+    ev->value = value;
+    ev->flags = b->overrun ? GPIO_EV_F_OVERRUN : 0;
+    b->overrun = 0;
+
+    ring->head++;
+}
+
+static void board_playback_start(struct board *b, const struct gpio_play_step *steps, uint32_t count);
+
+/*
+ * Verifies a press like GpioExpectCheck() in the driver. Returns the
+ * changes the consumer has to be woken up for.
+ */
+static int board_expect_check(struct board *b, int button, uint64_t t)
+{
+    struct gpio_expect *expect = &b->expect;
+    struct gpio_play_step pattern[GPIO_PLAY_MAX_STEPS];
+    const struct gpio_feedback *feedback = NULL;
+    uint32_t index = b->expect_index;
+    uint32_t kind;
+
+    if (expect->count == 0)
+    {
+        return BOARD_CHANGED_EVENTS;
+    }
+
+    if (button != expect->buttons[index])
+    {
+        kind = GPIO_VERDICT_WRONG;
+        if (expect->flags & GPIO_EXPECT_F_PLAY_WRONG)
+        {
+            feedback = &expect->wrong;
+        }
+    }
+    else if (++b->expect_index == expect->count)
+    {
+        kind = GPIO_VERDICT_COMPLETE;
+        index = expect->count;
+        if (expect->flags & GPIO_EXPECT_F_PLAY_COMPLETE)
+        {
+            feedback = &expect->complete;
+        }
+    }
+    else if (expect->flags & GPIO_EXPECT_F_PROGRESS)
+    {
+        kind = GPIO_VERDICT_PROGRESS;
+        index = b->expect_index;
+    }
+    else
+    {
+        return 0;
+    }
+
+    board_ring_push(b, GPIO_EV_VERDICT, board_switch_pins[button - 1], GPIO_VERDICT(kind, index), t);
+
+    if (kind != GPIO_VERDICT_PROGRESS)
+    {
+        expect->count = 0;
+    }
+
+    if (feedback)
+    {
+        for (uint32_t i = 0; i < feedback->repeat; i++)
+        {
+            pattern[i] = feedback->step;
+        }
+        board_playback_start(b, pattern, feedback->repeat);
+
+        return BOARD_CHANGED_EVENTS | BOARD_CHANGED_PLAYBACK;
+    }
+
+    return BOARD_CHANGED_EVENTS;
+}
+
+static int board_accept(struct board *b, int button, uint64_t edge_ns)
+{
+    int i = button - 1;
+
+    b->last_ns[i] = edge_ns;
+    board_ring_push(b, GPIO_EV_BUTTON, board_switch_pins[i], button, edge_ns);
+
+    if (b->config.pulse_ms)
+    {
+        board_set_leds(b, b->leds | (1 << i));
+        b->pulse_end[i] = b->now + b->config.pulse_ms * MS_NS;
+    }
+
+    return board_expect_check(b, button, edge_ns) | BOARD_CHANGED_LEDS;
+}
+
+/* Falling edge of a switch, debounced like gpio_irq_handler_falling(). */
+static int board_edge(struct board *b, int button, uint64_t t)
+{
+    int i = button - 1;
+
+    b->stats.irq_count++;
+
+    if (b->last_ns[i] && t - b->last_ns[i] < b->config.debounce_us * US_NS)
+    {
+        return 0;
+    }
+
+    if (b->config.confirm_us == 0)
+    {
+        return board_accept(b, button, t);
+    }
+
+    if (!b->confirm_pending[i])
+    {
+        b->confirm_pending[i] = 1;
+        b->edge_ns[i] = t;
+        board_timeline_add(b, t + b->config.confirm_us * US_NS, ITEM_CONFIRM, button);
+    }
+
+    return 0;
+}
+
+static int board_item(struct board *b, const struct board_item *item)
+{
+    int i = item->button - 1;
+    int changes = 0;
+
+    switch (item->kind)
+    {
+    case ITEM_FALL:
+        trace_add(b->record, item->t, TRACE_SWITCH, board_switch_pins[i], 0, 1);
+        b->switches |= 1 << i;
+        changes = board_edge(b, item->button, item->t);
+        break;
+
+    case ITEM_RISE:
+        trace_add(b->record, item->t, TRACE_SWITCH, board_switch_pins[i], 0, 0);
+        b->switches &= ~(1 << i);
+        break;
+
+    case ITEM_CONFIRM:
+        if (b->switches & (1 << i))
+        {
+            changes = board_accept(b, item->button, b->edge_ns[i]);
+        }
+        b->confirm_pending[i] = 0;
+        break;
+    }
+
+    return changes;
+}
+
+/* The auto player repeats a played sequence of single LED steps. */
+static void board_auto_play(struct board *b)
+{
+    uint64_t t = b->now + b->auto_delay_ns;
+    int button;
+
+    for (uint32_t i = 0; i < b->play_count; i++)
+    {
+        if (__builtin_popcount(b->steps[i].led_mask) != 1)
+        {
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < b->play_count; i++)
+    {
+        button = __builtin_ctz(b->steps[i].led_mask) + 1;
+
+        if (b->auto_error_pct && (int) (rand_r(&b->seed) % 100) < b->auto_error_pct)
+        {
+            button = button % BOARD_BUTTONS + 1;
+        }
+
+        board_schedule_press(b, t + i * b->auto_gap_ns, button, 0, 0, b->auto_gap_ns / 2);
+    }
+}
+
+/* Playback timer, same steps and statistics as GpioPlaybackTick() in the driver. */
+static int board_playback_tick(struct board *b)
+{
+    struct gpio_play_step *step = &b->steps[b->play_index];
+    struct gpio_play_stats *stats = &b->play_stats;
+    uint64_t late = b->advance_ns > b->play_deadline ? b->advance_ns - b->play_deadline : 0;
+    uint32_t next_us;
+
+    stats->deadlines++;
+    stats->late_ns_total += late;
+    stats->late_ns_max = late > stats->late_ns_max ? late : stats->late_ns_max;
+    stats->last_deadlines++;
+    stats->last_late_ns_total += late;
+    stats->last_late_ns_max = late > stats->last_late_ns_max ? late : stats->last_late_ns_max;
+
+    if (b->play_lit)
+    {
+        board_set_leds(b, b->leds & ~step->led_mask);
+        b->play_lit = 0;
+        next_us = step->off_us;
+    }
+    else
+    {
+        b->play_index++;
+        if (b->play_index >= b->play_count)
+        {
+            b->play_running = 0;
+            board_ring_push(b, GPIO_EV_PLAYBACK, 0, b->play_count, b->now);
+
+            if (b->auto_on)
+            {
+                board_auto_play(b);
+            }
+
+            return BOARD_CHANGED_EVENTS | BOARD_CHANGED_PLAYBACK;
+        }
+
+        step = &b->steps[b->play_index];
+        board_set_leds(b, b->leds | step->led_mask);
+        b->play_lit = 1;
+        next_us = step->on_us;
+    }
+
+    b->play_deadline += next_us * US_NS;
+
+    return BOARD_CHANGED_LEDS;
+}
+
+/*
+ * LEDs of an animation frame: the board has no PWM, a LED is lit for the
+ * whole frame when its level is above half, like at the end in the driver.
+ */
+static uint32_t board_frame_leds(const struct gpio_anim_frame *frame)
+{
+    uint32_t lit = 0;
+
+    for (int i = 0; i < BOARD_LEDS; i++)
+    {
+        if (frame->level[i] > GPIO_ANIM_LEVEL_MAX / 2)
+        {
+            lit |= 1 << i;
+        }
+    }
+
+    return lit;
+}
+
+static void board_animation_show(struct board *b)
+{
+    const struct gpio_anim_frame *frame = &b->frames[b->anim_index];
+    uint64_t length_us = (uint64_t) frame->fade_us + frame->hold_us;
+    uint32_t lit = board_frame_leds(frame);
+
+    board_set_leds(b, (b->leds & ~b->anim_lit) | lit);
+    b->anim_lit = lit;
+    b->anim_deadline += length_us * US_NS;
+
+    // Ticks the driver would run for the frame, all on time
+    b->anim_stats.ticks += length_us / b->anim_tick_us;
+}
+
+/* Animation timer, at the end of every frame. */
+static int board_animation_tick(struct board *b)
+{
+    b->anim_index++;
+    if (b->anim_index >= b->anim_count)
+    {
+        b->anim_running = 0;
+        board_ring_push(b, GPIO_EV_PLAYBACK, 0, b->anim_count, b->now);
+
+        return BOARD_CHANGED_EVENTS | BOARD_CHANGED_PLAYBACK;
+    }
+
+    board_animation_show(b);
+
+    return BOARD_CHANGED_LEDS;
+}
+
+/* Stops the pattern and the animation, see GpioPlaybackStop() in the driver. */
+static void board_playback_stop(struct board *b)
+{
+    if (b->play_running && b->play_lit)
+    {
+        board_set_leds(b, b->leds & ~b->steps[b->play_index].led_mask);
+    }
+    b->play_running = 0;
+
+    if (b->anim_running)
+    {
+        board_set_leds(b, b->leds & ~b->anim_lit);
+    }
+    b->anim_lit = 0;
+    b->anim_running = 0;
+}
+
+static void board_animation_start(struct board *b, const struct gpio_anim_frame *frames, uint32_t count,
+                                  uint32_t tick_us)
+{
+    board_playback_stop(b);
+
+    memcpy(b->frames, frames, count * sizeof(*frames));
+    b->anim_count = count;
+    b->anim_index = 0;
+    b->anim_running = count != 0;
+
+    if (count)
+    {
+        board_set_leds(b, 0);
+        b->anim_tick_us = tick_us;
+        b->anim_stats.tick_us = tick_us;
+        b->anim_deadline = b->now;
+        board_animation_show(b);
+    }
+}
+
+static void board_playback_start(struct board *b, const struct gpio_play_step *steps, uint32_t count)
+{
+    board_playback_stop(b);
+
+    memcpy(b->steps, steps, count * sizeof(*steps));
+    b->play_count = count;
+    b->play_index = 0;
+    b->play_lit = 0;
+    b->play_stats.last_deadlines = 0;
+    b->play_stats.last_late_ns_total = 0;
+    b->play_stats.last_late_ns_max = 0;
+    b->play_running = count != 0;
+
+    if (count)
+    {
+        board_set_leds(b, b->leds | steps[0].led_mask);
+        b->play_lit = 1;
+        b->play_deadline = b->now + steps[0].on_us * US_NS;
+    }
+}
+
+static int board_action(struct board *b)
+{
+    struct board_action *action = &b->script[b->script_pos];
+    uint64_t t = b->next_action;
+
+    switch (action->type)
+    {
+    case ACTION_PRESS:
+        board_schedule_press(b, t, action->button, action->count, action->gap_ns, action->hold_ns);
+        break;
+
+    case ACTION_BURST:
+        for (int i = 0; i < action->count; i++)
+        {
+            board_schedule_press(b, t + i * action->gap_ns, action->button, 0, 0, action->hold_ns);
+        }
+        break;
+
+    case ACTION_AUTO:
+        b->auto_on = action->count;
+        b->auto_delay_ns = action->hold_ns;
+        b->auto_gap_ns = action->gap_ns;
+        b->auto_error_pct = action->error_pct;
+        break;
+
+    case ACTION_LOOP:
+        // A loop never restarts in the same instant, it would spin forever
+        b->script_pos = 0;
+        b->next_action = t + (b->script[0].delay_ns ? b->script[0].delay_ns : MS_NS);
+        return 0;
+    }
+
+    b->script_pos++;
+    b->next_action = b->script_pos < b->script_len ? t + b->script[b->script_pos].delay_ns : BOARD_NEVER;
+
+    return 0;
+}
+
+static size_t board_timeline_first(const struct board *b)
+{
+    size_t first = 0;
+
+    for (size_t i = 1; i < b->timeline_len; i++)
+    {
+        if (b->timeline[i].t < b->timeline[first].t)
+        {
+            first = i;
+        }
+    }
+
+    return first;
+}
+
+/*
+ * Replays the input record due at time t: the switch level changes or the
+ * press starts at once.
+ */
+static int board_replay_step(struct board *b, uint64_t t)
+{
+    const struct trace_record *record = &b->replay->records[b->replay_pos++];
+    struct board_item item = { .t = t, .button = board_record_button(record) };
+
+    board_replay_seek(b);
+
+    if (b->replay_kind == TRACE_PRESS)
+    {
+        board_schedule_press(b, t, item.button, 0, 0, REPLAY_HOLD_NS);
+        return 0;
+    }
+
+    // A level which did not change is no edge, e.g. a trace started with the switch pressed
+    if (!!(b->switches & (1 << (item.button - 1))) == !!record->value)
+    {
+        return 0;
+    }
+
+    item.kind = record->value ? ITEM_FALL : ITEM_RISE;
+
+    return board_item(b, &item);
+}
+
+/* Time of the next thing happening on the board, BOARD_NEVER if nothing. */
+uint64_t board_next_deadline(const struct board *b)
+{
+    uint64_t t = b->next_action;
+
+    if (board_replay_deadline(b) < t)
+    {
+        t = board_replay_deadline(b);
+    }
+
+    if (b->play_running && b->play_deadline < t)
+    {
+        t = b->play_deadline;
+    }
+
+    if (b->anim_running && b->anim_deadline < t)
+    {
+        t = b->anim_deadline;
+    }
+
+    for (int i = 0; i < BOARD_LEDS; i++)
+    {
+        if (b->pulse_end[i] < t)
+        {
+            t = b->pulse_end[i];
+        }
+    }
+
+    if (b->timeline_len && b->timeline[board_timeline_first(b)].t < t)
+    {
+        t = b->timeline[board_timeline_first(b)].t;
+    }
+
+    return t;
+}
+
+/* Handles the earliest thing due at time t. */
+static int board_step(struct board *b, uint64_t t)
+{
+    struct board_item item;
+    size_t first;
+
+    if (b->play_running && b->play_deadline <= t)
+    {
+        return board_playback_tick(b);
+    }
+
+    if (b->anim_running && b->anim_deadline <= t)
+    {
+        return board_animation_tick(b);
+    }
+
+    for (int i = 0; i < BOARD_LEDS; i++)
+    {
+        if (b->pulse_end[i] <= t)
+        {
+            b->pulse_end[i] = BOARD_NEVER;
+            board_set_leds(b, b->leds & ~(1 << i));
+            return BOARD_CHANGED_LEDS;
+        }
+    }
+
+    if (b->timeline_len)
+    {
+        first = board_timeline_first(b);
+        if (b->timeline[first].t <= t)
+        {
+            item = b->timeline[first];
+            b->timeline[first] = b->timeline[--b->timeline_len];
+            return board_item(b, &item);
+        }
+    }
+
+    if (board_replay_deadline(b) <= t)
+    {
+        return board_replay_step(b, t);
+    }
+
+    return board_action(b);
+}
+
+/*
+ * Moves the board time forward to 'now', handling everything due on the
+ * way in time order. Returns BOARD_CHANGED_* flags.
+ */
+int board_advance(struct board *b, uint64_t now)
+{
+    uint64_t t;
+    int changes = 0;
+
+    b->advance_ns = now;
+
+    while ((t = board_next_deadline(b)) <= now)
+    {
+        b->now = t;
+        changes |= board_step(b, t);
+    }
+
+    if (now > b->now)
+    {
+        b->now = now;
+    }
+
+    return changes;
+}
+
+/*
+ * Makes 'owner' the event ring consumer, see GpioSessionClaim() in the
+ * driver. Returns 0 or -EBUSY.
+ */
+int board_claim(struct board *b, uint64_t owner)
+{
+    if (b->has_owner)
+    {
+        return b->owner == owner ? 0 : -EBUSY;
+    }
+
+    b->has_owner = 1;
+    b->owner = owner;
+    b->ring.tail = b->ring.head;
+
+    return 0;
+}
+
+/*
+ * Makes 'owner' the event ring consumer which takes the events from
+ * b->ring itself, like a process mapping the driver ring. Only such a
+ * consumer can arm GPIO_IOC_EXPECT, the verdicts never reach
+ * board_take_presses(). Returns 0 or -EBUSY.
+ */
+int board_map(struct board *b, uint64_t owner)
+{
+    int ret = board_claim(b, owner);
+
+    if (ret == 0)
+    {
+        b->mapped = 1;
+    }
+
+    return ret;
+}
+
+void board_release(struct board *b, uint64_t owner)
+{
+    if (b->has_owner && b->owner == owner)
+    {
+        b->has_owner = 0;
+        b->mapped = 0;
+        b->expect.count = 0;
+    }
+}
+
+int board_ready(const struct board *b)
+{
+    // Presses are held back until their verdict, like GpioRingReady()
+    if (b->expect.count && !(b->expect.flags & GPIO_EXPECT_F_PROGRESS))
+    {
+        return 0;
+    }
+
+    return b->ring.head != b->ring.tail;
+}
+
+/*
+ * Consumes the waiting events, storing the presses as ASCII button
+ * numbers like read() on the driver. The other events are dropped, there
+ * is no verdict among them: only a mapping owner arms verification.
+ * Returns number of presses.
+ */
+int board_take_presses(struct board *b, char *buf, size_t max)
+{
+    struct gpio_event *ev;
+    size_t n = 0;
+
+    while (b->ring.tail != b->ring.head && n < max)
+    {
+        ev = &b->ring.events[b->ring.tail & (GPIO_RING_SIZE - 1)];
+        if (ev->type == GPIO_EV_BUTTON)
+        {
+            buf[n++] = '0' + ev->value;
+        }
+        b->ring.tail++;
+    }
+
+    return n;
+}
+
+unsigned int board_poll(struct board *b, uint64_t owner, unsigned int events)
+{
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    if (events & (POLLIN | POLLRDNORM))
+    {
+        if (board_claim(b, owner))
+        {
+            mask |= POLLERR;
+        }
+        else if (board_ready(b))
+        {
+            mask |= POLLIN | POLLRDNORM;
+        }
+    }
+
+    if (!b->play_running && !b->anim_running)
+    {
+        mask |= POLLPRI;
+    }
+
+    return mask;
+}
+
+static void board_apply(struct board *b, uint32_t set, uint32_t clear)
+{
+    board_set_leds(b, (b->leds & ~clear) | set);
+}
+
+/*
+ * Write to the device by 'owner': binary command or the text "LEDn v" command.
+ * Returns the number of bytes taken or a negative error code.
+ */
+ssize_t board_write(struct board *b, uint64_t owner, const void *buf, size_t len)
+{
+    const struct gpio_cmd_header *header = buf;
+    const struct gpio_frame *frame;
+    size_t size = len;
+    char text[80];
+    int ret;
+
+    if (len >= sizeof(*header) && header->magic == GPIO_CMD_MAGIC)
+    {
+        switch (header->type)
+        {
+        case GPIO_CMD_PLAY:
+            if (header->count > GPIO_PLAY_MAX_STEPS
+                || len - sizeof(*header) != header->count * sizeof(struct gpio_play_step))
+            {
+                return -EINVAL;
+            }
+            // The end of the pattern goes to the ring of the owner, like GPIO_IOC_PLAY
+            ret = board_claim(b, owner);
+            if (ret)
+            {
+                return ret;
+            }
+            trace_add(b->record, b->now, TRACE_COMMAND, 0, TRACE_CODE_WRITE + header->type, header->count);
+            board_playback_start(b, (const struct gpio_play_step *) (header + 1), header->count);
+            return len;
+
+        case GPIO_CMD_FRAME:
+            if (header->count != 1 || len - sizeof(*header) != sizeof(*frame))
+            {
+                return -EINVAL;
+            }
+            frame = (const struct gpio_frame *) (header + 1);
+            trace_add(b->record, b->now, TRACE_COMMAND, 0, TRACE_CODE_WRITE + header->type, frame->leds);
+            board_set_leds(b, frame->leds);
+            return len;
+
+        default:
+            return -EINVAL;
+        }
+    }
+
+    // Text commands are short, the rest of a longer write is ignored
+    if (size > sizeof(text) - 1)
+    {
+        size = sizeof(text) - 1;
+    }
+    memcpy(text, buf, size);
+    text[size] = '\0';
+
+    if (strstr(text, "LED") && strlen(text) >= 5 && text[3] >= '1' && text[3] <= '4')
+    {
+        trace_add(b->record, b->now, TRACE_COMMAND, text[3] - '0', TRACE_CODE_TEXT, text[5] == '1');
+        if (text[5] == '1')
+        {
+            board_apply(b, 1 << (text[3] - '1'), 0);
+        }
+        else
+        {
+            board_apply(b, 0, 1 << (text[3] - '1'));
+        }
+        return len;
+    }
+
+    return 0;
+}
+
+/*
+ * ioctl on the device by 'owner'. The argument is already in this process, for
+ * GPIO_IOC_PLAY also the steps it points to, for GPIO_IOC_ANIMATE the frames. Returns 0 or -errno.
+ */
+int board_ioctl(struct board *b, uint64_t owner, unsigned long cmd, void *arg)
+{
+    struct gpio_version *version;
+    struct gpio_leds *leds;
+    struct gpio_play *play;
+    struct gpio_expect *expect;
+    struct gpio_animation *animation;
+    struct gpio_config *config;
+    uint32_t tick_us;
+    int ret;
+
+    if (b->record)
+    {
+        trace_ioctl(b->record, b->now, cmd, arg);
+    }
+
+    // Their events land in the ring or hold it back, only its owner may issue them
+    if (cmd == GPIO_IOC_PLAY || cmd == GPIO_IOC_EXPECT || cmd == GPIO_IOC_ANIMATE)
+    {
+        ret = board_claim(b, owner);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    switch (cmd)
+    {
+    case GPIO_IOC_GET_VERSION:
+        version = arg;
+        version->abi = GPIO_ABI_VERSION;
+        version->ring = GPIO_RING_VERSION;
+        version->leds = BOARD_LEDS;
+        version->buttons = BOARD_BUTTONS;
+        return 0;
+
+    case GPIO_IOC_SET_LEDS:
+        leds = arg;
+        board_apply(b, leds->set, leds->clear & ~leds->set);
+        return 0;
+
+    case GPIO_IOC_SET_FRAME:
+        board_set_leds(b, ((struct gpio_frame *) arg)->leds);
+        return 0;
+
+    case GPIO_IOC_GET_SWITCHES:
+        *(uint32_t *) arg = b->switches;
+        return 0;
+
+    case GPIO_IOC_GET_CONFIG:
+        *(struct gpio_config *) arg = b->config;
+        return 0;
+
+    case GPIO_IOC_SET_CONFIG:
+        config = arg;
+        if (config->debounce_us > GPIO_CONFIG_DEBOUNCE_MAX_US || config->confirm_us > GPIO_CONFIG_CONFIRM_MAX_US
+            || config->pulse_ms > GPIO_CONFIG_PULSE_MAX_MS || config->read_timeout_ms > GPIO_CONFIG_TIMEOUT_MAX_MS)
+        {
+            return -EINVAL;
+        }
+        b->config = *config;
+        return 0;
+
+    case GPIO_IOC_GET_STATS:
+        b->stats.overruns = b->ring.overruns;
+        *(struct gpio_stats *) arg = b->stats;
+        return 0;
+
+    case GPIO_IOC_PLAY:
+        play = arg;
+        if (play->count > GPIO_PLAY_MAX_STEPS)
+        {
+            return -EINVAL;
+        }
+        board_playback_start(b, (const struct gpio_play_step *) (uintptr_t) play->steps, play->count);
+        return 0;
+
+    case GPIO_IOC_EXPECT:
+        expect = arg;
+        if (expect->count > GPIO_EXPECT_MAX
+            || ((expect->flags & GPIO_EXPECT_F_PLAY_WRONG)
+                && (expect->wrong.repeat < 1 || expect->wrong.repeat > GPIO_PLAY_MAX_STEPS))
+            || ((expect->flags & GPIO_EXPECT_F_PLAY_COMPLETE)
+                && (expect->complete.repeat < 1 || expect->complete.repeat > GPIO_PLAY_MAX_STEPS)))
+        {
+            return -EINVAL;
+        }
+        for (uint32_t i = 0; i < expect->count; i++)
+        {
+            if (expect->buttons[i] < 1 || expect->buttons[i] > BOARD_BUTTONS)
+            {
+                return -EINVAL;
+            }
+        }
+        // Verdicts reach only the mapping, like in the driver
+        if (expect->count && !(b->mapped && b->owner == owner))
+        {
+            return -EOPNOTSUPP;
+        }
+        b->expect = *expect;
+        b->expect_index = 0;
+        // Arming drops what is left in the ring, every press after it has a verdict
+        if (expect->count)
+        {
+            b->ring.tail = b->ring.head;
+        }
+        return 0;
+
+    case GPIO_IOC_ANIMATE:
+        animation = arg;
+        tick_us = animation->tick_us ? animation->tick_us : 125; // pwm_tick_us default
+        if (animation->count > GPIO_ANIM_MAX_FRAMES || tick_us < GPIO_ANIM_TICK_MIN_US
+            || tick_us > GPIO_ANIM_TICK_MAX_US)
+        {
+            return -EINVAL;
+        }
+        board_animation_start(b, (const struct gpio_anim_frame *) (uintptr_t) animation->frames,
+                              animation->count, tick_us);
+        return 0;
+
+    case GPIO_IOC_GET_ANIM_STATS:
+        *(struct gpio_anim_stats *) arg = b->anim_stats;
+        return 0;
+
+    case GPIO_IOC_GET_PLAY_STATS:
+        *(struct gpio_play_stats *) arg = b->play_stats;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
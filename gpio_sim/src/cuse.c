@@ -0,0 +1,580 @@
+#define _GNU_SOURCE // ppoll()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+
+#include "cuse.h"
+
+/* Time base of the board. */
+uint64_t cuse_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sends the reply of request 'unique': an error (negative errno) or the
+ * data, which may be split in two parts.
+ */
+static int cuse_reply(struct cuse_server *srv, uint64_t unique, int error,
+                      const void *data, size_t len, const void *data2, size_t len2)
+{
+    struct fuse_out_header out;
+    struct iovec iov[3];
+    int iovcnt = 1;
+
+    out.unique = unique;
+    out.error = error;
+    out.len = sizeof(out);
+
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(out);
+
+    if (error == 0 && len)
+    {
+        iov[iovcnt].iov_base = (void *) data;
+        iov[iovcnt++].iov_len = len;
+        out.len += len;
+    }
+
+    if (error == 0 && len2)
+    {
+        iov[iovcnt].iov_base = (void *) data2;
+        iov[iovcnt++].iov_len = len2;
+        out.len += len2;
+    }
+
+    // ENOENT means the request was interrupted meanwhile, it is no error
+    if (writev(srv->fd, iov, iovcnt) < 0 && errno != ENOENT)
+    {
+        perror("cuse reply");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cuse_reply_error(struct cuse_server *srv, uint64_t unique, int error)
+{
+    return cuse_reply(srv, unique, error, NULL, 0, NULL, 0);
+}
+
+/* Wakes up everybody polling the device, they poll again. */
+static void cuse_notify_polls(struct cuse_server *srv)
+{
+    struct fuse_out_header out;
+    struct fuse_notify_poll_wakeup_out wakeup;
+    struct iovec iov[2];
+
+    for (size_t i = 0; i < srv->polls_len; i++)
+    {
+        out.unique = 0;
+        out.error = FUSE_NOTIFY_POLL;
+        out.len = sizeof(out) + sizeof(wakeup);
+        wakeup.kh = srv->polls[i];
+
+        iov[0].iov_base = &out;
+        iov[0].iov_len = sizeof(out);
+        iov[1].iov_base = &wakeup;
+        iov[1].iov_len = sizeof(wakeup);
+
+        if (writev(srv->fd, iov, 2) < 0 && errno != ENOENT)
+        {
+            perror("cuse notify");
+        }
+    }
+
+    srv->polls_len = 0;
+}
+
+/*
+ * Answers the blocked reads which got presses or timed out.
+ */
+static void cuse_serve_reads(struct cuse_server *srv, uint64_t now)
+{
+    struct cuse_read *rd;
+    char presses[80];
+    size_t i = 0;
+    int n;
+
+    while (i < srv->reads_len)
+    {
+        rd = &srv->reads[i];
+        n = 0;
+
+        if (board_ready(srv->board))
+        {
+            n = board_take_presses(srv->board, presses, rd->size < sizeof(presses) ? rd->size : sizeof(presses));
+        }
+
+        if (n > 0 || rd->deadline <= now)
+        {
+            cuse_reply(srv, rd->unique, 0, presses, n, NULL, 0);
+            srv->reads[i] = srv->reads[--srv->reads_len];
+            continue;
+        }
+
+        i++;
+    }
+}
+
+static void cuse_init(struct cuse_server *srv, uint64_t unique)
+{
+    struct cuse_init_out out;
+    char info[64];
+    int info_len;
+
+    memset(&out, 0, sizeof(out));
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = FUSE_KERNEL_MINOR_VERSION;
+    out.flags = CUSE_UNRESTRICTED_IOCTL;
+    out.max_read = CUSE_MAX_WRITE;
+    out.max_write = CUSE_MAX_WRITE;
+
+    info_len = snprintf(info, sizeof(info), "DEVNAME=%s", srv->name) + 1;
+
+    cuse_reply(srv, unique, 0, &out, sizeof(out), info, info_len);
+}
+
+static void cuse_read(struct cuse_server *srv, uint64_t unique, const struct fuse_read_in *in)
+{
+    struct board *b = srv->board;
+    struct cuse_read *rd;
+    char presses[80];
+    int ret;
+    int n;
+
+    ret = board_claim(b, in->fh);
+    if (ret)
+    {
+        cuse_reply_error(srv, unique, ret);
+        return;
+    }
+
+    // Nothing can be taken, the events stay for the next read
+    if (in->size == 0)
+    {
+        cuse_reply(srv, unique, 0, NULL, 0, NULL, 0);
+        return;
+    }
+
+    // Other events (e.g. end of playback) are skipped, like in the driver
+    while (board_ready(b))
+    {
+        n = board_take_presses(b, presses, in->size < sizeof(presses) ? in->size : sizeof(presses));
+        if (n > 0)
+        {
+            cuse_reply(srv, unique, 0, presses, n, NULL, 0);
+            return;
+        }
+    }
+
+    if (in->flags & O_NONBLOCK)
+    {
+        cuse_reply_error(srv, unique, -EAGAIN);
+        return;
+    }
+
+    if (srv->reads_len >= CUSE_MAX_READS)
+    {
+        cuse_reply_error(srv, unique, -EBUSY);
+        return;
+    }
+
+    // Answered later from cuse_serve_reads()
+    rd = &srv->reads[srv->reads_len++];
+    rd->unique = unique;
+    rd->fh = in->fh;
+    rd->size = in->size;
+    rd->deadline = b->config.read_timeout_ms
+                 ? b->now + b->config.read_timeout_ms * 1000000ULL : BOARD_NEVER;
+}
+
+static void cuse_write(struct cuse_server *srv, uint64_t unique, const struct fuse_write_in *in,
+                       const void *data)
+{
+    struct fuse_write_out out;
+    ssize_t ret;
+
+    ret = board_write(srv->board, in->fh, data, in->size);
+    if (ret < 0)
+    {
+        cuse_reply_error(srv, unique, ret);
+        return;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.size = ret;
+    cuse_reply(srv, unique, 0, &out, sizeof(out), NULL, 0);
+}
+
+/*
+ * Unrestricted ioctl: the kernel does not know the argument layout, so
+ * the first reply asks it to retry with the user memory the request
+ * needs (the argument, and for GPIO_IOC_PLAY and GPIO_IOC_ANIMATE the steps
+ * or frames it points to).
+ */
+static void cuse_ioctl(struct cuse_server *srv, uint64_t unique, const struct fuse_ioctl_in *in,
+                       const void *data)
+{
+    struct fuse_ioctl_iovec iov[3];
+    struct fuse_ioctl_out out;
+    size_t size = _IOC_SIZE(in->cmd);
+    size_t need_in = 0;
+    size_t need_out = 0;
+    int in_iovs = 0;
+    int out_iovs = 0;
+    char arg[256];
+    const struct gpio_play *play;
+    const struct gpio_animation *animation;
+    struct gpio_play local;
+    struct gpio_animation local_animation;
+    int nested = in->cmd == GPIO_IOC_PLAY || in->cmd == GPIO_IOC_ANIMATE;
+    uint64_t records = 0;
+    size_t record_size = 0;
+    uint32_t count = 0;
+    uint32_t max_count = 0;
+    int ret;
+
+    if (size > sizeof(arg))
+    {
+        cuse_reply_error(srv, unique, -ENOTTY);
+        return;
+    }
+
+    if (_IOC_DIR(in->cmd) & _IOC_WRITE)
+    {
+        iov[in_iovs].base = in->arg;
+        iov[in_iovs++].len = size;
+        need_in += size;
+    }
+
+    // The play steps or animation frames can be located once the argument is known
+    if (nested && in->in_size >= size)
+    {
+        if (in->cmd == GPIO_IOC_PLAY)
+        {
+            play = data;
+            records = play->steps;
+            record_size = sizeof(struct gpio_play_step);
+            count = play->count;
+            max_count = GPIO_PLAY_MAX_STEPS;
+        }
+        else
+        {
+            animation = data;
+            records = animation->frames;
+            record_size = sizeof(struct gpio_anim_frame);
+            count = animation->count;
+            max_count = GPIO_ANIM_MAX_FRAMES;
+        }
+
+        if (count > max_count)
+        {
+            cuse_reply_error(srv, unique, -EINVAL);
+            return;
+        }
+
+        if (count)
+        {
+            iov[in_iovs].base = records;
+            iov[in_iovs++].len = count * record_size;
+            need_in += count * record_size;
+        }
+    }
+
+    if (_IOC_DIR(in->cmd) & _IOC_READ)
+    {
+        iov[in_iovs + out_iovs].base = in->arg;
+        iov[in_iovs + out_iovs++].len = size;
+        need_out += size;
+    }
+
+    if (in->in_size < need_in || in->out_size < need_out
+        || (nested && in->in_size < size))
+    {
+        memset(&out, 0, sizeof(out));
+        out.flags = FUSE_IOCTL_RETRY;
+        out.in_iovs = in_iovs;
+        out.out_iovs = out_iovs;
+        cuse_reply(srv, unique, 0, &out, sizeof(out), iov, (in_iovs + out_iovs) * sizeof(iov[0]));
+        return;
+    }
+
+    memset(arg, 0, sizeof(arg));
+    memcpy(arg, data, (_IOC_DIR(in->cmd) & _IOC_WRITE) ? size : 0);
+
+    if (in->cmd == GPIO_IOC_PLAY)
+    {
+        // Steps follow the argument in the request, point the argument at them
+        local = *(const struct gpio_play *) data;
+        local.steps = (uintptr_t) ((const char *) data + sizeof(local));
+        memcpy(arg, &local, sizeof(local));
+    }
+    else if (in->cmd == GPIO_IOC_ANIMATE)
+    {
+        local_animation = *(const struct gpio_animation *) data;
+        local_animation.frames = (uintptr_t) ((const char *) data + sizeof(local_animation));
+        memcpy(arg, &local_animation, sizeof(local_animation));
+    }
+
+    ret = board_ioctl(srv->board, in->fh, in->cmd, arg);
+    if (ret < 0)
+    {
+        cuse_reply_error(srv, unique, ret);
+        return;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.result = ret;
+    cuse_reply(srv, unique, 0, &out, sizeof(out), arg, need_out);
+}
+
+static void cuse_poll(struct cuse_server *srv, uint64_t unique, const struct fuse_poll_in *in)
+{
+    struct fuse_poll_out out;
+    size_t i;
+
+    memset(&out, 0, sizeof(out));
+    out.revents = board_poll(srv->board, in->fh, in->events);
+
+    if (in->flags & FUSE_POLL_SCHEDULE_NOTIFY)
+    {
+        for (i = 0; i < srv->polls_len && srv->polls[i] != in->kh; i++)
+        {
+        }
+
+        if (i == srv->polls_len && srv->polls_len < CUSE_MAX_POLLS)
+        {
+            srv->polls[srv->polls_len++] = in->kh;
+        }
+    }
+
+    cuse_reply(srv, unique, 0, &out, sizeof(out), NULL, 0);
+}
+
+static void cuse_interrupt(struct cuse_server *srv, const struct fuse_interrupt_in *in)
+{
+    for (size_t i = 0; i < srv->reads_len; i++)
+    {
+        if (srv->reads[i].unique == in->unique)
+        {
+            cuse_reply_error(srv, in->unique, -EINTR);
+            srv->reads[i] = srv->reads[--srv->reads_len];
+            return;
+        }
+    }
+}
+
+static void cuse_release(struct cuse_server *srv, uint64_t unique, const struct fuse_release_in *in)
+{
+    size_t i = 0;
+
+    board_release(srv->board, in->fh);
+
+    while (i < srv->reads_len)
+    {
+        if (srv->reads[i].fh == in->fh)
+        {
+            cuse_reply_error(srv, srv->reads[i].unique, -EBADF);
+            srv->reads[i] = srv->reads[--srv->reads_len];
+            continue;
+        }
+        i++;
+    }
+
+    cuse_reply_error(srv, unique, 0);
+}
+
+/*
+ * Handles one request read from /dev/cuse. Returns 1 if the board state
+ * changed in a way pollers have to be told about, 0 otherwise.
+ */
+static int cuse_request(struct cuse_server *srv, const char *buf, size_t len)
+{
+    const struct fuse_in_header *hdr = (const struct fuse_in_header *) buf;
+    const char *body = buf + sizeof(*hdr);
+    struct fuse_open_out open_out;
+
+    if (len < sizeof(*hdr) || hdr->len != len)
+    {
+        return 0;
+    }
+
+    switch (hdr->opcode)
+    {
+    case CUSE_INIT:
+        cuse_init(srv, hdr->unique);
+        return 0;
+
+    case FUSE_OPEN:
+        memset(&open_out, 0, sizeof(open_out));
+        open_out.fh = ++srv->next_fh;
+        open_out.open_flags = FOPEN_NONSEEKABLE;
+        cuse_reply(srv, hdr->unique, 0, &open_out, sizeof(open_out), NULL, 0);
+        return 0;
+
+    case FUSE_RELEASE:
+        cuse_release(srv, hdr->unique, (const struct fuse_release_in *) body);
+        return 0;
+
+    case FUSE_FLUSH:
+        cuse_reply_error(srv, hdr->unique, 0);
+        return 0;
+
+    case FUSE_READ:
+        cuse_read(srv, hdr->unique, (const struct fuse_read_in *) body);
+        return 0;
+
+    case FUSE_WRITE:
+        cuse_write(srv, hdr->unique, (const struct fuse_write_in *) body,
+                   body + sizeof(struct fuse_write_in));
+        return 1;
+
+    case FUSE_IOCTL:
+        cuse_ioctl(srv, hdr->unique, (const struct fuse_ioctl_in *) body,
+                   body + sizeof(struct fuse_ioctl_in));
+        return 1;
+
+    case FUSE_POLL:
+        cuse_poll(srv, hdr->unique, (const struct fuse_poll_in *) body);
+        return 0;
+
+    case FUSE_INTERRUPT:
+        cuse_interrupt(srv, (const struct fuse_interrupt_in *) body);
+        return 0;
+
+    default:
+        cuse_reply_error(srv, hdr->unique, -ENOSYS);
+        return 0;
+    }
+}
+
+/*
+ * Opens /dev/cuse, the device appears once the kernel sent CUSE_INIT,
+ * which is answered from cuse_run(). Returns 0 or -1 on error.
+ */
+int cuse_open(struct cuse_server *srv, const char *name, struct board *board)
+{
+    memset(srv, 0, sizeof(*srv));
+    srv->name = name;
+    srv->board = board;
+
+    srv->buf_len = CUSE_MAX_WRITE + 4096;
+    srv->buf = malloc(srv->buf_len);
+    if (!srv->buf)
+    {
+        return -1;
+    }
+
+    srv->fd = open(CUSE_DEVICE, O_RDWR | O_CLOEXEC);
+    if (srv->fd < 0)
+    {
+        printf("Error, '%s' not opened: %s\n", CUSE_DEVICE, strerror(errno));
+        free(srv->buf);
+        srv->buf = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void cuse_close(struct cuse_server *srv)
+{
+    if (srv->fd >= 0)
+    {
+        close(srv->fd);
+        srv->fd = -1;
+    }
+
+    free(srv->buf);
+    srv->buf = NULL;
+}
+
+/*
+ * Serves the device until *stop is set or the kernel drops it.
+ * Returns 0 or -1 on error.
+ */
+int cuse_run(struct cuse_server *srv, volatile int *stop)
+{
+    struct pollfd pfd = { .fd = srv->fd, .events = POLLIN };
+    struct timespec timeout;
+    uint64_t now, deadline;
+    ssize_t len;
+    int changes;
+
+    while (!*stop)
+    {
+        now = cuse_clock_ns();
+        changes = board_advance(srv->board, now);
+        cuse_serve_reads(srv, now);
+        if (changes & (BOARD_CHANGED_EVENTS | BOARD_CHANGED_PLAYBACK))
+        {
+            cuse_notify_polls(srv);
+        }
+
+        // Sleep until the board or a blocked read needs attention
+        deadline = board_next_deadline(srv->board);
+        for (size_t i = 0; i < srv->reads_len; i++)
+        {
+            if (srv->reads[i].deadline < deadline)
+            {
+                deadline = srv->reads[i].deadline;
+            }
+        }
+
+        // In ns, a ms timeout rounded up would make every playback step late
+        timeout.tv_sec = deadline > now ? (deadline - now) / 1000000000ULL : 0;
+        timeout.tv_nsec = deadline > now ? (deadline - now) % 1000000000ULL : 0;
+
+        if (ppoll(&pfd, 1, deadline == BOARD_NEVER ? NULL : &timeout, NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        if (!(pfd.revents & POLLIN))
+        {
+            continue;
+        }
+
+        len = read(srv->fd, srv->buf, srv->buf_len);
+        if (len < 0)
+        {
+            if (errno == EINTR || errno == ENOENT || errno == EAGAIN)
+            {
+                continue;
+            }
+            if (errno == ENODEV)
+            {
+                // The kernel released the device
+                return 0;
+            }
+            perror("cuse read");
+            return -1;
+        }
+
+        board_advance(srv->board, cuse_clock_ns());
+
+        if (cuse_request(srv, srv->buf, len))
+        {
+            cuse_notify_polls(srv);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "cuse.h"
+
+static volatile int stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-n name] [-s script] [-a] [-p trace [-x speed]] [-w trace] [-v]\n", prog);
+    printf("  -n name    device created as /dev/<name> (default gpio_driver)\n");
+    printf("  -s script  scripted button presses, see board_load_script()\n");
+    printf("  -p trace   replays the presses of a binary trace, see board_replay()\n");
+    printf("  -x speed   replay speed, 2 replays twice as fast (default 1)\n");
+    printf("  -w trace   records the switches, LED commands and LEDs to a binary trace\n");
+    printf("  -a         auto player repeating every played sequence\n");
+    printf("  -v         print LED changes and presses\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+    struct board board;
+    struct cuse_server srv;
+    const char *name = "gpio_driver";
+    const char *script = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    struct trace_writer recorder = {0};
+    struct trace replay = {0};
+    double speed = 1;
+    int auto_player = 0;
+    int verbose = 0;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "n:s:p:x:w:avh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            name = optarg;
+            break;
+        case 's':
+            script = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'w':
+            record_path = optarg;
+            break;
+        case 'a':
+            auto_player = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (speed <= 0)
+    {
+        printf("Error, the replay speed must be above 0\n");
+        return 1;
+    }
+
+    board_init(&board, cuse_clock_ns());
+    board.verbose = verbose;
+
+    if (script && board_load_script(&board, script) < 0)
+    {
+        board_free(&board);
+        return 1;
+    }
+
+    if (replay_path)
+    {
+        if (trace_load(&replay, replay_path) < 0)
+        {
+            board_free(&board);
+            return 1;
+        }
+
+        // The replay starts with the board, clients may connect later
+        if (board_replay(&board, &replay, speed) < 0)
+        {
+            printf("Error, no button presses in '%s'\n", replay_path);
+            trace_free(&replay);
+            board_free(&board);
+            return 1;
+        }
+    }
+
+    if (record_path)
+    {
+        if (trace_create(&recorder, record_path, board.now, board.seed) < 0)
+        {
+            trace_free(&replay);
+            board_free(&board);
+            return 1;
+        }
+        board.record = &recorder;
+    }
+
+    if (auto_player)
+    {
+        // Reacts after 300 ms and presses every 200 ms
+        struct board_action action = {0};
+
+        action.type = ACTION_AUTO;
+        action.count = 1;
+        action.hold_ns = 300000000ULL;
+        action.gap_ns = 200000000ULL;
+        board_add_action(&board, &action);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (cuse_open(&srv, name, &board) < 0)
+    {
+        trace_close(&recorder);
+        trace_free(&replay);
+        board_free(&board);
+        return 1;
+    }
+    srv.verbose = verbose;
+
+    printf("Virtual board on /dev/%s, Ctrl-C to stop\n", name);
+
+    ret = cuse_run(&srv, &stop);
+
+    cuse_close(&srv);
+
+    if (replay_path)
+    {
+        printf("Replay: %zu of %zu records, LED changes %u as recorded, %u diverged\n",
+               board.replay_pos, replay.count, board.replay_matched, board.replay_diverged);
+    }
+
+    trace_close(&recorder);
+    trace_free(&replay);
+    board_free(&board);
+
+    return ret < 0 ? 1 : 0;
+}
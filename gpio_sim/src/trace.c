@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpio_driver.h"
+#include "trace.h"
+
+/*
+ * Creates the trace file and writes its header. Times given to
+ * trace_add() are counted from start_ns. Returns 0 or -1 on error.
+ */
+int trace_create(struct trace_writer *w, const char *path, uint64_t start_ns, uint32_t seed)
+{
+    struct trace_header header = {0};
+
+    w->f = fopen(path, "wb");
+    if (!w->f)
+    {
+        printf("Error, trace '%s' not created\n", path);
+        return -1;
+    }
+
+    w->start_ns = start_ns;
+    w->records = 0;
+
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    header.seed = seed;
+    header.start_ns = start_ns;
+
+    if (fwrite(&header, sizeof(header), 1, w->f) != 1)
+    {
+        printf("Error, trace '%s' not written\n", path);
+        fclose(w->f);
+        w->f = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Appends a record, the write errors are reported by trace_close(). */
+void trace_add(struct trace_writer *w, uint64_t t, int kind, int pin, int code, uint32_t value)
+{
+    struct trace_record record;
+
+    if (!w || !w->f)
+    {
+        return;
+    }
+
+    record.t_ns = t > w->start_ns ? t - w->start_ns : 0;
+    record.kind = kind;
+    record.pin = pin;
+    record.code = code;
+    record.value = value;
+
+    fwrite(&record, sizeof(record), 1, w->f);
+    w->records++;
+}
+
+/*
+ * Records the ioctls driving the LEDs, the others are ignored. The value
+ * is the LED mask, SET_LEDS has the cleared LEDs in the second byte, and
+ * the number of steps or frames for a pattern or an animation.
+ */
+void trace_ioctl(struct trace_writer *w, uint64_t t, unsigned long cmd, const void *arg)
+{
+    const struct gpio_leds *leds;
+    uint32_t value;
+
+    switch (cmd)
+    {
+    case GPIO_IOC_SET_LEDS:
+        leds = arg;
+        value = (leds->set & 0xff) | (leds->clear & 0xff) << 8;
+        break;
+
+    case GPIO_IOC_SET_FRAME:
+        value = ((const struct gpio_frame *) arg)->leds;
+        break;
+
+    case GPIO_IOC_PLAY:
+        value = ((const struct gpio_play *) arg)->count;
+        break;
+
+    case GPIO_IOC_ANIMATE:
+        value = ((const struct gpio_animation *) arg)->count;
+        break;
+
+    default:
+        return;
+    }
+
+    trace_add(w, t, TRACE_COMMAND, 0, _IOC_NR(cmd), value);
+}
+
+/* Flushes and closes the trace. Returns 0 or -1 if records were lost. */
+int trace_close(struct trace_writer *w)
+{
+    int err;
+
+    if (!w->f)
+    {
+        return 0;
+    }
+
+    err = ferror(w->f);
+    err |= fclose(w->f);
+    w->f = NULL;
+
+    if (err)
+    {
+        printf("Error, trace not completely written (%llu records)\n", (unsigned long long) w->records);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Loads a whole trace in memory. Returns 0 or -1 on error.
+ */
+int trace_load(struct trace *trace, const char *path)
+{
+    struct trace_record *records;
+    size_t max = 0;
+    FILE *f;
+
+    memset(trace, 0, sizeof(*trace));
+
+    f = fopen(path, "rb");
+    if (!f)
+    {
+        printf("Error, trace '%s' not opened\n", path);
+        return -1;
+    }
+
+    if (fread(&trace->header, sizeof(trace->header), 1, f) != 1
+        || trace->header.magic != TRACE_MAGIC || trace->header.version != TRACE_VERSION
+        || trace->header.record_size != sizeof(struct trace_record))
+    {
+        printf("Error, '%s' is not a trace of version %d\n", path, TRACE_VERSION);
+        fclose(f);
+        return -1;
+    }
+
+    for (;;)
+    {
+        if (trace->count == max)
+        {
+            max = max ? 2 * max : 1024;
+            records = realloc(trace->records, max * sizeof(*records));
+            if (!records)
+            {
+                printf("Error, trace '%s' too big\n", path);
+                trace_free(trace);
+                fclose(f);
+                return -1;
+            }
+            trace->records = records;
+        }
+
+        if (fread(&trace->records[trace->count], sizeof(struct trace_record), 1, f) != 1)
+        {
+            break;
+        }
+        trace->count++;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+void trace_free(struct trace *trace)
+{
+    free(trace->records);
+    trace->records = NULL;
+    trace->count = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Time base of the game. The real clock is CLOCK_MONOTONIC. The virtual
+ * clock stands still while the game computes and jumps to the next board
+ * deadline whenever the game waits on the simulated board, so a whole
+ * game takes no wall clock time.
+ */
+struct game_clock
+{
+    int virtual;
+    uint64_t now_ns;        // Virtual time, unused by the real clock
+};
+
+void game_clock_init(struct game_clock *clk, int virtual);
+uint64_t game_clock_now(const struct game_clock *clk);
+void game_clock_advance(struct game_clock *clk, uint64_t t);
+int game_clock_sleep_until(struct game_clock *clk, uint64_t t);
+
+#endif // CLOCK_H
@@ -0,0 +1,58 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpio_driver.h"
+#include "board.h"
+#include "clock.h"
+
+#define DEVICE_RETRIES 10
+#define DEVICE_RETRY_DELAY_MS 500
+#define DEVICE_BOARD_OWNER 1
+#define DEVICE_KEYS 16
+
+/*
+ * Session with the gpio_driver device, kept open for the whole game.
+ * The session owns the driver event ring, which is mapped when possible.
+ * Instead of the driver the session can also use a simulated board
+ * living in the process, whose time is the (virtual) game clock.
+ * Keys typed on the terminal join the presses of the buttons, see
+ * device_key_press().
+ */
+struct game_device
+{
+    const char *path;
+    int fd;
+    struct gpio_ring *ring; // Mapped event ring, NULL if read() is used
+    struct board *board;    // Simulated board, NULL for the driver
+    struct game_clock *clock;
+    uint64_t play_end_ns;   // When the last pattern finished playing
+    uint32_t verdict;       // Last GPIO_EV_VERDICT value since device_expect(), 0 if none
+    struct trace_writer *record; // Trace of the presses and LED commands, NULL after opening
+
+    // Keyboard presses not taken yet, ASCII button numbers and their times
+    char keys[DEVICE_KEYS];
+    uint64_t key_stamps[DEVICE_KEYS];
+    size_t key_count;
+};
+
+int device_open(struct game_device *dev, const char *path);
+int device_open_board(struct game_device *dev, struct board *board, struct game_clock *clock);
+void device_close(struct game_device *dev);
+int device_connected(const struct game_device *dev);
+int device_reconnect(struct game_device *dev);
+int device_wait(struct game_device *dev, short events, int timeout_ms);
+int device_start_play(struct game_device *dev, const struct gpio_play_step *steps, size_t count);
+int device_play_time_ms(const struct gpio_play_step *steps, size_t count);
+int device_play(struct game_device *dev, const struct gpio_play_step *steps, size_t count);
+int device_stats(struct game_device *dev, struct gpio_stats *stats);
+int device_play_stats(struct game_device *dev, struct gpio_play_stats *stats);
+int device_start_animation(struct game_device *dev, const struct gpio_anim_frame *frames, size_t count);
+int device_animation_time_ms(const struct gpio_anim_frame *frames, size_t count);
+int device_expect(struct game_device *dev, const struct gpio_expect *expect);
+int device_key_press(struct game_device *dev, int button);
+int device_take_presses(struct game_device *dev, char *buf, uint64_t *stamps, size_t max);
+
+#endif // DEVICE_H
@@ -0,0 +1,106 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include "device.h"
+#include "clock.h"
+#include "histogram.h"
+#include "loop.h"
+#include "rng.h"
+
+#define LED_NUM 3
+#define BUF_LEN 80
+
+#define GAME_LENGTH 12
+#define TIME_DELAY 1 // Time Delay in Seconds
+#define TIME_DELAY_US (TIME_DELAY * 1000000)
+#define WAIT_FOR_PLAYER 10
+#define GAME_MAX_FLASHES 2
+#define FADE_US (TIME_DELAY_US / 4) // Flash fade in and fade out
+#define TEMPO_MIN_MS 10 // Fastest sequence step, lit and dark
+#define TEMPO_MAX_MS 10000
+#define STEP_BITS 2
+#define ERROR_RETRIES 5 // Errors in a row before the session gives up
+#define ERROR_BACKOFF_MS 100 // Wait before the first retry, doubled for every next one
+
+#if GAME_LENGTH * STEP_BITS > 32 || LED_NUM > (1 << STEP_BITS)
+#error "The sequence does not fit in struct simon"
+#endif
+
+enum game_state
+{
+    STATE_INTRO,            // Flashing for start
+    STATE_SEQUENCE,         // Driver plays the sequence
+    STATE_TURN,             // Player repeats it
+    STATE_RESULT,           // Flashing for a lost or won game
+    STATE_OUTRO,            // Flashing for the end
+    STATE_DONE,
+    STATE_ERROR,            // Device failed, the game starts over
+    STATE_RETRY,            // Waiting to start over after an error
+    STATE_RECONNECT,        // Device lost, waiting to reopen it
+};
+
+struct simon
+{
+    enum game_state state;
+    size_t level;           // Length of the sequence
+    uint32_t sequence;      // LED number - 1 of every step, 2 bits each, step 0 lowest
+    char input[BUF_LEN];
+    uint64_t stamps[BUF_LEN];
+    int got;                // Presses in this turn
+    int checking;           // The driver verifies the presses of this turn
+    int next_game;          // Another game follows STATE_RESULT
+};
+
+/* Settings of the sessions, only read by the engine and shared by all of them. */
+struct engine_config
+{
+    long games_limit;       // Games to play before quitting, 0 plays until the player wins
+    unsigned int tempo_ms[GAME_LENGTH]; // Time a sequence step is lit and then dark, per level
+    FILE *out;              // Game messages, NULL keeps the session quiet
+    volatile sig_atomic_t *dump_requested; // Set from a signal handler to print the timing, may be NULL
+};
+
+/*
+ * Game session: the game state machine with its own clock, event loop,
+ * random numbers and statistics. Sessions share nothing but the config,
+ * so any number of them can run at once, each one from a single thread.
+ *
+ * The I/O backend is chosen by the caller between engine_init() and
+ * engine_run(): 'device' is opened on the driver with device_open() or on
+ * a simulated board with device_open_board(), then 'loop' is created on it.
+ */
+struct engine_session
+{
+    const struct engine_config *config;
+    struct game_device device;
+    struct game_clock clock;
+    struct game_loop loop;
+    struct simon game;
+    struct rng rng;
+
+    // Player timing: first press after the playback, between presses, whole turn
+    struct histogram reaction_hist;
+    struct histogram interval_hist;
+    struct histogram turn_hist;
+
+    // Playback timing: worst step overshoot of every sequence
+    struct histogram overshoot_hist;
+
+    long games_won;
+    long games_lost;
+    long errors;            // Patterns not played, devices failed
+    int failures;           // Errors in a row, reset by a sequence played
+    int reconnects;         // Failed tries to reopen the lost device
+};
+
+void engine_config_init(struct engine_config *config);
+int engine_parse_tempo(struct engine_config *config, const char *arg);
+void engine_init(struct engine_session *s, const struct engine_config *config, uint64_t seed, int virtual);
+void engine_run(struct engine_session *s);
+void engine_print_timing(struct engine_session *s, FILE *out);
+
+#endif // ENGINE_H
@@ -0,0 +1,14 @@
+#ifndef GETCH_H
+#define GETCH_H
+
+#include <stddef.h>
+
+/*
+ * Keyboard on the terminal, in raw mode from keyboard_init() to the end of
+ * the process. Keys '1' - '4' are presses of the buttons, 'q' quits.
+ */
+int keyboard_init(void);
+void keyboard_restore(void);
+int keyboard_read(char *keys, size_t max);
+
+#endif // GETCH_H
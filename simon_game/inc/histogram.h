@@ -0,0 +1,34 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Fixed bucket latency histogram in microseconds. Values below
+ * HIST_SUB_BUCKETS have a bucket each, above that every power of two is
+ * split into HIST_SUB_BUCKETS linear buckets, so the relative error stays
+ * under 1 / HIST_SUB_BUCKETS over the whole range (HDR histogram style).
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36 // Values up to 2^36 us (~19 h), larger ones are clamped
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram
+{
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+void histogram_init(struct histogram *h, const char *name);
+void histogram_record(struct histogram *h, uint64_t value_us);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *h, double p);
+void histogram_print(const struct histogram *h, FILE *out);
+
+#endif // HISTOGRAM_H
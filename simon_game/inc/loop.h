@@ -0,0 +1,54 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+
+#include "device.h"
+#include "clock.h"
+
+#define LOOP_NEVER UINT64_MAX
+
+/* Deadlines of the game. */
+enum loop_timer
+{
+    TIMER_PLAYBACK,         // Playback should be over by now
+    TIMER_PLAYER,           // Player ran out of time
+    TIMER_RETRY,            // Next try after a device error, or to reopen the lost device
+    LOOP_TIMERS,
+};
+
+/* Events reported by loop_wait(). */
+#define LOOP_DEVICE_IN  0x01 // Button presses are waiting
+#define LOOP_DEVICE_PRI 0x02 // No playback is running
+#define LOOP_STDIN      0x04 // Keys are waiting on stdin
+#define LOOP_STDIN_HUP  0x08 // stdin was hung up or failed, no more keys will come
+#define LOOP_DEVICE_HUP 0x10 // The device went away, its session has to be reopened
+#define LOOP_TIMER(id)  (0x20 << (id))
+
+/*
+ * Single threaded event loop of the game. With the driver it is an epoll
+ * over the device, stdin and one timerfd per deadline. With the simulated
+ * board the board is run from deadline to deadline on the game clock.
+ */
+struct game_loop
+{
+    struct game_device *dev;
+    struct game_clock *clock;
+    int epfd;               // -1 on the simulated board
+    int dev_fd;             // Device fd registered in epoll, -1 while the device is lost
+    short dev_events;       // POLLIN / POLLPRI watched on the device
+    int stdin_fd;           // -1 if stdin is not watched
+    int timer_fd[LOOP_TIMERS];
+    uint64_t deadline[LOOP_TIMERS]; // Game clock, LOOP_NEVER if not armed
+};
+
+int loop_init(struct game_loop *loop, struct game_device *dev, struct game_clock *clock, int watch_stdin);
+void loop_close(struct game_loop *loop);
+int loop_watch_device(struct game_loop *loop, short events);
+int loop_device_changed(struct game_loop *loop);
+void loop_unwatch_stdin(struct game_loop *loop);
+int loop_timer_set(struct game_loop *loop, enum loop_timer id, uint64_t deadline_ns);
+void loop_timer_cancel(struct game_loop *loop, enum loop_timer id);
+int loop_wait(struct game_loop *loop);
+
+#endif // LOOP_H
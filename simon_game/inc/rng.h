@@ -0,0 +1,20 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * xoshiro256** pseudo random number generator. The state is per user, so
+ * every game session draws its own reproducible sequence without locks.
+ */
+struct rng
+{
+    uint64_t s[4];
+};
+
+void rng_seed(struct rng *rng, uint64_t seed);
+uint64_t rng_next(struct rng *rng);
+uint32_t rng_below(struct rng *rng, uint32_t n);
+uint64_t rng_mix(uint64_t x);
+
+#endif // RNG_H
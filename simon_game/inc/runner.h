@@ -0,0 +1,44 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+#include "board.h"
+#include "histogram.h"
+
+/*
+ * Plays many game sessions in virtual time, each one on its own simulated
+ * board. The sessions are queued on one worker thread per core, a worker
+ * whose queue ran dry steals sessions from the others.
+ */
+struct runner_config
+{
+    const struct engine_config *engine;
+    unsigned int threads;
+    size_t sessions;
+    uint64_t seed;          // Seeds of the sessions are derived from it and their number
+
+    // Prepares the simulated board of a session after board_init(), returns 0 or -1
+    int (*setup_board)(struct board *b, void *arg);
+    void *arg;
+};
+
+struct runner_result
+{
+    size_t sessions;
+    long games_won;
+    long games_lost;
+    long errors;
+    uint64_t game_ns;       // Virtual time played by all sessions
+    uint64_t steals;        // Sessions run by another worker than the one they were queued on
+
+    struct histogram reaction_hist;
+    struct histogram interval_hist;
+    struct histogram turn_hist;
+};
+
+int runner_run(const struct runner_config *config, struct runner_result *result);
+
+#endif // RUNNER_H
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "device.h"
+#include "board.h"
+
+#define LED_COUNT 4
+#define BUF_LEN 80
+
+#define BENCH_ITERATIONS 10000
+#define BENCH_ROUND_STEPS 12
+#define BENCH_PRESS_GAP_NS 100000000ULL // Virtual time between two presses
+
+/*
+ * Benchmark target: the real driver (or gpio_sim) behind a device node,
+ * or the board model linked in, without any system call.
+ */
+struct bench_ctx
+{
+    struct game_device dev;
+    struct board *board;    // Local simulated device, NULL for the device node
+    const char *target;
+    unsigned int iterations;
+};
+
+struct bench_op
+{
+    const char *name;
+    const char *path;       // Protocol path the operation exercises
+    int (*run)(struct bench_ctx *ctx, unsigned int i);
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Legacy text command, one LED toggled per write. */
+static int op_text_write(struct bench_ctx *ctx, unsigned int i)
+{
+    char cmd[8];
+    int len;
+
+    len = snprintf(cmd, sizeof(cmd), "LED%u %u", i % LED_COUNT + 1, (i / LED_COUNT) & 1);
+
+    if (ctx->board)
+    {
+        return board_write(ctx->board, 1, cmd, len) == len ? 0 : -1;
+    }
+
+    return write(ctx->dev.fd, cmd, len) == len ? 0 : -1;
+}
+
+/* Binary frame command, all LEDs updated by one write. */
+static int op_frame_write(struct bench_ctx *ctx, unsigned int i)
+{
+    struct
+    {
+        struct gpio_cmd_header header;
+        struct gpio_frame frame;
+    } cmd = { { GPIO_CMD_MAGIC, GPIO_CMD_FRAME, 1 }, { i & 0xf } };
+
+    if (ctx->board)
+    {
+        return board_write(ctx->board, 1, &cmd, sizeof(cmd)) == sizeof(cmd) ? 0 : -1;
+    }
+
+    return write(ctx->dev.fd, &cmd, sizeof(cmd)) == sizeof(cmd) ? 0 : -1;
+}
+
+static int bench_ioctl(struct bench_ctx *ctx, unsigned long cmd, void *arg)
+{
+    if (ctx->board)
+    {
+        return board_ioctl(ctx->board, 1, cmd, arg) < 0 ? -1 : 0;
+    }
+
+    return ioctl(ctx->dev.fd, cmd, arg);
+}
+
+static int op_ioctl_leds(struct bench_ctx *ctx, unsigned int i)
+{
+    struct gpio_leds leds = { .set = i & 0xf, .clear = ~i & 0xf };
+
+    return bench_ioctl(ctx, GPIO_IOC_SET_LEDS, &leds);
+}
+
+static int op_ioctl_frame(struct bench_ctx *ctx, unsigned int i)
+{
+    struct gpio_frame frame = { .leds = i & 0xf };
+
+    return bench_ioctl(ctx, GPIO_IOC_SET_FRAME, &frame);
+}
+
+static int op_ioctl_switches(struct bench_ctx *ctx, unsigned int i)
+{
+    __u32 switches;
+
+    return bench_ioctl(ctx, GPIO_IOC_GET_SWITCHES, &switches);
+}
+
+/*
+ * Read path. Against a device node nobody presses the buttons, so this
+ * is the cost of a non-blocking read (or ring check) finding nothing.
+ * The local board gets a press which has to travel to the reader.
+ */
+static int op_read(struct bench_ctx *ctx, unsigned int i)
+{
+    struct board *b = ctx->board;
+    char buf[BUF_LEN];
+
+    if (!b)
+    {
+        return device_take_presses(&ctx->dev, buf, NULL, sizeof(buf)) < 0 ? -1 : 0;
+    }
+
+    board_advance(b, b->now + BENCH_PRESS_GAP_NS);
+    if (board_press(b, i % LED_COUNT + 1, 0, 0, BENCH_PRESS_GAP_NS / 2) < 0)
+    {
+        return -1;
+    }
+
+    while (!board_ready(b))
+    {
+        board_advance(b, board_next_deadline(b));
+    }
+
+    return board_take_presses(b, buf, sizeof(buf)) == 1 ? 0 : -1;
+}
+
+static int op_poll(struct bench_ctx *ctx, unsigned int i)
+{
+    struct pollfd pfd = { .fd = ctx->dev.fd, .events = POLLIN | POLLPRI };
+
+    if (ctx->board)
+    {
+        board_poll(ctx->board, 1, POLLIN | POLLPRI);
+        return 0;
+    }
+
+    return poll(&pfd, 1, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Whole round as the game plays it: a sequence upload, its playback
+ * with no delays and the completion notification.
+ */
+static int op_round(struct bench_ctx *ctx, unsigned int i)
+{
+    struct gpio_play_step steps[BENCH_ROUND_STEPS];
+    struct gpio_play play = { .count = BENCH_ROUND_STEPS, .steps = (uintptr_t) steps };
+    struct board *b = ctx->board;
+    char buf[BUF_LEN];
+
+    for (size_t s = 0; s < BENCH_ROUND_STEPS; s++)
+    {
+        steps[s].led_mask = 1 << ((i + s) % LED_COUNT);
+        steps[s].on_us = 1;
+        steps[s].off_us = 1;
+    }
+
+    if (!b)
+    {
+        if (device_play(&ctx->dev, steps, BENCH_ROUND_STEPS) < 0)
+        {
+            return -1;
+        }
+
+        // The end of playback is queued as an event, keeping the ring empty
+        while (device_take_presses(&ctx->dev, buf, NULL, sizeof(buf)) > 0)
+        {
+        }
+
+        return 0;
+    }
+
+    if (board_ioctl(b, 1, GPIO_IOC_PLAY, &play) < 0)
+    {
+        return -1;
+    }
+
+    while (b->play_running)
+    {
+        board_advance(b, board_next_deadline(b));
+    }
+
+    while (board_ready(b))
+    {
+        board_take_presses(b, buf, sizeof(buf));
+    }
+
+    return 0;
+}
+
+static const struct bench_op bench_ops[] =
+{
+    { "text_write",    "write",  op_text_write },
+    { "frame_write",   "write",  op_frame_write },
+    { "ioctl_leds",    "ioctl",  op_ioctl_leds },
+    { "ioctl_frame",   "ioctl",  op_ioctl_frame },
+    { "ioctl_switches","ioctl",  op_ioctl_switches },
+    { "read",          "read",   op_read },
+    { "poll",          "poll",   op_poll },
+    { "round",         "ioctl",  op_round },
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of the sorted samples. */
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t rank = (size_t) (p * n + 0.999999);
+
+    return sorted[rank ? rank - 1 : 0];
+}
+
+/*
+ * Runs one operation and prints its statistics as a JSON line.
+ * Returns 0 or -1 on error.
+ */
+static int bench_run(struct bench_ctx *ctx, const struct bench_op *op, uint64_t *samples)
+{
+    const char *mode = ctx->board ? "local" : ctx->dev.ring ? "mmap" : "syscall";
+    uint64_t start, t0, t1, total = 0;
+    unsigned int n = ctx->iterations;
+
+    // The round plays with real timers, fewer of them keep the run short
+    if (op->run == op_round && !ctx->board && n > 1000)
+    {
+        n = 1000;
+    }
+
+    start = now_ns();
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        t0 = now_ns();
+        if (op->run(ctx, i) < 0)
+        {
+            printf("{\"op\":\"%s\",\"error\":\"%s\",\"iteration\":%u}\n", op->name, strerror(errno), i);
+            return -1;
+        }
+        t1 = now_ns();
+
+        samples[i] = t1 - t0;
+        total += t1 - t0;
+    }
+
+    t1 = now_ns();
+
+    qsort(samples, n, sizeof(*samples), compare_u64);
+
+    printf("{\"op\":\"%s\",\"path\":\"%s\",\"target\":\"%s\",\"mode\":\"%s\",\"n\":%u,"
+           "\"min_ns\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+           "\"max_ns\":%llu,\"ops_per_s\":%.0f}\n",
+           op->name, op->path, ctx->target, mode, n,
+           (unsigned long long) samples[0],
+           (unsigned long long) (total / n),
+           (unsigned long long) percentile(samples, n, 0.50),
+           (unsigned long long) percentile(samples, n, 0.99),
+           (unsigned long long) percentile(samples, n, 0.999),
+           (unsigned long long) samples[n - 1],
+           n * 1e9 / (t1 - start));
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-d device] [-l] [-n iterations] [-o op]\n", prog);
+    printf("  -d device      device node (default %s), the driver or gpio_sim\n", GPIO_DRIVER_DEVICE);
+    printf("  -l             local simulated board instead of a device node\n");
+    printf("  -n iterations  samples per operation (default %d)\n", BENCH_ITERATIONS);
+    printf("  -o op          only this operation, may be repeated\n");
+    printf("Prints one JSON object per operation.\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_ctx ctx = { .target = GPIO_DRIVER_DEVICE, .iterations = BENCH_ITERATIONS };
+    struct board board;
+    const char *only[16];
+    size_t only_len = 0;
+    uint64_t *samples;
+    int local = 0;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:ln:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            ctx.target = optarg;
+            break;
+        case 'l':
+            local = 1;
+            break;
+        case 'n':
+            ctx.iterations = atoi(optarg);
+            break;
+        case 'o':
+            if (only_len < sizeof(only) / sizeof(only[0]))
+            {
+                only[only_len++] = optarg;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (ctx.iterations == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    samples = malloc(ctx.iterations * sizeof(*samples));
+    if (!samples)
+    {
+        return 1;
+    }
+
+    if (local)
+    {
+        board_init(&board, now_ns());
+        board_claim(&board, 1);
+        ctx.board = &board;
+        ctx.target = "board";
+    }
+    else if (device_open(&ctx.dev, ctx.target) < 0)
+    {
+        free(samples);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++)
+    {
+        size_t j = 0;
+
+        while (j < only_len && strcmp(only[j], bench_ops[i].name) != 0)
+        {
+            j++;
+        }
+
+        if (only_len && j == only_len)
+        {
+            continue;
+        }
+
+        if (bench_run(&ctx, &bench_ops[i], samples) < 0)
+        {
+            ret = 1;
+        }
+    }
+
+    if (local)
+    {
+        board_free(&board);
+    }
+    else
+    {
+        device_close(&ctx.dev);
+    }
+
+    free(samples);
+
+    return ret;
+}
@@ -0,0 +1,60 @@
+#include <time.h>
+#include <errno.h>
+
+#include "clock.h"
+
+void game_clock_init(struct game_clock *clk, int virtual)
+{
+    clk->virtual = virtual;
+    clk->now_ns = 0;
+}
+
+/* Current time in ns. */
+uint64_t game_clock_now(const struct game_clock *clk)
+{
+    struct timespec ts;
+
+    if (clk->virtual)
+    {
+        return clk->now_ns;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Moves the virtual clock forward to 't', it never goes back. */
+void game_clock_advance(struct game_clock *clk, uint64_t t)
+{
+    if (clk->virtual && t > clk->now_ns)
+    {
+        clk->now_ns = t;
+    }
+}
+
+/*
+ * Waits until the clock reaches 't'. The real clock sleeps to the absolute
+ * deadline, so the time spent before the call does not add to the wait.
+ * Returns 0 or -1 with errno EINTR if a signal cut the sleep short.
+ */
+int game_clock_sleep_until(struct game_clock *clk, uint64_t t)
+{
+    struct timespec ts = { .tv_sec = t / 1000000000ULL, .tv_nsec = t % 1000000000ULL };
+    int ret;
+
+    if (clk->virtual)
+    {
+        game_clock_advance(clk, t);
+        return 0;
+    }
+
+    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    if (ret)
+    {
+        errno = ret;
+        return -1;
+    }
+
+    return 0;
+}
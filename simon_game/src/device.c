@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "device.h"
+
+/* Time base of the driver timestamps, used when no game clock is given. */
+static const struct game_clock device_real_clock;
+
+static uint64_t device_now(const struct game_device *dev)
+{
+    return game_clock_now(dev->clock ? dev->clock : &device_real_clock);
+}
+
+/*
+ * True if the error means the device went away (e.g. the module was
+ * reloaded) and the session has to be opened again.
+ */
+static int device_lost(int err)
+{
+    return err == ENODEV || err == ENXIO || err == EIO || err == EBADF;
+}
+
+/*
+ * Opens the device and maps its event ring. Returns 0 or -1 with errno set.
+ */
+static int device_connect(struct game_device *dev)
+{
+    struct gpio_version version;
+    struct gpio_ring *ring;
+
+    dev->fd = open(dev->path, O_RDWR | O_NONBLOCK);
+    if (dev->fd < 0)
+    {
+        return -1;
+    }
+
+    // Checking that the driver speaks the binary interface
+    if (ioctl(dev->fd, GPIO_IOC_GET_VERSION, &version) < 0)
+    {
+        close(dev->fd);
+        dev->fd = -1;
+        return -1;
+    }
+
+    // Mapping the event ring, presses are then taken without read() calls
+    dev->ring = NULL;
+    ring = mmap(NULL, GPIO_RING_MMAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (ring != MAP_FAILED)
+    {
+        if (ring->magic == GPIO_RING_MAGIC && ring->version == GPIO_RING_VERSION)
+        {
+            dev->ring = ring;
+        }
+        else
+        {
+            munmap(ring, GPIO_RING_MMAP_LEN);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Opens the session, retrying while the device is not (yet) available.
+ * Returns 0 or -1 on error.
+ */
+int device_open(struct game_device *dev, const char *path)
+{
+    dev->path = path;
+    dev->fd = -1;
+    dev->ring = NULL;
+    dev->board = NULL;
+    dev->clock = NULL;
+    dev->key_count = 0;
+    dev->play_end_ns = 0;
+    dev->record = NULL;
+
+    for (int retry = 0; retry < DEVICE_RETRIES; retry++)
+    {
+        if (device_connect(dev) == 0)
+        {
+            return 0;
+        }
+
+        if (errno != ENOENT && errno != EBUSY && !device_lost(errno))
+        {
+            break;
+        }
+
+        usleep(DEVICE_RETRY_DELAY_MS * 1000);
+    }
+
+    printf("Error, '%s' not opened: %s\n", path, strerror(errno));
+
+    return -1;
+}
+
+/*
+ * Opens a session with a simulated board. The board is driven by the
+ * game clock, see device_board_wait(). Returns 0 or -1 on error.
+ */
+int device_open_board(struct game_device *dev, struct board *board, struct game_clock *clock)
+{
+    dev->path = "board";
+    dev->fd = -1;
+    dev->ring = NULL;
+    dev->board = board;
+    dev->clock = clock;
+    dev->play_end_ns = 0;
+    dev->record = NULL;
+    dev->key_count = 0;
+
+    // The board ring has the driver layout, it is consumed like a mapped one
+    dev->ring = &board->ring;
+
+    board_advance(board, game_clock_now(clock));
+
+    if (board_map(board, DEVICE_BOARD_OWNER) < 0)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+void device_close(struct game_device *dev)
+{
+    if (dev->board)
+    {
+        board_release(dev->board, DEVICE_BOARD_OWNER);
+        dev->board = NULL;
+        dev->ring = NULL;
+        return;
+    }
+
+    if (dev->ring)
+    {
+        munmap(dev->ring, GPIO_RING_MMAP_LEN);
+        dev->ring = NULL;
+    }
+
+    if (dev->fd >= 0)
+    {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+}
+
+/*
+ * True while the session is open. After the device was lost the session
+ * is closed, every call fails with ESTALE until device_reconnect() opens
+ * a new one, which starts with nothing armed or mapped from the old one.
+ */
+int device_connected(const struct game_device *dev)
+{
+    return dev->board || dev->fd >= 0;
+}
+
+/*
+ * Closes the session with the device which went away. Returns -1 with
+ * errno set to ESTALE: what the session had in the driver (the mapped
+ * ring, the armed verification, the playback) is gone with it.
+ */
+static int device_drop(struct game_device *dev)
+{
+    device_close(dev);
+    errno = ESTALE;
+
+    return -1;
+}
+
+/*
+ * Tries once to open a new session after the device was lost, without
+ * waiting: the caller retries from its event loop. The recording and the
+ * typed keys go on in the new session. Returns 0 or -1 with errno set.
+ */
+int device_reconnect(struct game_device *dev)
+{
+    if (device_connected(dev))
+    {
+        return 0;
+    }
+
+    return device_connect(dev);
+}
+
+/*
+ * device_wait() on the simulated board: runs the board from deadline to
+ * deadline until the events are reported. With the virtual clock the
+ * time just jumps there, the real clock sleeps until then.
+ */
+static int device_board_wait(struct game_device *dev, short events, int timeout_ms)
+{
+    struct board *b = dev->board;
+    uint64_t now = game_clock_now(dev->clock);
+    uint64_t end = timeout_ms < 0 ? BOARD_NEVER : now + timeout_ms * 1000000ULL;
+    uint64_t t;
+    unsigned int revents;
+
+    board_advance(b, now);
+
+    for (;;)
+    {
+        revents = board_poll(b, DEVICE_BOARD_OWNER, events);
+        if (revents & POLLERR)
+        {
+            errno = EBUSY;
+            return -1;
+        }
+
+        if (revents & events)
+        {
+            return revents & events;
+        }
+
+        if (now >= end)
+        {
+            return 0;
+        }
+
+        t = board_next_deadline(b);
+        if (t > end)
+        {
+            t = end;
+        }
+
+        if (t == BOARD_NEVER)
+        {
+            // Nothing will ever happen on the board
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        game_clock_sleep_until(dev->clock, t);
+        now = game_clock_now(dev->clock);
+        board_advance(b, now);
+    }
+}
+
+/*
+ * Waits at most timeout_ms for the events on the device. Returns the
+ * reported events, 0 on timeout or -1 on error. A lost device closes the
+ * session, see device_connected().
+ */
+int device_wait(struct game_device *dev, short events, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = dev->fd, .events = events };
+    int ret;
+
+    if (dev->board)
+    {
+        return device_board_wait(dev, events, timeout_ms);
+    }
+
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    if (pfd.revents & (POLLHUP | POLLNVAL))
+    {
+        return device_drop(dev);
+    }
+
+    if (pfd.revents & POLLERR)
+    {
+        // Another session owns the driver event ring
+        errno = EBUSY;
+        return -1;
+    }
+
+    return pfd.revents;
+}
+
+/*
+ * Issues an ioctl on the driver or the simulated board. If the driver
+ * went away the session is closed, see device_connected(). Returns 0 or
+ * -1 on error.
+ */
+static int device_ioctl(struct game_device *dev, unsigned long cmd, void *arg)
+{
+    int ret;
+
+    if (dev->board)
+    {
+        ret = board_ioctl(dev->board, DEVICE_BOARD_OWNER, cmd, arg);
+        if (ret < 0)
+        {
+            errno = -ret;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (dev->fd < 0)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+
+    // The board records the commands itself, with the LED changes
+    if (dev->record)
+    {
+        trace_ioctl(dev->record, device_now(dev), cmd, arg);
+    }
+
+    if (ioctl(dev->fd, cmd, arg) < 0)
+    {
+        return device_lost(errno) ? device_drop(dev) : -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Uploads the LED pattern to the driver with a single ioctl, replacing
+ * the one being played. Returns 0 or -1 on error.
+ */
+int device_start_play(struct game_device *dev, const struct gpio_play_step *steps, size_t count)
+{
+    struct gpio_play play = { .count = count, .steps = (uintptr_t) steps };
+
+    return device_ioctl(dev, GPIO_IOC_PLAY, &play);
+}
+
+/*
+ * Time the driver needs to play the pattern, in ms.
+ */
+int device_play_time_ms(const struct gpio_play_step *steps, size_t count)
+{
+    int time_ms = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        time_ms += (steps[i].on_us + steps[i].off_us) / 1000;
+    }
+
+    return time_ms;
+}
+
+/*
+ * Uploads the LED pattern to the driver and waits until the driver
+ * finished playing it. Returns 0 or -1 on error.
+ */
+int device_play(struct game_device *dev, const struct gpio_play_step *steps, size_t count)
+{
+    int timeout_ms = device_play_time_ms(steps, count) + 1000;
+
+    if (device_start_play(dev, steps, count) < 0)
+    {
+        return -1;
+    }
+
+    // POLLPRI is reported once the driver is done with the pattern
+    if (device_wait(dev, POLLPRI, timeout_ms) <= 0)
+    {
+        return -1;
+    }
+
+    // Refined by the driver timestamp of GPIO_EV_PLAYBACK, if it is seen
+    dev->play_end_ns = device_now(dev);
+
+    return 0;
+}
+
+/*
+ * Reads the counters of the IRQ path: interrupts, time spent in the
+ * handler and ring overruns, see GPIO_IOC_GET_STATS. Returns 0 or -1 on error.
+ */
+int device_stats(struct game_device *dev, struct gpio_stats *stats)
+{
+    return device_ioctl(dev, GPIO_IOC_GET_STATS, stats);
+}
+
+/*
+ * Reads the overshoot of the pattern steps after their deadlines, see
+ * GPIO_IOC_GET_PLAY_STATS. Fails with ENOTTY on drivers older than ABI 5.
+ * Returns 0 or -1 on error.
+ */
+int device_play_stats(struct game_device *dev, struct gpio_play_stats *stats)
+{
+    return device_ioctl(dev, GPIO_IOC_GET_PLAY_STATS, stats);
+}
+
+/*
+ * Uploads the LED animation to the driver, replacing the pattern or
+ * animation being played. The driver ends it like a pattern, see
+ * GPIO_IOC_ANIMATE. Fails with ENOTTY on drivers older than ABI 4.
+ * Returns 0 or -1 on error.
+ */
+int device_start_animation(struct game_device *dev, const struct gpio_anim_frame *frames, size_t count)
+{
+    struct gpio_animation animation = { .count = count, .tick_us = 0, .frames = (uintptr_t) frames };
+
+    return device_ioctl(dev, GPIO_IOC_ANIMATE, &animation);
+}
+
+/*
+ * Time the driver needs to play the animation, in ms.
+ */
+int device_animation_time_ms(const struct gpio_anim_frame *frames, size_t count)
+{
+    int time_ms = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        time_ms += (frames[i].fade_us + frames[i].hold_us) / 1000;
+    }
+
+    return time_ms;
+}
+
+/*
+ * Uploads the presses the driver has to verify, see GPIO_IOC_EXPECT.
+ * The verdict shows up in dev->verdict once the presses are taken.
+ * Fails with ENOTTY on drivers older than ABI 3. Returns 0 or -1 on error.
+ */
+int device_expect(struct game_device *dev, const struct gpio_expect *expect)
+{
+    dev->verdict = 0;
+
+    return device_ioctl(dev, GPIO_IOC_EXPECT, (void *) expect);
+}
+
+/*
+ * Takes up to 'max' button presses from the mapped event ring and stores
+ * them as ASCII button numbers, with the driver timestamps in 'stamps'
+ * (may be NULL). Returns number of presses taken.
+ */
+static int ring_consume(struct game_device *dev, char *buf, uint64_t *stamps, size_t max)
+{
+    struct gpio_ring *ring = dev->ring;
+    struct gpio_event *ev;
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = ring->tail;
+    size_t n = 0;
+
+    while (tail != head && n < max)
+    {
+        ev = &ring->events[tail & (GPIO_RING_SIZE - 1)];
+
+        if (ev->flags & GPIO_EV_F_OVERRUN)
+        {
+            printf("Warning, button presses were lost (%u total)\n", ring->overruns);
+        }
+
+        if (ev->type == GPIO_EV_BUTTON)
+        {
+            if (stamps)
+            {
+                stamps[n] = ev->timestamp_ns;
+            }
+            buf[n++] = '0' + ev->value;
+            trace_add(dev->record, ev->timestamp_ns, TRACE_PRESS, ev->pin, 0, ev->value);
+        }
+        else if (ev->type == GPIO_EV_PLAYBACK)
+        {
+            dev->play_end_ns = ev->timestamp_ns;
+        }
+        else if (ev->type == GPIO_EV_VERDICT)
+        {
+            dev->verdict = ev->value;
+        }
+        tail++;
+    }
+
+    // Giving the slots back to the driver
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/*
+ * Queues a press of 'button' (1-4) typed on the keyboard, stamped now on
+ * the time base of the driver timestamps. device_take_presses() hands it
+ * out after the presses of the buttons. Returns 0 or -1 if the queue is full.
+ */
+int device_key_press(struct game_device *dev, int button)
+{
+    uint64_t now = device_now(dev);
+
+    if (dev->key_count >= DEVICE_KEYS)
+    {
+        return -1;
+    }
+
+    dev->keys[dev->key_count] = '0' + button;
+    dev->key_stamps[dev->key_count] = now;
+    dev->key_count++;
+    trace_add(dev->record, now, TRACE_PRESS, 0, 0, button);
+
+    return 0;
+}
+
+/* Takes up to 'max' queued keyboard presses. Returns number of presses taken. */
+static int keys_consume(struct game_device *dev, char *buf, uint64_t *stamps, size_t max)
+{
+    size_t n = dev->key_count < max ? dev->key_count : max;
+
+    memcpy(buf, dev->keys, n);
+    if (stamps)
+    {
+        memcpy(stamps, dev->key_stamps, n * sizeof(*stamps));
+    }
+
+    dev->key_count -= n;
+    memmove(dev->keys, dev->keys + n, dev->key_count);
+    memmove(dev->key_stamps, dev->key_stamps + n, dev->key_count * sizeof(dev->key_stamps[0]));
+
+    return n;
+}
+
+/*
+ * Takes the button presses available right now from the driver or the
+ * simulated board, without blocking. See device_take_presses().
+ */
+static int buttons_consume(struct game_device *dev, char *buf, uint64_t *stamps, size_t max)
+{
+    ssize_t ret;
+
+    if (dev->ring)
+    {
+        return ring_consume(dev, buf, stamps, max);
+    }
+
+    if (dev->fd < 0)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+
+    ret = read(dev->fd, buf, max);
+    if (ret > 0 && stamps)
+    {
+        // read() has no timestamps, the presses are as old as their arrival
+        uint64_t now = device_now(dev);
+
+        for (ssize_t i = 0; i < ret; i++)
+        {
+            stamps[i] = now;
+        }
+    }
+
+    for (ssize_t i = 0; i < ret; i++)
+    {
+        trace_add(dev->record, device_now(dev), TRACE_PRESS, 0, 0, buf[i] - '0');
+    }
+
+    if (ret < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return 0;
+        }
+
+        if (device_lost(errno))
+        {
+            return device_drop(dev);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Takes the presses available right now, without blocking: the buttons,
+ * then the keys typed on the keyboard. Press times go to 'stamps' (may be
+ * NULL): the driver timestamp from the event ring, the time of the read()
+ * when the ring is not mapped, or the time the key was read. The presses
+ * are recorded in dev->record. Returns number of presses stored in buf or -1 on error.
+ */
+int device_take_presses(struct game_device *dev, char *buf, uint64_t *stamps, size_t max)
+{
+    int n;
+
+    n = buttons_consume(dev, buf, stamps, max);
+    if (n < 0 || dev->key_count == 0)
+    {
+        return n;
+    }
+
+    return n + keys_consume(dev, buf + n, stamps ? stamps + n : NULL, max - n);
+}
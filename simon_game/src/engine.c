@@ -0,0 +1,773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "engine.h"
+#include "getch.h"
+
+// One flash: all LEDs on, then off
+static const struct gpio_play_step flesh_step = { (1 << LED_NUM) - 1, TIME_DELAY_US, TIME_DELAY_US };
+
+// The same flash as an animation: fade in, hold, fade out, stay dark
+static const struct gpio_anim_frame flesh_frames[2] =
+{
+    { { 255, 255, 255, 0 }, FADE_US, TIME_DELAY_US - FADE_US },
+    { { 0, 0, 0, 0 }, FADE_US, TIME_DELAY_US - FADE_US },
+};
+
+static void flesh_led(struct engine_session *s, int times, enum game_state state);
+static void playback_done(struct engine_session *s);
+
+/* Game message, dropped by a quiet session. */
+static void engine_printf(struct engine_session *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!s->config->out)
+    {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vfprintf(s->config->out, fmt, ap);
+    va_end(ap);
+}
+
+/* Error message, counted also when the session is quiet. */
+static void engine_error(struct engine_session *s, const char *what)
+{
+    s->errors++;
+    engine_printf(s, "Error, %s\n", what);
+}
+
+/* Default settings: one game until won, one second a step. */
+void engine_config_init(struct engine_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->out = stdout;
+
+    for (int i = 0; i < GAME_LENGTH; i++)
+    {
+        config->tempo_ms[i] = TIME_DELAY * 1000;
+    }
+}
+
+/*
+ * Parses the tempo curve: step times in ms for level 1, 2, ... separated
+ * by commas, the last one is kept for the higher levels. Returns 0 or -1
+ * on error.
+ */
+int engine_parse_tempo(struct engine_config *config, const char *arg)
+{
+    const char *p = arg;
+    char *end;
+    unsigned long ms = 0;
+    size_t level = 0;
+
+    while (level < GAME_LENGTH && *p)
+    {
+        ms = strtoul(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0') || ms < TEMPO_MIN_MS || ms > TEMPO_MAX_MS)
+        {
+            printf("Error, tempo '%s' not understood, steps of %d - %d ms\n", arg, TEMPO_MIN_MS, TEMPO_MAX_MS);
+            return -1;
+        }
+
+        config->tempo_ms[level++] = ms;
+        p = *end ? end + 1 : end;
+    }
+
+    while (level < GAME_LENGTH)
+    {
+        config->tempo_ms[level++] = ms;
+    }
+
+    return 0;
+}
+
+/*
+ * Prepares a session with its own random numbers drawn from 'seed'. The
+ * device and the loop are left to the caller, see struct engine_session.
+ */
+void engine_init(struct engine_session *s, const struct engine_config *config, uint64_t seed, int virtual)
+{
+    memset(s, 0, sizeof(*s));
+    s->config = config;
+    s->device.fd = -1;
+
+    rng_seed(&s->rng, seed);
+    game_clock_init(&s->clock, virtual);
+
+    histogram_init(&s->reaction_hist, "reaction");
+    histogram_init(&s->interval_hist, "interval");
+    histogram_init(&s->turn_hist, "turn");
+    histogram_init(&s->overshoot_hist, "overshoot");
+}
+
+void engine_print_timing(struct engine_session *s, FILE *out)
+{
+    fprintf(out, "\nPlayer timing\n");
+    histogram_print(&s->reaction_hist, out);
+    histogram_print(&s->interval_hist, out);
+    histogram_print(&s->turn_hist, out);
+
+    fprintf(out, "\nPlayback timing\n");
+    histogram_print(&s->overshoot_hist, out);
+    fflush(out);
+}
+
+/*
+ * Records how late the driver switched the LEDs of the sequence just
+ * played, after the absolute step deadlines.
+ */
+static void record_overshoot(struct engine_session *s)
+{
+    struct gpio_play_stats stats;
+
+    if (device_play_stats(&s->device, &stats) == 0 && stats.last_deadlines)
+    {
+        histogram_record(&s->overshoot_hist, stats.last_late_ns_max / 1000);
+    }
+}
+
+/*
+ * Records the timing of a turn. 'stamps' are the press times, 'start' is
+ * the end of the playback the player had to repeat.
+ */
+static void record_turn(struct engine_session *s, uint64_t start, const uint64_t *stamps, int presses)
+{
+    if (presses <= 0 || start == 0)
+    {
+        return;
+    }
+
+    histogram_record(&s->reaction_hist, stamps[0] > start ? (stamps[0] - start) / 1000 : 0);
+
+    for (int i = 1; i < presses; i++)
+    {
+        histogram_record(&s->interval_hist, stamps[i] > stamps[i - 1] ? (stamps[i] - stamps[i - 1]) / 1000 : 0);
+    }
+
+    histogram_record(&s->turn_hist, stamps[presses - 1] > start ? (stamps[presses - 1] - start) / 1000 : 0);
+}
+
+/*
+ * Counts a finished game. Returns 1 if another game has to be played.
+ */
+static int game_over(struct engine_session *s, int won)
+{
+    if (won)
+    {
+        s->games_won++;
+    }
+    else
+    {
+        s->games_lost++;
+    }
+
+    if (s->config->games_limit == 0)
+    {
+        return !won;
+    }
+
+    return s->games_won + s->games_lost < s->config->games_limit;
+}
+
+/*
+ * Waits in 'state' for the end of the pattern being played, which takes
+ * 'time_ms'. The guard timer gives up one second after that.
+ */
+static void await_playback(struct engine_session *s, int time_ms, enum game_state state)
+{
+    s->game.state = state;
+    loop_watch_device(&s->loop, POLLPRI);
+    loop_timer_set(&s->loop, TIMER_PLAYBACK, game_clock_now(&s->clock) + (time_ms + 1000) * 1000000ULL);
+}
+
+/*
+ * Starts playing a pattern and waits for its end in 'state'.
+ * Returns 0 or -1 on error.
+ */
+static int start_playback(struct engine_session *s, const struct gpio_play_step *steps, size_t count,
+                          enum game_state state)
+{
+    if (device_start_play(&s->device, steps, count) < 0)
+    {
+        return -1;
+    }
+
+    await_playback(s, device_play_time_ms(steps, count), state);
+
+    return 0;
+}
+
+/*
+ * Starts playing an animation and waits for its end in 'state'.
+ * Returns 0 or -1 on error.
+ */
+static int start_animation(struct engine_session *s, const struct gpio_anim_frame *frames, size_t count,
+                           enum game_state state)
+{
+    if (device_start_animation(&s->device, frames, count) < 0)
+    {
+        return -1;
+    }
+
+    await_playback(s, device_animation_time_ms(frames, count), state);
+
+    return 0;
+}
+
+/*
+ * Flashes all LEDs 'times' times, the game goes on in 'state' once
+ * the flashing is over. The driver fades the LEDs in and out, drivers
+ * without animations (before ABI 4) switch them on and off instead.
+ */
+static void flesh_led(struct engine_session *s, int times, enum game_state state)
+{
+    struct gpio_anim_frame frames[4 * GAME_MAX_FLASHES];
+    struct gpio_play_step steps[2 * GAME_MAX_FLASHES];
+    size_t count = 2 * times;
+
+    // All LED on/off, twice per flash
+    for (size_t i = 0; i < count; i++)
+    {
+        frames[2 * i] = flesh_frames[0];
+        frames[2 * i + 1] = flesh_frames[1];
+        steps[i] = flesh_step;
+    }
+
+    if (start_animation(s, frames, 2 * count, state) == 0)
+    {
+        return;
+    }
+
+    if (errno != ENOTTY || start_playback(s, steps, count, state) < 0)
+    {
+        engine_error(s, "LEDs not flashed");
+        s->game.state = state;
+        playback_done(s);
+    }
+}
+
+/* LED (1-LED_NUM) of a step of the sequence. */
+static int sequence_step(const struct simon *game, size_t i)
+{
+    return ((game->sequence >> (i * STEP_BITS)) & ((1 << STEP_BITS) - 1)) + 1;
+}
+
+/* Sequence as ASCII LED numbers. */
+static void sequence_text(const struct simon *game, char *buf)
+{
+    for (size_t i = 0; i < game->level; i++)
+    {
+        buf[i] = '0' + sequence_step(game, i);
+    }
+    buf[game->level] = '\0';
+}
+
+/* Plays the sequence of the current level, the turn follows. */
+static void play_sequence(struct engine_session *s)
+{
+    struct simon *game = &s->game;
+    struct gpio_play_step steps[GAME_LENGTH];
+    uint32_t step_us;
+
+    // LED on/off, played by the driver
+    step_us = s->config->tempo_ms[game->level - 1] * 1000;
+    for (size_t i = 0; i < game->level; i++)
+    {
+        steps[i].led_mask = 1 << (sequence_step(game, i) - 1);
+        steps[i].on_us = step_us;
+        steps[i].off_us = step_us;
+    }
+
+    if (start_playback(s, steps, game->level, STATE_SEQUENCE) < 0)
+    {
+        engine_error(s, "sequence not played");
+        game->state = STATE_ERROR;
+    }
+}
+
+/*
+ * Plays the sequence of the next level, which is the previous one with
+ * a new step at the end. A new game starts with level 0.
+ */
+static void start_round(struct engine_session *s)
+{
+    struct simon *game = &s->game;
+
+    if (game->level == 0)
+    {
+        game->sequence = 0;
+    }
+
+    // Game Sequence, one more step
+    game->sequence |= rng_below(&s->rng, LED_NUM) << (game->level * STEP_BITS);
+    game->level++;
+
+    play_sequence(s);
+}
+
+/*
+ * Hands the sequence to the driver, which checks every press and wakes
+ * the game up once with the verdict. A wrong press is flashed by the
+ * driver at once, like flesh_led(1). Returns 0 or -1 if the driver
+ * cannot verify (ABI older than 3).
+ */
+static int expect_sequence(struct engine_session *s)
+{
+    struct gpio_expect expect = { .count = s->game.level, .flags = GPIO_EXPECT_F_PLAY_WRONG };
+
+    expect.wrong.step = flesh_step;
+    expect.wrong.repeat = 2;
+
+    for (size_t i = 0; i < s->game.level; i++)
+    {
+        expect.buttons[i] = sequence_step(&s->game, i);
+    }
+
+    return device_expect(&s->device, &expect);
+}
+
+/* Waiting for player to repeat the sequence, at most WAIT_FOR_PLAYER s. */
+static void start_turn(struct engine_session *s)
+{
+    struct simon *game = &s->game;
+    uint64_t now = game_clock_now(&s->clock);
+
+    engine_printf(s, "Your move\n");
+
+    // The driver timestamp of the end of playback replaces it, if available
+    s->device.play_end_ns = now;
+
+    // Only the event ring carries the verdicts, read() checks in the game
+    game->checking = s->device.ring && expect_sequence(s) == 0;
+
+    // Presses made while the sequence played (or left from the last turn) do not
+    // count. Arming already dropped them, a press since then has its verdict.
+    if (!game->checking)
+    {
+        while (device_take_presses(&s->device, game->input, game->stamps, BUF_LEN - 1) > 0)
+        {
+        }
+    }
+
+    // Reset memory
+    memset(game->input, 0, BUF_LEN);
+    game->got = 0;
+
+    game->state = STATE_TURN;
+    loop_watch_device(&s->loop, POLLIN);
+    loop_timer_set(&s->loop, TIMER_PLAYER, now + WAIT_FOR_PLAYER * 1000000000ULL);
+}
+
+/*
+ * Ends the turn, 'correct' tells if the player repeated the whole
+ * sequence.
+ */
+static void end_turn(struct engine_session *s, int correct)
+{
+    struct simon *game = &s->game;
+    char sequence[GAME_LENGTH + 1];
+
+    loop_timer_cancel(&s->loop, TIMER_PLAYER);
+    loop_watch_device(&s->loop, 0);
+
+    record_turn(s, s->device.play_end_ns, game->stamps, game->got);
+
+    if (game->checking && s->device.verdict == 0)
+    {
+        // Out of time, the driver must not judge the next presses
+        struct gpio_expect none = { .count = 0 };
+
+        device_expect(&s->device, &none);
+    }
+
+    if (!correct)
+    {
+        sequence_text(game, sequence);
+
+        engine_printf(s, "\nBetter Luck Next Time :(\n");
+        engine_printf(s, "Game seq. : %s\n", sequence);
+        engine_printf(s, "Your input: %s\n", game->input);
+
+        // Decided, a lost device does not bring the turn back
+        game->next_game = game_over(s, 0);
+        game->level = 0;
+
+        if (game->checking && GPIO_VERDICT_KIND(s->device.verdict) == GPIO_VERDICT_WRONG)
+        {
+            // The driver is flashing since the wrong press
+            await_playback(s, 2 * device_play_time_ms(&flesh_step, 1), STATE_RESULT);
+        }
+        else
+        {
+            flesh_led(s, 1, STATE_RESULT);
+        }
+        return;
+    }
+
+    engine_printf(s, "\nNext level !!!\n\n");
+
+    if (game->level == GAME_LENGTH - 1)
+    {
+        engine_printf(s, "\nYOU WON\n");
+
+        game->next_game = game_over(s, 1);
+        game->level = 0;
+        flesh_led(s, 2, STATE_RESULT);
+        return;
+    }
+
+    start_round(s);
+}
+
+/*
+ * Checks every press against the next step as it arrives: a wrong press
+ * loses at once, the last correct one wins the turn at once. When the
+ * driver verifies the turn its verdict decides instead, until a key is
+ * typed: the driver does not see the keyboard.
+ */
+static void take_presses(struct engine_session *s)
+{
+    struct simon *game = &s->game;
+    char presses[BUF_LEN];
+    uint64_t stamps[BUF_LEN];
+    int ret;
+
+    if (game->checking && s->device.key_count)
+    {
+        // The presses so far were right, the game checks the rest of the turn
+        struct gpio_expect none = { .count = 0 };
+
+        device_expect(&s->device, &none);
+        game->checking = 0;
+    }
+
+    ret = device_take_presses(&s->device, presses, stamps, BUF_LEN - 1 - game->got);
+    if (ret < 0)
+    {
+        engine_error(s, "presses not taken");
+        game->state = STATE_ERROR;
+        return;
+    }
+
+    for (int i = 0; i < ret; i++)
+    {
+        game->input[game->got] = presses[i];
+        game->stamps[game->got] = stamps[i];
+        game->got++;
+
+        if (game->checking)
+        {
+            continue;
+        }
+
+        if (presses[i] != '0' + sequence_step(game, game->got - 1))
+        {
+            end_turn(s, 0);
+            return;
+        }
+
+        if ((size_t) game->got == game->level)
+        {
+            end_turn(s, 1);
+            return;
+        }
+    }
+
+    if (game->checking && s->device.verdict)
+    {
+        end_turn(s, GPIO_VERDICT_KIND(s->device.verdict) == GPIO_VERDICT_COMPLETE);
+    }
+}
+
+/* The driver finished playing, the game goes on. */
+static void playback_done(struct engine_session *s)
+{
+    struct simon *game = &s->game;
+
+    loop_timer_cancel(&s->loop, TIMER_PLAYBACK);
+    loop_watch_device(&s->loop, 0);
+
+    switch (game->state)
+    {
+    case STATE_INTRO:
+        game->level = 0;
+        start_round(s);
+        break;
+
+    case STATE_SEQUENCE:
+        s->failures = 0;
+        record_overshoot(s);
+        start_turn(s);
+        break;
+
+    case STATE_RESULT:
+        if (game->next_game)
+        {
+            game->level = 0;
+            start_round(s);
+        }
+        else
+        {
+            flesh_led(s, 1, STATE_OUTRO);
+        }
+        break;
+
+    case STATE_OUTRO:
+        game->state = STATE_DONE;
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * Keys typed on the terminal: '1' - '4' press the buttons, q quits at
+ * once. The presses join those of the board and are taken right away.
+ */
+static void read_keys(struct engine_session *s)
+{
+    char keys[16];
+    int pressed = 0;
+    int n;
+
+    n = keyboard_read(keys, sizeof(keys));
+    if (n <= 0)
+    {
+        // A raw terminal reads 0 when no key is there, its hangup comes as LOOP_STDIN_HUP
+        if (n == 0 && !isatty(STDIN_FILENO))
+        {
+            // stdin was closed, nobody can quit from there anymore
+            loop_unwatch_stdin(&s->loop);
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (keys[i] >= '1' && keys[i] <= '0' + BOARD_BUTTONS)
+        {
+            pressed |= device_key_press(&s->device, keys[i] - '0') == 0;
+        }
+        else if ((keys[i] == 'q' || keys[i] == 'Q') && s->game.state != STATE_OUTRO && s->game.state != STATE_DONE)
+        {
+            // Finish game, without the outro if the device is lost
+            loop_timer_cancel(&s->loop, TIMER_PLAYER);
+            loop_timer_cancel(&s->loop, TIMER_RETRY);
+            if (device_connected(&s->device))
+            {
+                flesh_led(s, 1, STATE_OUTRO);
+            }
+            else
+            {
+                s->game.state = STATE_DONE;
+            }
+        }
+    }
+
+    // Like the device reporting the presses, out of a turn they wait for start_turn() to drop them
+    if (pressed && s->game.state == STATE_TURN)
+    {
+        take_presses(s);
+    }
+}
+
+/*
+ * Starts the game over after an error, like after a lost game, once the
+ * backoff is over: ERROR_BACKOFF_MS, doubled for every error in a row.
+ * The session ends after ERROR_RETRIES errors in a row.
+ */
+static void retry_later(struct engine_session *s)
+{
+    s->failures++;
+
+    if (s->failures >= ERROR_RETRIES)
+    {
+        engine_printf(s, "Error, giving up after %d errors in a row\n", s->failures);
+        s->game.state = STATE_DONE;
+        return;
+    }
+
+    s->game.state = STATE_RETRY;
+    loop_watch_device(&s->loop, 0);
+    loop_timer_set(&s->loop, TIMER_RETRY,
+                   game_clock_now(&s->clock) + ((uint64_t) ERROR_BACKOFF_MS << (s->failures - 1)) * 1000000ULL);
+}
+
+/*
+ * The device went away: its session is closed and reopened from the loop,
+ * one try every DEVICE_RETRY_DELAY_MS, so 'q', the signals and the keys
+ * are still served meanwhile. Nothing armed in the old session (the
+ * verification of the turn, the playback) carries over to the new one.
+ */
+static void lose_device(struct engine_session *s)
+{
+    device_close(&s->device);
+    loop_device_changed(&s->loop);
+
+    loop_timer_cancel(&s->loop, TIMER_PLAYBACK);
+    loop_timer_cancel(&s->loop, TIMER_PLAYER);
+    s->game.checking = 0;
+
+    engine_printf(s, "Reconnecting to '%s'\n", s->device.path);
+
+    s->reconnects = 0;
+    s->game.state = STATE_RECONNECT;
+    loop_timer_set(&s->loop, TIMER_RETRY, game_clock_now(&s->clock) + DEVICE_RETRY_DELAY_MS * 1000000ULL);
+}
+
+/*
+ * One try to reopen the lost device. On the new session the turn of the
+ * current level starts again with its sequence, or the next game if none
+ * was under way. The session ends after DEVICE_RETRIES failed tries.
+ */
+static void reconnect(struct engine_session *s)
+{
+    if (device_reconnect(&s->device) == 0)
+    {
+        if (loop_device_changed(&s->loop) == 0)
+        {
+            engine_printf(s, "Reconnected to '%s'\n", s->device.path);
+            if (s->game.level)
+            {
+                play_sequence(s);
+            }
+            else
+            {
+                start_round(s);
+            }
+            return;
+        }
+
+        device_close(&s->device);
+    }
+
+    if (++s->reconnects >= DEVICE_RETRIES)
+    {
+        engine_printf(s, "Error, '%s' not reopened: %s\n", s->device.path, strerror(errno));
+        s->game.state = STATE_DONE;
+        return;
+    }
+
+    loop_timer_set(&s->loop, TIMER_RETRY, game_clock_now(&s->clock) + DEVICE_RETRY_DELAY_MS * 1000000ULL);
+}
+
+/*
+ * Runs the game as a state machine until it is over, every event of the
+ * loop moves it on.
+ */
+void engine_run(struct engine_session *s)
+{
+    struct simon *game = &s->game;
+    volatile sig_atomic_t *dump = s->config->dump_requested;
+    int events;
+
+    // Fleshing LED for Start
+    flesh_led(s, 1, STATE_INTRO);
+
+    while (game->state != STATE_DONE)
+    {
+        if (game->state == STATE_ERROR)
+        {
+            if (device_connected(&s->device))
+            {
+                retry_later(s);
+            }
+            else
+            {
+                lose_device(s);
+            }
+            continue;
+        }
+
+        events = loop_wait(&s->loop);
+        if (events < 0)
+        {
+            engine_error(s, strerror(errno));
+            break;
+        }
+
+        if (dump && *dump)
+        {
+            *dump = 0;
+            engine_print_timing(s, stdout);
+        }
+
+        if (events & LOOP_STDIN)
+        {
+            read_keys(s);
+        }
+
+        if (events & LOOP_STDIN_HUP)
+        {
+            loop_unwatch_stdin(&s->loop);
+        }
+
+        if (events & LOOP_DEVICE_HUP)
+        {
+            engine_error(s, "device lost");
+            device_close(&s->device);
+
+            // Quitting (or the last game over) does not wait for the device, the outro is not flashed
+            game->state = game->state == STATE_OUTRO || game->state == STATE_DONE
+                          || (game->state == STATE_RESULT && !game->next_game) ? STATE_DONE : STATE_ERROR;
+            continue;
+        }
+
+        if (events & LOOP_DEVICE_PRI)
+        {
+            playback_done(s);
+        }
+        else if (events & LOOP_TIMER(TIMER_PLAYBACK))
+        {
+            if (game->state == STATE_SEQUENCE)
+            {
+                engine_error(s, "sequence not played");
+                game->state = STATE_ERROR;
+            }
+            else
+            {
+                engine_error(s, "LEDs not flashed");
+                playback_done(s);
+            }
+        }
+
+        if ((events & LOOP_DEVICE_IN) && game->state == STATE_TURN)
+        {
+            take_presses(s);
+        }
+
+        if ((events & LOOP_TIMER(TIMER_RETRY)) && game->state == STATE_RETRY)
+        {
+            loop_timer_cancel(&s->loop, TIMER_RETRY);
+            game->level = 0;
+            start_round(s);
+        }
+        else if ((events & LOOP_TIMER(TIMER_RETRY)) && game->state == STATE_RECONNECT)
+        {
+            reconnect(s);
+        }
+
+        if ((events & LOOP_TIMER(TIMER_PLAYER)) && game->state == STATE_TURN)
+        {
+            // Out of time, but the driver may hold presses back for their verdict
+            if (game->checking)
+            {
+                take_presses(s);
+            }
+
+            if (game->state == STATE_TURN)
+            {
+                end_turn(s, 0);
+            }
+        }
+    }
+}
@@ -1,42 +1,135 @@
 #include <termios.h>
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
 
-static struct termios old, new;
+#include "getch.h"
 
-/* Initialize new terminal i/o settings */
-void initTermios(int echo) 
+static struct termios saved;
+static struct termios raw;
+static volatile sig_atomic_t raw_mode;
+
+// Signals ending the process, the terminal is restored before
+static const int keyboard_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+static struct sigaction stop_action;
+
+/* Restores the terminal settings saved by keyboard_init(), async-signal-safe. */
+void keyboard_restore(void)
+{
+    if (raw_mode)
+    {
+        raw_mode = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+}
+
+/* Restores the terminal, then dies of the signal as it would have. */
+static void keyboard_on_signal(int sig)
 {
-    tcgetattr(0, &old); /* grab old terminal i/o settings */
-    new = old; /* make new settings same as old settings */
-    new.c_lflag &= ~ICANON; /* disable buffered i/o */
-    new.c_lflag &= echo ? ECHO : ~ECHO; /* set echo mode */
-    tcsetattr(0, TCSANOW, &new); /* use these new terminal i/o settings now */
+    keyboard_restore();
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-/* Restore old terminal i/o settings */
-void resetTermios(void) 
+/* Ctrl-Z: gives the shell its terminal back, then stops as it would have. */
+static void keyboard_on_stop(int sig)
 {
-    tcsetattr(0, TCSANOW, &old);
+    if (raw_mode)
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+
+    // Stops once the handler returns, keyboard_on_continue() installs it again
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-/* Read 1 character - echo defines echo mode */
-char getch_(int echo) 
+/* Back from a stop: raw again, unless continued in the background. */
+static void keyboard_on_continue(int sig)
 {
-    char ch;
-    initTermios(echo);
-    ch = getchar();
-    resetTermios();
-    return ch;
+    sigaction(SIGTSTP, &stop_action, NULL);
+
+    if (raw_mode && tcgetpgrp(STDIN_FILENO) == getpgrp())
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
 }
 
-/* Read 1 character without echo */
-char getch(void) 
+/*
+ * Puts the terminal on stdin in raw mode for the rest of the process:
+ * every key is read at once, without echo. read() returns what was typed
+ * and never blocks (VMIN and VTIME 0), O_NONBLOCK is left alone because
+ * stdout shares the open terminal. Ctrl-C still sends SIGINT. The settings
+ * are restored at exit, on the signals ending the process and while the
+ * process is stopped by Ctrl-Z.
+ * Returns 0 or -1 if stdin is no terminal.
+ */
+int keyboard_init(void)
 {
-    return getch_(0);
+    static int installed;
+    struct sigaction sa;
+    struct sigaction old;
+
+    if (raw_mode)
+    {
+        return 0;
+    }
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0)
+    {
+        return -1;
+    }
+
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0)
+    {
+        return -1;
+    }
+    raw_mode = 1;
+
+    if (!installed)
+    {
+        installed = 1;
+        atexit(keyboard_restore);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = keyboard_on_signal;
+        sigemptyset(&sa.sa_mask);
+
+        for (size_t i = 0; i < sizeof(keyboard_signals) / sizeof(keyboard_signals[0]); i++)
+        {
+            // Signals ignored by the parent stay ignored
+            if (sigaction(keyboard_signals[i], NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+            {
+                sigaction(keyboard_signals[i], &sa, NULL);
+            }
+        }
+
+        // Without job control (SIGTSTP ignored) there is no stop to handle
+        memset(&stop_action, 0, sizeof(stop_action));
+        stop_action.sa_handler = keyboard_on_stop;
+        sigemptyset(&stop_action.sa_mask);
+        if (sigaction(SIGTSTP, NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+        {
+            sigaction(SIGTSTP, &stop_action, NULL);
+
+            sa.sa_handler = keyboard_on_continue;
+            sigaction(SIGCONT, &sa, NULL);
+        }
+    }
+
+    return 0;
 }
 
-/* Read 1 character with echo */
-char getche(void) 
+/*
+ * Reads the keys typed so far, at most 'max'. Returns their number, 0 if
+ * none or -1 on error.
+ */
+int keyboard_read(char *keys, size_t max)
 {
-    return getch_(1);
+    return read(STDIN_FILENO, keys, max);
 }
\ No newline at end of file
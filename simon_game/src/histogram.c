@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "histogram.h"
+
+void histogram_init(struct histogram *h, const char *name)
+{
+    memset(h, 0, sizeof(*h));
+    h->name = name;
+    h->min = UINT64_MAX;
+}
+
+/* Bucket of a value, see histogram.h. */
+static unsigned int histogram_index(uint64_t v)
+{
+    unsigned int shift;
+
+    if (v < HIST_SUB_BUCKETS)
+    {
+        return v;
+    }
+
+    if (v >= 1ULL << HIST_MAX_BITS)
+    {
+        return HIST_BUCKETS - 1;
+    }
+
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+    return (shift + 1) * HIST_SUB_BUCKETS + ((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Smallest value stored in a bucket. */
+static uint64_t histogram_lower(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < HIST_SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    shift = index / HIST_SUB_BUCKETS - 1;
+
+    return (uint64_t) (HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift;
+}
+
+void histogram_record(struct histogram *h, uint64_t value_us)
+{
+    h->buckets[histogram_index(value_us)]++;
+    h->count++;
+    h->sum += value_us;
+
+    if (value_us < h->min)
+    {
+        h->min = value_us;
+    }
+    if (value_us > h->max)
+    {
+        h->max = value_us;
+    }
+}
+
+/* Adds the values recorded in 'src' to 'dst'. */
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+    {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->min < dst->min)
+    {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+}
+
+/*
+ * Value below which the fraction 'p' of the recorded values lies, as the
+ * upper end of its bucket. Returns 0 for an empty histogram.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+    uint64_t rank = p * h->count + 0.5;
+    uint64_t seen = 0;
+
+    if (h->count == 0)
+    {
+        return 0;
+    }
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            // The largest value is known exactly
+            return i + 1 < HIST_BUCKETS && histogram_lower(i + 1) - 1 < h->max
+                 ? histogram_lower(i + 1) - 1 : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/* Prints the summary line and the non empty buckets. */
+void histogram_print(const struct histogram *h, FILE *out)
+{
+    if (h->count == 0)
+    {
+        fprintf(out, "%s: no samples\n", h->name);
+        return;
+    }
+
+    fprintf(out, "%s: n=%llu min=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu (us)\n",
+            h->name,
+            (unsigned long long) h->count,
+            (unsigned long long) h->min,
+            (unsigned long long) (h->sum / h->count),
+            (unsigned long long) histogram_percentile(h, 0.50),
+            (unsigned long long) histogram_percentile(h, 0.90),
+            (unsigned long long) histogram_percentile(h, 0.99),
+            (unsigned long long) h->max);
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+    {
+        if (h->buckets[i])
+        {
+            fprintf(out, "  %10llu .. %-10llu %u\n",
+                    (unsigned long long) histogram_lower(i),
+                    (unsigned long long) (i + 1 < HIST_BUCKETS ? histogram_lower(i + 1) - 1 : h->max),
+                    h->buckets[i]);
+        }
+    }
+}
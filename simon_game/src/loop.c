@@ -0,0 +1,349 @@
+#define _GNU_SOURCE // ppoll()
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "loop.h"
+
+// epoll tags of the watched fds
+#define TAG_DEVICE 0
+#define TAG_STDIN 1
+#define TAG_TIMER 2
+
+static int loop_add(struct game_loop *loop, int fd, uint32_t events, uint32_t tag)
+{
+    struct epoll_event ev = { .events = events, .data.u32 = tag };
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static uint32_t loop_device_events(short events)
+{
+    return (events & POLLIN ? EPOLLIN : 0) | (events & POLLPRI ? EPOLLPRI : 0);
+}
+
+/*
+ * Sets up the loop for the device session. Returns 0 or -1 on error.
+ */
+int loop_init(struct game_loop *loop, struct game_device *dev, struct game_clock *clock, int watch_stdin)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->dev = dev;
+    loop->clock = clock;
+    loop->epfd = -1;
+    loop->dev_fd = -1;
+    loop->stdin_fd = watch_stdin ? STDIN_FILENO : -1;
+
+    for (int i = 0; i < LOOP_TIMERS; i++)
+    {
+        loop->timer_fd[i] = -1;
+        loop->deadline[i] = LOOP_NEVER;
+    }
+
+    if (dev->board)
+    {
+        return 0;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+    {
+        return -1;
+    }
+
+    // The device is registered without events until the game asks for them
+    loop->dev_fd = dev->fd;
+    if (loop_add(loop, loop->dev_fd, 0, TAG_DEVICE) < 0)
+    {
+        goto fail;
+    }
+
+    if (loop->stdin_fd >= 0 && loop_add(loop, loop->stdin_fd, EPOLLIN, TAG_STDIN) < 0)
+    {
+        // stdin is no terminal, pipe or socket (e.g. /dev/null)
+        loop->stdin_fd = -1;
+    }
+
+    for (int i = 0; i < LOOP_TIMERS; i++)
+    {
+        loop->timer_fd[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loop->timer_fd[i] < 0 || loop_add(loop, loop->timer_fd[i], EPOLLIN, TAG_TIMER + i) < 0)
+        {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    loop_close(loop);
+    return -1;
+}
+
+void loop_close(struct game_loop *loop)
+{
+    for (int i = 0; i < LOOP_TIMERS; i++)
+    {
+        if (loop->timer_fd[i] >= 0)
+        {
+            close(loop->timer_fd[i]);
+            loop->timer_fd[i] = -1;
+        }
+    }
+
+    if (loop->epfd >= 0)
+    {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
+
+/*
+ * Selects the device events the game waits for: POLLIN for presses,
+ * POLLPRI for the end of playback. Returns 0 or -1 on error.
+ */
+int loop_watch_device(struct game_loop *loop, short events)
+{
+    struct epoll_event ev = { .events = loop_device_events(events), .data.u32 = TAG_DEVICE };
+
+    loop->dev_events = events;
+
+    if (loop->epfd < 0 || loop->dev_fd < 0)
+    {
+        return 0;
+    }
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->dev_fd, &ev);
+}
+
+void loop_unwatch_stdin(struct game_loop *loop)
+{
+    if (loop->stdin_fd >= 0 && loop->epfd >= 0)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->stdin_fd, NULL);
+    }
+
+    loop->stdin_fd = -1;
+}
+
+/*
+ * Arms a deadline, in game clock time. Returns 0 or -1 on error.
+ */
+int loop_timer_set(struct game_loop *loop, enum loop_timer id, uint64_t deadline_ns)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    loop->deadline[id] = deadline_ns;
+
+    if (loop->timer_fd[id] < 0)
+    {
+        return 0;
+    }
+
+    // Zero would disarm the timer
+    its.it_value.tv_sec = deadline_ns / 1000000000ULL;
+    its.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+
+    return timerfd_settime(loop->timer_fd[id], TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void loop_timer_cancel(struct game_loop *loop, enum loop_timer id)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    loop->deadline[id] = LOOP_NEVER;
+
+    if (loop->timer_fd[id] >= 0)
+    {
+        timerfd_settime(loop->timer_fd[id], 0, &its, NULL);
+    }
+}
+
+/*
+ * The device session was closed or reopened: the old fd is dropped from
+ * the loop and the new one, if any, is watched for the same events.
+ * Returns 0 or -1 on error.
+ */
+int loop_device_changed(struct game_loop *loop)
+{
+    if (loop->epfd < 0)
+    {
+        return 0;
+    }
+
+    // Already gone from epoll if the fd was closed
+    if (loop->dev_fd >= 0)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->dev_fd, NULL);
+    }
+
+    loop->dev_fd = loop->dev->fd;
+    if (loop->dev_fd >= 0
+        && loop_add(loop, loop->dev_fd, loop_device_events(loop->dev_events), TAG_DEVICE) < 0)
+    {
+        loop->dev_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int loop_wait_epoll(struct game_loop *loop)
+{
+    struct epoll_event evs[LOOP_TIMERS + 2];
+    uint64_t expirations;
+    uint32_t tag;
+    int events = 0;
+    int n;
+
+    n = epoll_wait(loop->epfd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+    if (n < 0)
+    {
+        // A signal, the game checks its flags
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        tag = evs[i].data.u32;
+
+        if (tag == TAG_DEVICE)
+        {
+            // Reopening takes time, the game does it from its own state
+            if (evs[i].events & EPOLLHUP)
+            {
+                events |= LOOP_DEVICE_HUP;
+                continue;
+            }
+
+            if (evs[i].events & EPOLLERR)
+            {
+                // Another session owns the driver event ring
+                errno = EBUSY;
+                return -1;
+            }
+
+            events |= (evs[i].events & EPOLLIN ? LOOP_DEVICE_IN : 0)
+                    | (evs[i].events & EPOLLPRI ? LOOP_DEVICE_PRI : 0);
+        }
+        else if (tag == TAG_STDIN)
+        {
+            events |= LOOP_STDIN | (evs[i].events & (EPOLLHUP | EPOLLERR) ? LOOP_STDIN_HUP : 0);
+        }
+        else
+        {
+            tag -= TAG_TIMER;
+
+            // A timer re-armed meanwhile has nothing to read
+            if (read(loop->timer_fd[tag], &expirations, sizeof(expirations)) > 0
+                && loop->deadline[tag] != LOOP_NEVER)
+            {
+                loop->deadline[tag] = LOOP_NEVER;
+                events |= LOOP_TIMER(tag);
+            }
+        }
+    }
+
+    return events;
+}
+
+static int loop_wait_board(struct game_loop *loop)
+{
+    struct pollfd pfd = { .fd = loop->stdin_fd, .events = POLLIN };
+    struct timespec timeout;
+    uint64_t now, next;
+    int events;
+    int ret;
+
+    for (;;)
+    {
+        ret = device_wait(loop->dev, loop->dev_events, 0);
+        if (ret < 0)
+        {
+            return -1;
+        }
+
+        events = (ret & POLLIN ? LOOP_DEVICE_IN : 0) | (ret & POLLPRI ? LOOP_DEVICE_PRI : 0);
+
+        now = game_clock_now(loop->clock);
+        next = board_next_deadline(loop->dev->board);
+
+        for (int i = 0; i < LOOP_TIMERS; i++)
+        {
+            if (loop->deadline[i] <= now)
+            {
+                loop->deadline[i] = LOOP_NEVER;
+                events |= LOOP_TIMER(i);
+            }
+            else if (loop->deadline[i] < next)
+            {
+                next = loop->deadline[i];
+            }
+        }
+
+        if (events)
+        {
+            return events;
+        }
+
+        if (loop->clock->virtual)
+        {
+            if (next == LOOP_NEVER)
+            {
+                // Nothing will ever happen
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            game_clock_advance(loop->clock, next);
+            continue;
+        }
+
+        // Real time on the simulated board, without stdin to the absolute deadline
+        if (loop->stdin_fd < 0 && next != LOOP_NEVER)
+        {
+            if (game_clock_sleep_until(loop->clock, next) < 0)
+            {
+                return errno == EINTR ? 0 : -1;
+            }
+            continue;
+        }
+
+        // Only stdin can come in between, the ns timeout avoids rounding up to ms
+        timeout.tv_sec = (next - now) / 1000000000ULL;
+        timeout.tv_nsec = (next - now) % 1000000000ULL;
+        ret = ppoll(&pfd, loop->stdin_fd >= 0, next == LOOP_NEVER ? NULL : &timeout, NULL);
+        if (ret < 0)
+        {
+            return errno == EINTR ? 0 : -1;
+        }
+
+        if (ret > 0)
+        {
+            return LOOP_STDIN | (pfd.revents & (POLLHUP | POLLERR | POLLNVAL) ? LOOP_STDIN_HUP : 0);
+        }
+    }
+}
+
+/*
+ * Waits for the next events of the game. Returns LOOP_* flags, 0 if a
+ * signal interrupted the wait or -1 on error.
+ */
+int loop_wait(struct game_loop *loop)
+{
+    if (loop->epfd < 0)
+    {
+        return loop_wait_board(loop);
+    }
+
+    return loop_wait_epoll(loop);
+}
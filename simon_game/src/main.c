@@ -1,216 +1,411 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <pthread.h>
-#include <semaphore.h>
+#include <errno.h>
 #include <time.h>
+#include <signal.h>
+
+#include "device.h"
+#include "clock.h"
+#include "histogram.h"
+#include "loop.h"
+#include "engine.h"
+#include "runner.h"
+#include "getch.h"
+
+// Solver bot timing, see board_load_script()
+#define BOT_REACTION_MS 300
+#define BOT_PERIOD_MS 200
+
+
+/*
+ * Players of the simulated boards, shared by every session: the script
+ * loaded once, the bot and the recording to replay are only read.
+ */
+struct board_setup
+{
+    struct board script;    // Template, only its actions are used
+    int bot_error;          // Error pct of the solver bot, -1 without the bot
+    const struct trace *replay;
+    double speed;
+    struct trace_writer *record;
+};
+
+volatile sig_atomic_t dump_requested;
+
+void on_sigusr1(int sig)
+{
+    dump_requested = 1;
+}
 
-#define LED_NUM 3
-#define BUF_LEN 80
+/*
+ * Hands the players of 'arg' (struct board_setup) to a new simulated
+ * board. Returns 0 or -1 on error.
+ */
+int setup_board(struct board *b, void *arg)
+{
+    struct board_setup *setup = arg;
 
-#define GAME_LENGTH 12
-#define TIME_DELAY 1 // Time Delay in Seconds
-#define WAIT_FOR_PLAYER 10
+    for (size_t i = 0; i < setup->script.script_len; i++)
+    {
+        if (board_add_action(b, &setup->script.script[i]) < 0)
+        {
+            return -1;
+        }
+    }
 
-char getch(void);
-void flesh_led();
+    if (setup->bot_error >= 0)
+    {
+        struct board_action bot = { .type = ACTION_AUTO, .count = 1 };
 
-char led_on[LED_NUM][BUF_LEN]  = {"LED1 1", "LED2 1", "LED3 1"};
-char led_off[LED_NUM][BUF_LEN] = {"LED1 0", "LED2 0", "LED3 0"};
+        bot.hold_ns = BOT_REACTION_MS * 1000000ULL;
+        bot.gap_ns = BOT_PERIOD_MS * 1000000ULL;
+        bot.error_pct = setup->bot_error;
+        if (board_add_action(b, &bot) < 0)
+        {
+            return -1;
+        }
+    }
 
+    if (setup->replay && board_replay(b, setup->replay, setup->speed) < 0)
+    {
+        return -1;
+    }
 
-int file_desc;
-int ret_val;
-char tmp[BUF_LEN];
-char finish;
+    b->record = setup->record;
 
-void _simon_game_(void)
+    return 0;
+}
+
+/*
+ * Plays 'sessions' sessions at once on simulated boards in virtual time,
+ * quietly, and prints their summed up outcome. Returns the exit code.
+ */
+int run_sessions(const struct engine_config *config, struct board_setup *setup, size_t sessions,
+                 unsigned int threads, uint64_t seed)
 {
-    char game_sequence[GAME_LENGTH];
+    struct runner_config run = { .engine = config, .threads = threads, .sessions = sessions, .seed = seed };
+    struct runner_result result;
+    struct timespec wall_start, wall_end;
+    double wall;
+
+    run.setup_board = setup_board;
+    run.arg = setup;
 
-    for (size_t game = 1; game < GAME_LENGTH && !finish; game++)
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    if (runner_run(&run, &result) < 0)
     {
-        // Reset memory
-        memset(game_sequence, 0, GAME_LENGTH);
+        printf("Error, sessions not started: %s\n", strerror(errno));
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
 
-        // Game Sequence
-        for (size_t gs = 0; gs < game; gs++)
-        {
-            game_sequence[gs] = rand() % LED_NUM + 1;
-        }
-        
-        // Openning the driver
-        file_desc = open("/dev/gpio_driver", O_RDWR);
+    printf("\nPlayer timing\n");
+    histogram_print(&result.reaction_hist, stdout);
+    histogram_print(&result.interval_hist, stdout);
+    histogram_print(&result.turn_hist, stdout);
 
-        if(file_desc < 0)
-        {
-            printf("Error, 'gpio_driver' not opened\n");
-            continue;
-        }
+    printf("Sessions: %zu on %u threads, %lu stolen\n", result.sessions, threads, (unsigned long) result.steals);
+    printf("Games: %ld won, %ld lost, %ld errors, game time %.1f s, wall time %.3f s, %.0f games/s\n",
+           result.games_won, result.games_lost, result.errors, result.game_ns / 1e9, wall,
+           wall > 0 ? (result.games_won + result.games_lost) / wall : 0);
+
+    return result.sessions == sessions ? 0 : 1;
+}
 
-        // LED on/off
-        for (size_t i = 0; i < game; i++)
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-d device] [-t] [-s trace] [-b error_pct] [-p recording [-x speed]] [-w recording]\n"
+           "       [-T tempo] [-g games] [-r seed] [-n sessions [-j threads]]\n", prog);
+    printf("  -d device     device node (default %s)\n", GPIO_DRIVER_DEVICE);
+    printf("  -s trace      simulated board pressing the buttons from a trace file\n");
+    printf("  -b error_pct  simulated board with a solver bot, wrong on error_pct%% of presses\n");
+    printf("  -p recording  simulated board replaying the presses of a recording (-w)\n");
+    printf("  -x speed      replay speed, 2 replays twice as fast (default 1)\n");
+    printf("  -w recording  records the presses and LED commands to a binary file\n");
+    printf("  -t            virtual time, the simulated board runs as fast as possible\n");
+    printf("  -T tempo      ms a sequence step is lit and dark, per level: 1000,800,500 speeds up\n");
+    printf("                at level 2 and 3 (default %d, %d - %d)\n", TIME_DELAY * 1000, TEMPO_MIN_MS, TEMPO_MAX_MS);
+    printf("  -g games      games to play (default: until won, 1 in virtual time)\n");
+    printf("  -r seed       random seed (default the seed of the replayed recording)\n");
+    printf("  -n sessions   sessions played at once on simulated boards, in virtual time\n");
+    printf("  -j threads    threads playing the sessions (default one per core)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct engine_config config;
+    struct engine_session session;
+    struct board_setup setup = { .bot_error = -1, .speed = 1 };
+    struct board board;
+    const char *path = GPIO_DRIVER_DEVICE;
+    const char *trace = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    struct trace_writer recorder = {0};
+    struct trace replay = {0};
+    size_t sessions = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int virtual = 0;
+    int simulated;
+    int seeded = 0;
+    unsigned int seed = (unsigned) time(NULL);
+    struct timespec wall_start, wall_end;
+    uint64_t game_start;
+    struct sigaction sa;
+    struct gpio_play_stats play_stats;
+    struct gpio_stats stats;
+    int ret = 1;
+    int opt;
+
+    engine_config_init(&config);
+    config.dump_requested = &dump_requested;
+    board_init(&setup.script, 0);
+
+    while ((opt = getopt(argc, argv, "d:s:b:p:x:w:tT:g:r:n:j:h")) != -1)
+    {
+        switch (opt)
         {
-            int gs = game_sequence[i] - 1;
-            strcpy(tmp, led_on[gs]);
-           
-            // write to drivere
-            ret_val = write(file_desc, tmp, BUF_LEN);
-            sleep(TIME_DELAY);
-
-            strcpy(tmp, led_off[gs]);
-            ret_val = write(file_desc, tmp, BUF_LEN);
-            sleep(TIME_DELAY);
+        case 'd':
+            path = optarg;
+            break;
+        case 's':
+            trace = optarg;
+            break;
+        case 'b':
+            setup.bot_error = atoi(optarg);
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'x':
+            setup.speed = atof(optarg);
+            break;
+        case 'w':
+            record_path = optarg;
+            break;
+        case 't':
+            virtual = 1;
+            config.games_limit = config.games_limit ? config.games_limit : 1;
+            break;
+        case 'T':
+            if (engine_parse_tempo(&config, optarg) < 0)
+            {
+                return 1;
+            }
+            break;
+        case 'g':
+            config.games_limit = atol(optarg);
+            break;
+        case 'r':
+            seed = strtoul(optarg, NULL, 0);
+            seeded = 1;
+            break;
+        case 'n':
+            sessions = strtoul(optarg, NULL, 0);
+            virtual = 1;
+            config.games_limit = config.games_limit ? config.games_limit : 1;
+            break;
+        case 'j':
+            threads = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
         }
+    }
 
-        // Closing driver
-        close(file_desc);
+    simulated = trace || setup.bot_error >= 0 || replay_path;
 
-         // Waiting for player to repeat the sequence
-        printf("Your move\n");
-        sleep(WAIT_FOR_PLAYER);
+    if (virtual && !simulated)
+    {
+        printf("Error, virtual time needs a trace (-s), the bot (-b) or a recording (-p)\n");
+        return 1;
+    }
 
-        // Openning the driver
-        file_desc = open("/dev/gpio_driver", O_RDWR);
+    if (setup.speed <= 0)
+    {
+        printf("Error, the replay speed must be above 0, -t replays as fast as possible\n");
+        return 1;
+    }
 
-        if(file_desc < 0)
-        {
-            printf("Error, 'gpio_driver' not opened\n");
-            continue;
-        }
+    if (sessions && record_path)
+    {
+        printf("Error, the sessions (-n) cannot be recorded to one file\n");
+        return 1;
+    }
 
-        // Reset memory
-        memset(tmp, 0, BUF_LEN);
+    if (threads < 1)
+    {
+        threads = 1;
+    }
 
-        // Closing driver
-        ret_val = read(file_desc, tmp, BUF_LEN);
-        close(file_desc);
+    if (trace && board_load_script(&setup.script, trace) < 0)
+    {
+        return 1;
+    }
 
-        if(ret_val < 0)
+    if (replay_path)
+    {
+        if (trace_load(&replay, replay_path) < 0)
         {
-            printf("Error\n");
-            game = 0;
-            continue;
+            goto out;
         }
+        setup.replay = &replay;
 
-        // Converting number to ascii val.
-        for (size_t i = 0; i < strlen(game_sequence); i++)
+        // The same sequences are drawn as in the recorded games
+        if (!seeded)
         {
-            game_sequence[i] += '0';            
+            seed = replay.header.seed;
         }
+    }
+
+    if (sessions)
+    {
+        config.out = NULL;
+        ret = run_sessions(&config, &setup, sessions, threads, seed);
+        goto out;
+    }
+
+    // Seeding the random number gen.
+    engine_init(&session, &config, seed, virtual);
+
+    game_start = game_clock_now(&session.clock);
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    // SIGUSR1 dumps the histograms, interrupting the wait of the loop
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    printf("##############################\n");
+    printf("\tSimon Game\n");
+    printf("##############################\n");
 
-        // Comparing user input and game seq.
-        if (strcmp(tmp, game_sequence) != 0)
+    // Recording from the start, on the time base of the driver timestamps
+    if (record_path)
+    {
+        if (trace_create(&recorder, record_path, game_clock_now(&session.clock), seed) < 0)
         {
-            printf("\nBetter Luck Next Time :(\n");
-            printf("Game seq. : %s\n", game_sequence);
-            printf("Your input: %s\n", tmp);
-            
-            flesh_led();
-            
-            game = 0;
+            goto out;
         }
-        else
+        setup.record = &recorder;
+    }
+
+    if (simulated)
+    {
+        // Simulated board in the process, driven by the game clock
+        board_init(&board, game_clock_now(&session.clock));
+        board.seed = seed;
+
+        if (setup_board(&board, &setup) < 0)
         {
-            printf("\nNext level !!!\n\n");
+            printf("Error, simulated board not set up\n");
+            board_free(&board);
+            simulated = 0;
+            goto out;
         }
 
-        if (game == GAME_LENGTH - 1)
+        if (device_open_board(&session.device, &board, &session.clock) < 0)
         {
-            flesh_led();
-            flesh_led();
-            printf("\nYOU WON\n");
-            finish = 1;
+            board_free(&board);
+            simulated = 0;
+            goto out;
         }
-               
+    }
+    // Openning the driver, kept open for the whole game
+    else if (device_open(&session.device, path) < 0)
+    {
+        goto out;
     }
 
-}
-
-void flesh_led(void)
-{
-    // Openning the driver
-    file_desc = open("/dev/gpio_driver", O_RDWR);
+    session.device.record = setup.record;
 
-    if(file_desc < 0)
+    // One loop for the device, the keyboard and the deadlines
+    if (loop_init(&session.loop, &session.device, &session.clock, !virtual) < 0)
     {
-        printf("Error, 'gpio_driver' not opened\n");
-        return;
+        printf("Error, event loop not created: %s\n", strerror(errno));
+        device_close(&session.device);
+        goto out;
     }
 
-    // LED on/off
-    for (size_t i = 0; i < 2; i++)
+    // Keys without Enter: 1-4 press the buttons, q quits at once. Raw until the exit.
+    if (session.loop.stdin_fd >= 0 && keyboard_init() == 0)
     {
-        for (size_t i = 0; i < LED_NUM; i++)
-        {
-            strcpy(tmp, led_on[i]);
-            ret_val = write(file_desc, tmp, BUF_LEN);
-        }
-
-        sleep(TIME_DELAY);  
-              
-        for (size_t i = 0; i < LED_NUM; i++)
-        {
-            strcpy(tmp, led_off[i]);
-            ret_val = write(file_desc, tmp, BUF_LEN);
-        }
-        
-        sleep(TIME_DELAY); 
+        printf("Keys 1-%d press the buttons, q quits\n", BOARD_BUTTONS);
     }
 
-    // Closing driver
-    close(file_desc);
+    // Staring Simon Game
+    engine_run(&session);
 
-    // Reset memory
-    memset(tmp, 0, BUF_LEN);
-}
+    printf("THE END\n");
+    printf("gg\n");
 
-void* _finish_ (void *pParam)
-{
-    char c;
-    while(1)
+    dump_requested = 0;
+    engine_print_timing(&session, stdout);
+
+    if (device_play_stats(&session.device, &play_stats) == 0 && play_stats.deadlines)
     {
-        // Getting user input from keybord
-        c = getch();
+        printf("Playback: %llu step deadlines, overshoot avg %.1f us, max %.1f us\n",
+               (unsigned long long) play_stats.deadlines,
+               play_stats.late_ns_total / 1e3 / play_stats.deadlines, play_stats.late_ns_max / 1e3);
+    }
 
-        if (c == 'q' || c == 'Q' || finish)
+    // The driver's own ISR counters, since loading or the last debugfs reset. A
+    // simulated board has no interrupt handler, gpio_sim counts but does not time it.
+    if (!simulated && device_stats(&session.device, &stats) == 0 && stats.irq_count)
+    {
+        if (stats.isr_ns_total)
         {
-            // Finish game
-            finish = 1;
-            
-            break;
+            printf("IRQ: %llu interrupts, ISR avg %.1f us, max %.1f us, %u overruns\n",
+                   (unsigned long long) stats.irq_count, stats.isr_ns_total / 1e3 / stats.irq_count,
+                   stats.isr_ns_max / 1e3, stats.overruns);
+        }
+        else
+        {
+            printf("IRQ: %llu interrupts, ISR time not measured, %u overruns\n",
+                   (unsigned long long) stats.irq_count, stats.overruns);
         }
     }
-    return 0;
-}
-
-int main()
-{
-    // Seeding the random number gen.
-    srand((unsigned) time(NULL));
-    pthread_t pFinish;
 
-    // Creating a thread
-    pthread_create(&pFinish, NULL, _finish_, 0);
+    // Closing driver
+    loop_close(&session.loop);
+    device_close(&session.device);
 
-    printf("##############################\n");
-    printf("\tSimon Game\n");
-    printf("##############################\n");
+    if (replay_path)
+    {
+        printf("Replay: %zu of %zu records, LED changes %u as recorded, %u diverged\n",
+               board.replay_pos, replay.count, board.replay_matched, board.replay_diverged);
+    }
 
-    // Fleshing LED for Start
-    flesh_led();
+    if (simulated)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &wall_end);
+        printf("Games: %ld won, %ld lost, %ld errors, game time %.1f s, wall time %.3f s\n",
+               session.games_won, session.games_lost, session.errors, (game_clock_now(&session.clock) - game_start) / 1e9,
+               (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9);
+        board_free(&board);
+    }
+    else
+    {
+        printf("Games: %ld won, %ld lost, %ld errors\n", session.games_won, session.games_lost, session.errors);
+    }
 
-    // Staring Simon Game
-    _simon_game_();
+    ret = 0;
 
-    pthread_join(pFinish, NULL);
+out:
+    if (setup.record)
+    {
+        trace_close(&recorder);
+    }
 
-    flesh_led();
-    printf("THE END\n");
-    printf("gg\n");
+    if (replay_path)
+    {
+        trace_free(&replay);
+    }
+    board_free(&setup.script);
 
-    return 0;
+    return ret;
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#include "rng.h"
+
+static uint64_t rng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * splitmix64 finalizer: spreads the bits of x over the whole result, so
+ * consecutive seeds give unrelated states.
+ */
+uint64_t rng_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+/* Seeds the state from a single number with splitmix64, never all zero. */
+void rng_seed(struct rng *rng, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        seed += 0x9e3779b97f4a7c15ULL;
+        rng->s[i] = rng_mix(seed);
+    }
+}
+
+uint64_t rng_next(struct rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+
+    return result;
+}
+
+/* Uniform number in [0, n), from the high bits without a division. */
+uint32_t rng_below(struct rng *rng, uint32_t n)
+{
+    return (uint32_t) (((rng_next(rng) >> 32) * n) >> 32);
+}
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "runner.h"
+#include "rng.h"
+
+/*
+ * Sessions queued on a worker. The owner takes them from the tail, the
+ * thieves from the head, so both ends are only contended when a single
+ * session is left. No session is queued after the start, a queue only
+ * shrinks.
+ */
+struct runner_queue
+{
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t head;
+    size_t tail;
+};
+
+struct runner_worker
+{
+    pthread_t thread;
+    const struct runner_config *config;
+    struct runner_worker *workers; // All workers, the victims of the steals
+    unsigned int id;
+    struct runner_queue queue;
+    struct rng rng;         // Victim choice
+    struct runner_result result;
+};
+
+static void runner_result_init(struct runner_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    histogram_init(&result->reaction_hist, "reaction");
+    histogram_init(&result->interval_hist, "interval");
+    histogram_init(&result->turn_hist, "turn");
+}
+
+static void runner_result_add(struct runner_result *dst, const struct runner_result *src)
+{
+    dst->sessions += src->sessions;
+    dst->games_won += src->games_won;
+    dst->games_lost += src->games_lost;
+    dst->errors += src->errors;
+    dst->game_ns += src->game_ns;
+    dst->steals += src->steals;
+
+    histogram_merge(&dst->reaction_hist, &src->reaction_hist);
+    histogram_merge(&dst->interval_hist, &src->interval_hist);
+    histogram_merge(&dst->turn_hist, &src->turn_hist);
+}
+
+/* Takes the newest session of the own queue. Returns 0 or -1 if it is empty. */
+static int runner_pop(struct runner_queue *queue, size_t *item)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail != queue->head)
+    {
+        *item = queue->items[--queue->tail];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+/* Takes the oldest session of another queue. Returns 0 or -1 if it is empty. */
+static int runner_steal(struct runner_queue *queue, size_t *item)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail != queue->head)
+    {
+        *item = queue->items[queue->head++];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+/*
+ * Finds a session for the worker: its own first, then one stolen from the
+ * workers in a random order. Returns 0 or -1 once all queues are empty.
+ */
+static int runner_next(struct runner_worker *w, size_t *item)
+{
+    unsigned int threads = w->config->threads;
+    unsigned int first;
+
+    if (runner_pop(&w->queue, item) == 0)
+    {
+        return 0;
+    }
+
+    first = rng_below(&w->rng, threads);
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        struct runner_worker *victim = &w->workers[(first + i) % threads];
+
+        if (victim != w && runner_steal(&victim->queue, item) == 0)
+        {
+            w->result.steals++;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Plays session 'index' to its end on a fresh simulated board and adds
+ * its outcome to the results of the worker. Returns 0 or -1 on error.
+ */
+static int runner_session(struct runner_worker *w, size_t index)
+{
+    const struct runner_config *config = w->config;
+    struct runner_result *result = &w->result;
+    uint64_t seed = rng_mix(config->seed + index);
+    struct engine_session *s;
+    struct board *b;
+    int ret = -1;
+
+    // Both are too big for the stack of a worker
+    s = malloc(sizeof(*s));
+    b = malloc(sizeof(*b));
+    if (!s || !b)
+    {
+        goto out;
+    }
+
+    engine_init(s, config->engine, seed, 1);
+    board_init(b, game_clock_now(&s->clock));
+    b->seed = seed >> 32;
+
+    if ((config->setup_board && config->setup_board(b, config->arg) < 0)
+        || device_open_board(&s->device, b, &s->clock) < 0)
+    {
+        board_free(b);
+        goto out;
+    }
+
+    if (loop_init(&s->loop, &s->device, &s->clock, 0) == 0)
+    {
+        engine_run(s);
+        loop_close(&s->loop);
+
+        result->sessions++;
+        result->games_won += s->games_won;
+        result->games_lost += s->games_lost;
+        result->errors += s->errors;
+        result->game_ns += game_clock_now(&s->clock);
+        histogram_merge(&result->reaction_hist, &s->reaction_hist);
+        histogram_merge(&result->interval_hist, &s->interval_hist);
+        histogram_merge(&result->turn_hist, &s->turn_hist);
+        ret = 0;
+    }
+
+    device_close(&s->device);
+    board_free(b);
+
+out:
+    if (ret < 0)
+    {
+        result->errors++;
+    }
+    free(b);
+    free(s);
+
+    return ret;
+}
+
+static void *runner_worker_main(void *arg)
+{
+    struct runner_worker *w = arg;
+    size_t index;
+
+    while (runner_next(w, &index) == 0)
+    {
+        runner_session(w, index);
+    }
+
+    return NULL;
+}
+
+/*
+ * Plays config->sessions sessions on config->threads workers and sums up
+ * their outcome in 'result'. Session i is queued on worker i % threads.
+ * Returns 0 or -1 if the workers could not be started.
+ */
+int runner_run(const struct runner_config *config, struct runner_result *result)
+{
+    unsigned int threads = config->threads ? config->threads : 1;
+    struct runner_config run = *config;
+    struct runner_worker *workers;
+    unsigned int started = 0;
+    int ret = 0;
+
+    run.threads = threads;
+    runner_result_init(result);
+
+    workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+    {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        struct runner_worker *w = &workers[i];
+
+        w->config = &run;
+        w->workers = workers;
+        w->id = i;
+        rng_seed(&w->rng, config->seed ^ rng_mix(i + 1));
+        runner_result_init(&w->result);
+        pthread_mutex_init(&w->queue.lock, NULL);
+
+        w->queue.items = malloc((config->sessions / threads + 1) * sizeof(size_t));
+        if (!w->queue.items)
+        {
+            ret = -1;
+            goto out;
+        }
+
+        for (size_t index = i; index < config->sessions; index += threads)
+        {
+            w->queue.items[w->queue.tail++] = index;
+        }
+    }
+
+    for (started = 0; started < threads; started++)
+    {
+        if (pthread_create(&workers[started].thread, NULL, runner_worker_main, &workers[started]) != 0)
+        {
+            // The started workers steal the sessions of the missing ones
+            ret = started ? 0 : -1;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        runner_result_add(result, &workers[i].result);
+    }
+
+out:
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        pthread_mutex_destroy(&workers[i].queue.lock);
+        free(workers[i].queue.items);
+    }
+    free(workers);
+
+    return ret;
+}